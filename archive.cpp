@@ -0,0 +1,432 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "logging.h"
+#include "format.h"
+#include "archive.h"
+
+static size_t round_up(size_t val, size_t align)
+{
+    return ((val + align - 1) / align) * align;
+}
+
+static bool pwrite_all(int fd, const void * buf, size_t len, off_t offset)
+{
+    const uint8_t * p = reinterpret_cast<const uint8_t *>(buf);
+
+    while(len > 0) {
+        const ssize_t ret = pwrite(fd, p, len, offset);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+ArchiveWriter::ArchiveWriter()
+{
+    memset(&m_header, 0, sizeof(m_header));
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    close();
+}
+
+/**
+ * Create the archive and write its header
+ *
+ * @param[in] path File to create, truncated if it exists
+ * @param[in] fmt Format of the frames that will be appended
+ *
+ * @return true on success
+ */
+bool ArchiveWriter::open(const std::string & path, const BaseFormat & fmt)
+{
+    struct iovec iov[2];
+    unsigned p;
+
+    close();
+    memset(&m_header, 0, sizeof(m_header));
+    memcpy(m_header.magic, ARCHIVE_MAGIC, sizeof(m_header.magic));
+    m_header.version = ARCHIVE_VERSION;
+    m_header.header_size = ARCHIVE_ALIGN;
+    m_header.pixelformat = fmt.pix_fmt();
+    m_header.width = fmt.width();
+    m_header.height = fmt.height();
+    m_header.bytesperline = fmt.bytesperline();
+    m_header.sizeimage = fmt.image_size();
+    m_header.num_planes = fmt.num_planes();
+    for(p = 0; p < fmt.num_planes(); p++) {
+        m_header.plane_bytesperline[p] = fmt.plane_bytesperline(p);
+        m_header.plane_size[p] = fmt.plane_size(p);
+    }
+
+    /* The Recorder drops a frame it has no room for, so stage enough for a
+     * few whole slots of the largest frame as well as the writes in flight */
+    size_t frame_bytes = 0;
+    for(p = 0; p < fmt.num_planes(); p++) {
+        frame_bytes += fmt.plane_size(p);
+    }
+    if(frame_bytes < fmt.image_size()) {
+        frame_bytes = fmt.image_size();
+    }
+    const size_t slot_size = round_up(ARCHIVE_RECORD_SIZE + frame_bytes, ARCHIVE_ALIGN);
+    const size_t chunks = (ARCHIVE_SLOTS_STAGED * slot_size + Recorder::CHUNK_SIZE - 1)
+            / Recorder::CHUNK_SIZE + 1;
+    if(!m_rec.open(path, Recorder::CHUNK_SIZE,
+            chunks > Recorder::NUM_CHUNKS ? chunks : Recorder::NUM_CHUNKS)) {
+        return false;
+    }
+    iov[0].iov_base = &m_header;
+    iov[0].iov_len = sizeof(m_header);
+    iov[1].iov_base = NULL;
+    iov[1].iov_len = ARCHIVE_ALIGN - sizeof(m_header);
+    if(!m_rec.write_frame(iov, 2)) {
+        m_rec.close();
+        return false;
+    }
+    m_path = path;
+    m_index.clear();
+    LOG_INFO("Archiving %s %ux%u to %s", fmt.pix_fmt_str().c_str(),
+            fmt.width(), fmt.height(), path.c_str());
+    return true;
+}
+
+/**
+ * Add a frame to the end of the archive, without waiting for the disk
+ *
+ * @param[in] data The frame
+ * @param[in] len Its length in bytes
+ * @param[in] meta Its sequence number, timestamp and flags
+ *
+ * @return false if the frame was dropped
+ */
+bool ArchiveWriter::append(const uint8_t * data, size_t len, const FrameMeta & meta)
+{
+    struct iovec piece;
+
+    piece.iov_base = const_cast<uint8_t *>(data);
+    piece.iov_len = len;
+    return append(&piece, 1, meta);
+}
+
+/**
+ * Add a frame that is in several pieces, such as a JPEG with tables put
+ * back in, as one record
+ *
+ * @param[in] pieces The frame, at most MAX_PIECES of them
+ * @param[in] num_pieces How many
+ * @param[in] meta Its sequence number, timestamp and flags
+ *
+ * @return false if the frame was dropped
+ */
+bool ArchiveWriter::append(const struct iovec * pieces, unsigned num_pieces,
+        const FrameMeta & meta)
+{
+    ArchiveRecord rec;
+    struct iovec iov[MAX_PIECES + 3];
+    size_t len = 0;
+    unsigned i;
+
+    if(m_path.empty() || (num_pieces > MAX_PIECES)) {
+        return false;
+    }
+    for(i = 0; i < num_pieces; i++) {
+        len += pieces[i].iov_len;
+    }
+    const uint64_t start = m_rec.length();
+    const size_t slot_size = round_up(ARCHIVE_RECORD_SIZE + len, ARCHIVE_ALIGN);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = ARCHIVE_RECORD_MAGIC;
+    rec.slot_size = slot_size;
+    rec.entry.offset = start + ARCHIVE_RECORD_SIZE;
+    rec.entry.timestamp_ns = meta.timestamp_ns;
+    rec.entry.size = len;
+    rec.entry.sequence = meta.sequence;
+    rec.entry.flags = meta.flags;
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = NULL;
+    iov[1].iov_len = ARCHIVE_RECORD_SIZE - sizeof(rec);
+    for(i = 0; i < num_pieces; i++) {
+        iov[i + 2] = pieces[i];
+    }
+    iov[i + 2].iov_base = NULL;
+    iov[i + 2].iov_len = slot_size - ARCHIVE_RECORD_SIZE - len;
+    if(!m_rec.write_frame(iov, num_pieces + 3)) {
+        return false;
+    }
+    m_index.push_back(rec.entry);
+    return true;
+}
+
+/**
+ * Wait for the frames to reach the disk, then write the index after them
+ * and point the header at it
+ *
+ * @return true if the archive is complete
+ */
+bool ArchiveWriter::close()
+{
+    if(m_path.empty()) {
+        return true;
+    }
+    bool ok = m_rec.close();
+    const uint64_t index_offset = m_rec.length();
+
+    const int fd = ::open(m_path.c_str(), O_WRONLY | O_CLOEXEC);
+    if(fd < 0) {
+        LOG_ERRNO_AS_ERROR("Reopen %s failed", m_path.c_str());
+        m_path.clear();
+        return false;
+    }
+    m_header.num_frames = m_index.size();
+    m_header.index_offset = index_offset;
+    if(!m_index.empty() && !pwrite_all(fd, &m_index[0],
+                m_index.size() * sizeof(ArchiveIndex), index_offset)) {
+        LOG_ERRNO_AS_ERROR("Failed to write archive index");
+        ok = false;
+    }
+    /* Header last, a crash before here leaves the records to rebuild from */
+    else if((fdatasync(fd) == -1)
+            || !pwrite_all(fd, &m_header, sizeof(m_header), 0)) {
+        LOG_ERRNO_AS_ERROR("Failed to write archive header");
+        ok = false;
+    }
+    ::close(fd);
+    LOG_INFO("Archived %llu frames to %s", (unsigned long long) m_index.size(),
+            m_path.c_str());
+    m_path.clear();
+    m_index.clear();
+    return ok;
+}
+
+ArchiveReader::ArchiveReader()
+    : m_fd(-1), m_map(0), m_size(0), m_header(0), m_index(0), m_num_frames(0)
+{
+}
+
+ArchiveReader::~ArchiveReader()
+{
+    close();
+}
+
+/**
+ * Map an archive
+ *
+ * @param[in] path The archive
+ *
+ * @return true on success
+ */
+bool ArchiveReader::open(const std::string & path)
+{
+    struct stat st;
+
+    close();
+    m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(m_fd < 0) {
+        LOG_ERRNO_AS_ERROR("Open %s failed", path.c_str());
+        return false;
+    }
+    if((fstat(m_fd, &st) == -1) || (st.st_size < ARCHIVE_ALIGN)) {
+        LOG_ERROR("%s is too small to be an archive", path.c_str());
+        close();
+        return false;
+    }
+    m_size = st.st_size;
+    void * map = mmap(NULL, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+    if(map == MAP_FAILED) {
+        LOG_ERRNO_AS_ERROR("Failed to map %s", path.c_str());
+        m_size = 0;
+        close();
+        return false;
+    }
+    m_map = reinterpret_cast<const uint8_t *>(map);
+    m_header = reinterpret_cast<const ArchiveHeader *>(m_map);
+
+    if((memcmp(m_header->magic, ARCHIVE_MAGIC, sizeof(m_header->magic)) != 0)
+            || (m_header->version != ARCHIVE_VERSION)
+            || (m_header->header_size < sizeof(ArchiveHeader))
+            || (m_header->num_planes > VIDEO_MAX_PLANES)) {
+        LOG_ERROR("%s is not a version %i archive", path.c_str(), ARCHIVE_VERSION);
+        close();
+        return false;
+    }
+
+    const uint64_t index_offset = m_header->index_offset;
+    const uint64_t num_frames = m_header->num_frames;
+    if((index_offset >= m_header->header_size) && (index_offset <= m_size)
+            && (num_frames <= (m_size - index_offset) / sizeof(ArchiveIndex))) {
+        m_index = reinterpret_cast<const ArchiveIndex *>(m_map + index_offset);
+        m_num_frames = num_frames;
+        if(index_valid()) {
+            return true;
+        }
+        LOG_WARN("%s has frames past its end in the index", path.c_str());
+    }
+    if(!rebuild_index()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @return true if every frame the index points at is inside the file, so
+ * frame() never hands out a pointer past the end of the mapping
+ */
+bool ArchiveReader::index_valid() const
+{
+    uint64_t n;
+
+    for(n = 0; n < m_num_frames; n++) {
+        const ArchiveIndex & entry = m_index[n];
+        if((entry.offset < m_header->header_size + ARCHIVE_RECORD_SIZE)
+                || (entry.offset > m_size) || (entry.size > m_size - entry.offset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * The writer never got to close() or the index is damaged, recover what
+ * frames made it to disk by walking the records
+ */
+bool ArchiveReader::rebuild_index()
+{
+    uint64_t offset = m_header->header_size;
+
+    m_rebuilt.clear();
+    while(offset + ARCHIVE_RECORD_SIZE <= m_size) {
+        const ArchiveRecord * rec = reinterpret_cast<const ArchiveRecord *>(m_map + offset);
+        if((rec->magic != ARCHIVE_RECORD_MAGIC)
+                || (rec->slot_size < ARCHIVE_RECORD_SIZE)
+                || (rec->entry.offset != offset + ARCHIVE_RECORD_SIZE)
+                || (rec->entry.offset + rec->entry.size > m_size)) {
+            break;
+        }
+        m_rebuilt.push_back(rec->entry);
+        offset += rec->slot_size;
+    }
+    LOG_WARN("Archive index missing or bad, recovered %zu frames", m_rebuilt.size());
+    m_index = m_rebuilt.empty() ? NULL : &m_rebuilt[0];
+    m_num_frames = m_rebuilt.size();
+    return true;
+}
+
+void ArchiveReader::close()
+{
+    if(m_map) {
+        munmap(const_cast<uint8_t *>(m_map), m_size);
+        m_map = 0;
+    }
+    if(m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    m_size = 0;
+    m_header = 0;
+    m_index = 0;
+    m_num_frames = 0;
+    m_rebuilt.clear();
+}
+
+/**
+ * Create a format object describing the archived frames
+ *
+ * @return The object, the caller deletes it, or NULL if the pixel format
+ * is not one we support
+ */
+BaseFormat * ArchiveReader::create_format() const
+{
+    BaseFormat * fmt = create_format_obj(m_header->pixelformat);
+    if(!fmt) {
+        return NULL;
+    }
+    if(m_header->num_planes > 1) {
+        fmt->init_planes(m_header->width, m_header->height, m_header->num_planes,
+                m_header->plane_bytesperline, m_header->plane_size);
+    }
+    else {
+        fmt->init(m_header->width, m_header->height, m_header->bytesperline,
+                m_header->sizeimage);
+    }
+    return fmt;
+}
+
+/**
+ * @param[in] n Frame number
+ *
+ * @return The frame, in place in the mapping, or NULL if n is out of range
+ */
+const uint8_t * ArchiveReader::frame(uint64_t n) const
+{
+    if(n >= m_num_frames) {
+        return NULL;
+    }
+    return m_map + m_index[n].offset;
+}
+
+/**
+ * @param[in] n Frame number
+ * @param[in] plane Plane of a multi-planar frame
+ *
+ * @return The start of the plane, in place in the mapping, or NULL if n or
+ * plane is out of range or the frame is too short to hold it
+ */
+const uint8_t * ArchiveReader::frame_plane(uint64_t n, unsigned plane) const
+{
+    uint64_t offset = 0;
+    unsigned p;
+
+    if((n >= m_num_frames) || (plane >= m_header->num_planes)) {
+        return NULL;
+    }
+    for(p = 0; p < plane; p++) {
+        offset += m_header->plane_size[p];
+    }
+    if(offset + m_header->plane_size[plane] > m_index[n].size) {
+        return NULL;
+    }
+    return m_map + m_index[n].offset + offset;
+}
+
+static bool timestamp_less(const ArchiveIndex & entry, uint64_t timestamp_ns)
+{
+    return entry.timestamp_ns < timestamp_ns;
+}
+
+/**
+ * Binary search for a timestamp, frames are appended in capture order so
+ * their timestamps only go up
+ *
+ * @param[in] timestamp_ns Time of interest
+ *
+ * @return The first frame at or after that time, or -1 if all are before it
+ */
+int64_t ArchiveReader::find(uint64_t timestamp_ns) const
+{
+    const ArchiveIndex * end = m_index + m_num_frames;
+    const ArchiveIndex * p = std::lower_bound(m_index, end, timestamp_ns,
+            timestamp_less);
+    if(p == end) {
+        return -1;
+    }
+    return p - m_index;
+}
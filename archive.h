@@ -0,0 +1,137 @@
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/videodev2.h>
+
+#include "frame.h"
+#include "recorder.h"
+
+class BaseFormat;
+
+/**
+ * On disk layout of a frame archive, all little endian as written by the
+ * host:
+ *
+ *   ArchiveHeader, padded to ARCHIVE_ALIGN
+ *   per frame: ArchiveRecord padded to ARCHIVE_RECORD_SIZE, then the frame
+ *              data, the whole padded to ARCHIVE_ALIGN. A frame with
+ *              num_planes > 1 is its planes back to back, each plane_size.
+ *   ArchiveIndex[num_frames], written by close()
+ *
+ * Each record starts on a page and its frame on the following cache line,
+ * so frames can be used straight out of an mmap. The record duplicates the
+ * frame's index entry, so an archive whose writer died before close() can
+ * still be indexed by walking the records.
+ */
+#define ARCHIVE_MAGIC "SNAPARC1"
+#define ARCHIVE_VERSION (1)
+#define ARCHIVE_ALIGN (4096)
+#define ARCHIVE_RECORD_SIZE (64)
+#define ARCHIVE_RECORD_MAGIC (0x4d415246)    /* "FRAM" */
+#define ARCHIVE_SLOTS_STAGED (3)    /* Frames the writer can hold in memory */
+
+struct ArchiveHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t pixelformat;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytesperline;
+    uint32_t sizeimage;
+    uint32_t num_planes;
+    uint32_t plane_bytesperline[VIDEO_MAX_PLANES];
+    uint32_t plane_size[VIDEO_MAX_PLANES];
+    uint64_t num_frames;
+    uint64_t index_offset;
+};
+
+struct ArchiveIndex
+{
+    uint64_t offset;            /* of the frame data, not its record */
+    uint64_t timestamp_ns;
+    uint32_t size;
+    uint32_t sequence;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct ArchiveRecord
+{
+    uint32_t magic;
+    uint32_t slot_size;         /* record, frame and padding */
+    ArchiveIndex entry;
+};
+
+/**
+ * Appends frames to an archive at capture rate, the writes go through a
+ * Recorder so they are asynchronous and a frame the disk cannot keep up
+ * with is dropped whole. The index is kept in memory and written on close.
+ */
+class ArchiveWriter
+{
+private:
+    std::string m_path;
+    Recorder m_rec;
+    ArchiveHeader m_header;
+    std::vector<ArchiveIndex> m_index;
+
+public:
+    /* Most pieces a frame can be appended in, one per plane */
+    static const unsigned MAX_PIECES = VIDEO_MAX_PLANES;
+
+    ArchiveWriter();
+    ~ArchiveWriter();
+
+    bool open(const std::string & path, const BaseFormat & fmt);
+    bool append(const uint8_t * data, size_t len, const FrameMeta & meta);
+    bool append(const struct iovec * pieces, unsigned num_pieces, const FrameMeta & meta);
+    bool close();
+
+    uint64_t num_frames() const {return m_index.size();};
+    uint64_t dropped() const {return m_rec.dropped();};
+};
+
+/**
+ * Random access to an archive through a read only mmap. Frames are
+ * returned as pointers into the mapping, nothing is copied.
+ */
+class ArchiveReader
+{
+private:
+    int m_fd;
+    const uint8_t * m_map;
+    size_t m_size;
+    const ArchiveHeader * m_header;
+    const ArchiveIndex * m_index;
+    uint64_t m_num_frames;
+    std::vector<ArchiveIndex> m_rebuilt;
+
+    bool rebuild_index();
+    bool index_valid() const;
+
+public:
+    ArchiveReader();
+    ~ArchiveReader();
+
+    bool open(const std::string & path);
+    void close();
+
+    uint64_t num_frames() const {return m_num_frames;};
+    const ArchiveHeader & header() const {return *m_header;};
+    BaseFormat * create_format() const;
+
+    const ArchiveIndex & entry(uint64_t n) const {return m_index[n];};
+    const uint8_t * frame(uint64_t n) const;
+    const uint8_t * frame_plane(uint64_t n, unsigned plane) const;
+    int64_t find(uint64_t timestamp_ns) const;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "logging.h"
+#include "arena.h"
+
+#define CACHE_LINE_SIZE (64)
+
+static size_t round_up(size_t val, size_t align)
+{
+    return ((val + align - 1) / align) * align;
+}
+
+FrameArena::FrameArena()
+    : m_base(0), m_size(0), m_frame_size(0), m_num_frames(0), m_huge(false)
+{
+}
+
+FrameArena::~FrameArena()
+{
+    release();
+}
+
+/**
+ * Allocate the arena
+ *
+ * @param[in] num_frames Number of frame slots
+ * @param[in] frame_bytes Minimum size of each slot, rounded up to a page
+ * @param[in] huge_pages Try for 2MB huge pages, falls back to transparent
+ *            huge pages if none are reserved
+ *
+ * @return true on success
+ */
+bool FrameArena::allocate(unsigned num_frames, size_t frame_bytes, bool huge_pages)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    void * base = MAP_FAILED;
+
+    release();
+    if(page_size < CACHE_LINE_SIZE) {
+        page_size = CACHE_LINE_SIZE;
+    }
+    m_frame_size = round_up(frame_bytes, page_size);
+    m_size = m_frame_size * num_frames;
+
+    if(huge_pages) {
+        m_size = round_up(m_size, HUGE_PAGE_SIZE);
+        base = mmap(NULL, m_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(base == MAP_FAILED) {
+            LOG_WARN("No hugetlb pages for %zu bytes, using THP", m_size);
+        }
+        else {
+            m_huge = true;
+        }
+    }
+    if(base == MAP_FAILED) {
+        base = mmap(NULL, m_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(base == MAP_FAILED) {
+            LOG_ERRNO_AS_ERROR("Failed to map frame arena");
+            m_size = 0;
+            return false;
+        }
+        if(huge_pages && (madvise(base, m_size, MADV_HUGEPAGE) == -1)) {
+            LOG_WARN("MADV_HUGEPAGE not supported");
+        }
+    }
+    m_base = reinterpret_cast<uint8_t *>(base);
+    m_num_frames = num_frames;
+    LOG_INFO("Frame arena %p, %u x %zu bytes%s", m_base, m_num_frames,
+            m_frame_size, m_huge ? " (hugetlb)" : "");
+    return true;
+}
+
+/**
+ * Give the memory back, any buffers using it must already be released by
+ * the driver
+ */
+void FrameArena::release()
+{
+    if(m_base) {
+        munmap(m_base, m_size);
+        m_base = 0;
+    }
+    m_size = 0;
+    m_num_frames = 0;
+    m_huge = false;
+}
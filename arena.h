@@ -0,0 +1,38 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * One contiguous block of memory carved up into equal, page aligned frame
+ * slots. Used as the destination for V4L2_MEMORY_USERPTR capture so that
+ * frames land where the application wants them. Optionally backed by 2MB
+ * huge pages to cut TLB misses on high resolution streams.
+ */
+class FrameArena
+{
+private:
+    uint8_t * m_base;
+    size_t m_size;
+    size_t m_frame_size;
+    unsigned m_num_frames;
+    bool m_huge;
+
+public:
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    FrameArena();
+    ~FrameArena();
+
+    bool allocate(unsigned num_frames, size_t frame_bytes, bool huge_pages);
+    void release();
+
+    uint8_t * frame(unsigned n) const {return m_base + n * m_frame_size;};
+    size_t frame_size() const {return m_frame_size;};
+    unsigned num_frames() const {return m_num_frames;};
+    bool huge_pages() const {return m_huge;};
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "logging.h"
+#include "capture.h"
+#include "bufpool.h"
+
+#define DEFAULT_STEP (2)
+#define DEFAULT_IDLE_FRAMES (300)
+
+/**
+ * @param[in] cam The camera whose buffers to manage
+ * @param[in] min_bufs Never go below this
+ * @param[in] max_bufs Never go above this (capped at VIDEO_MAX_FRAME)
+ */
+BufferPool::BufferPool(Camera & cam, unsigned min_bufs, unsigned max_bufs)
+    : m_cam(cam), m_min(min_bufs), m_max(max_bufs), m_step(DEFAULT_STEP),
+      m_idle_frames(DEFAULT_IDLE_FRAMES), m_active(0), m_calm(0),
+      m_to_retire(0), m_last_dropped(0)
+{
+    if(m_min < 2) {
+        m_min = 2;
+    }
+    if(m_max > VIDEO_MAX_FRAME) {
+        m_max = VIDEO_MAX_FRAME;
+    }
+    if(m_max < m_min) {
+        m_max = m_min;
+    }
+}
+
+/**
+ * Request the minimum number of buffers and queue them all, call before
+ * enabling capture
+ *
+ * @return Number of buffers
+ */
+int BufferPool::start()
+{
+    int i;
+    const int n = m_cam.request_buffers(m_min);
+    for(i = 0; i < n; i++) {
+        m_cam.queue_buffer(i);
+    }
+    m_active = n;
+    m_parked.clear();
+    m_to_retire = 0;
+    m_calm = 0;
+    m_last_dropped = m_cam.stats().dropped();
+    return n;
+}
+
+/**
+ * Add up to m_step buffers to circulation, parked ones first
+ */
+void BufferPool::grow()
+{
+    unsigned added = 0;
+
+    /* Cancel any pending shrink first, that is free */
+    if(m_to_retire > 0) {
+        m_to_retire = 0;
+        return;
+    }
+    while((added < m_step) && (m_active < m_max) && !m_parked.empty()) {
+        m_cam.queue_buffer(m_parked.back());
+        m_parked.pop_back();
+        m_active++;
+        added++;
+    }
+    if((added < m_step) && (m_active < m_max)) {
+        int first;
+        int i;
+        unsigned want = m_step - added;
+        if(want > m_max - m_active) {
+            want = m_max - m_active;
+        }
+        const int n = m_cam.create_buffers(want, first);
+        for(i = first; i < first + n; i++) {
+            m_cam.queue_buffer(i);
+        }
+        m_active += n;
+        added += n;
+    }
+    if(added) {
+        LOG_INFO("Buffer pool grown to %u", m_active);
+    }
+}
+
+/**
+ * Look at a freshly dequeued frame for signs of backpressure
+ */
+void BufferPool::update(const FrameMeta & meta)
+{
+    (void) meta;
+    const uint64_t dropped = m_cam.stats().dropped();
+
+    /* The driver dropped frames, or we just took its last buffer */
+    if((dropped != m_last_dropped) || (m_cam.num_queued() == 0)) {
+        m_last_dropped = dropped;
+        m_calm = 0;
+        grow();
+        return;
+    }
+
+    /* Calm means consumers are holding at most one buffer besides this */
+    if(static_cast<unsigned>(m_cam.num_queued()) + 2 >= m_active) {
+        if(++m_calm >= m_idle_frames) {
+            m_calm = 0;
+            if(m_active - m_to_retire > m_min) {
+                m_to_retire++;
+            }
+        }
+    }
+    else {
+        m_calm = 0;
+    }
+}
+
+/**
+ * Give a buffer back, it is requeued unless the pool is shrinking
+ */
+void BufferPool::release(int n)
+{
+    if(m_to_retire > 0) {
+        m_to_retire--;
+        m_active--;
+        if(!m_cam.remove_buffer(n)) {
+            m_parked.push_back(n);
+        }
+        LOG_INFO("Buffer pool shrunk to %u", m_active);
+        return;
+    }
+    m_cam.queue_buffer(n);
+}
@@ -0,0 +1,53 @@
+#ifndef _BUFPOOL_H_
+#define _BUFPOOL_H_
+
+#include <vector>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "frame.h"
+
+class Camera;
+
+/**
+ * Sizes a camera's buffer pool to the load. Starts with the minimum, grows
+ * (VIDIOC_CREATE_BUFS) when the driver drops frames or runs out of queued
+ * buffers, and after a long enough calm spell retires buffers again down
+ * to the minimum. Retired buffers are freed if the kernel supports it,
+ * otherwise parked and revived before any new ones are created.
+ *
+ * Call update() after every dequeue and give buffers back with release()
+ * rather than Camera::queue_buffer. Not thread safe, use it from the
+ * thread that owns the camera.
+ */
+class BufferPool
+{
+private:
+    Camera & m_cam;
+    unsigned m_min;
+    unsigned m_max;
+    unsigned m_step;
+    unsigned m_idle_frames;     /* Calm frames before shrinking by one */
+
+    unsigned m_active;          /* Buffers in circulation */
+    unsigned m_calm;
+    unsigned m_to_retire;
+    uint64_t m_last_dropped;
+    std::vector<int> m_parked;
+
+    void grow();
+
+public:
+    BufferPool(Camera & cam, unsigned min_bufs, unsigned max_bufs);
+
+    void set_step(unsigned step) {m_step = step;};
+    void set_idle_frames(unsigned frames) {m_idle_frames = frames;};
+
+    int start();
+    void update(const FrameMeta & meta);
+    void release(int n);
+    unsigned active() const {return m_active;};
+};
+
+#endif
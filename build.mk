@@ -1,18 +1,54 @@
-CFLAGS=-Wall -O3 -Wextra
+CFLAGS=-Wall -O3 -Wextra -pthread
+# Generic lambdas in the kernel pickers need C++14, the cache line aligned
+# TilePool shares need C++17 aligned new
+CXXFLAGS=-std=gnu++17
 
 CC=gcc -c
 CCC=g++ -c
 
 MAKEDEPEND=gcc -M $(CPPFLAGS)
-LINK=gcc $(LDFLAGS)
+LINK=gcc -pthread $(LDFLAGS)
 
-OBJS= capture.o logging.o debug.o main.o format.o control.o
+OBJS= capture.o logging.o debug.o main.o format.o control.o reactor.o arena.o stats.o pipeline.o bufpool.o negotiate.o profile.o discovery.o framesource.o replay.o uring.o recorder.o archive.o multicam.o luma.o colour.o pixkernel.o tiles.o thumbnail.o pnm.o mjpeg.o
 
 .PHONY: all
 all: capture
 
 capture: $(OBJS)
-	$(LINK) $(OBJS) -o $@ -lstdc++
+	$(LINK) $(OBJS) -o $@ -lstdc++ -lm
+
+# Equivalence checks of the kernels against their plain C references, each
+# test_xxx is built from tests/test_xxx.cpp and the objects it names
+TESTS= test_luma test_colour test_tiles test_thumbnail test_pnm test_mjpeg test_archive
+TEST_OBJS= $(TESTS:=.o)
+
+vpath %.cpp $(SRCDIR)/tests
+$(TEST_OBJS): CPPFLAGS += -I$(SRCDIR)
+
+test_luma: test_luma.o luma.o logging.o
+	$(LINK) $^ -o $@ -lstdc++ -lm
+
+test_colour: test_colour.o colour.o pixkernel.o format.o luma.o logging.o
+	$(LINK) $^ -o $@ -lstdc++ -lm
+
+test_tiles: test_tiles.o tiles.o thumbnail.o colour.o pixkernel.o format.o luma.o logging.o
+	$(LINK) $^ -o $@ -lstdc++ -lm
+
+test_thumbnail: test_thumbnail.o thumbnail.o tiles.o colour.o pixkernel.o format.o luma.o logging.o
+	$(LINK) $^ -o $@ -lstdc++ -lm
+
+test_pnm: test_pnm.o pnm.o tiles.o thumbnail.o colour.o pixkernel.o format.o luma.o logging.o
+	$(LINK) $^ -o $@ -lstdc++ -lm
+
+test_mjpeg: test_mjpeg.o mjpeg.o pnm.o tiles.o thumbnail.o colour.o pixkernel.o format.o luma.o logging.o
+	$(LINK) $^ -o $@ -lstdc++ -lm
+
+test_archive: test_archive.o archive.o recorder.o uring.o format.o luma.o logging.o
+	$(LINK) $^ -o $@ -lstdc++ -lm
+
+.PHONY: check
+check: $(TESTS)
+	@for t in $(TESTS); do ./$$t || exit 1; done
 
 
 %.o : %.c
@@ -23,10 +59,10 @@ capture: $(OBJS)
 	@mv $*.P $*.d
 
 %.o : %.cpp
-	$(CCC) $(CPPFLAGS) -MMD $(CFLAGS) -o $@ $<
+	$(CCC) $(CPPFLAGS) -MMD $(CFLAGS) $(CXXFLAGS) -o $@ $<
 	@cp $*.d $*.P
 	@sed -e 's/#.*//' -e 's/^[^:]*: *//' -e 's/ *\\$$//' -e '/^$$/ d' -e 's/$$/ :/' < $*.d >> $*.P
 	@rm -f $*.d
 	@mv $*.P $*.d
 
--include $(OBJS:.o=.d)
+-include $(OBJS:.o=.d) $(TEST_OBJS:.o=.d)
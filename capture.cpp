@@ -2,34 +2,35 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <linux/videodev2.h>
 #include <sys/mman.h>
-#include <exception>
 
 #include "logging.h"
 #include "debug.h"
 #include "capture.h"
 #include "format.h"
 #include "control.h"
+#include "arena.h"
 
 #define MAX_INPUTS (100)
 #define MAX_STANDARDS (100)
 #define MAX_FORMATS (100)
 
-class Camera_error : std::exception
-{
-};
-
 /**
  * Constructor a Camera object
  */
 Camera::Camera(std::string & devpath)
-    : m_fd(0), m_buf_type(0), m_formatObj(0),
-      m_buf_starts(0), m_buf_lengths(0), m_num_bufs(0), m_brightness(0),
-      m_contrast(0), m_input(-1)
+    : m_fd(0), m_buf_type(0), m_memory(V4L2_MEMORY_MMAP), m_formatObj(0),
+      m_bufs(0), m_num_bufs(0), m_num_queued(0), m_dmabufs(0), m_num_dmabufs(0),
+      m_arena(0), m_brightness(0),
+      m_contrast(0), m_input(-1), m_caps(0), m_nonblocking(false), m_streaming(false),
+      m_use_profile(false)
 {
+    m_interval.numerator = 0;
+    m_interval.denominator = 0;
 //    const int fd = open(devpath.c_str(), O_RDWR | O_NONBLOCK);
     const int fd = open(devpath.c_str(), O_RDWR);
     if(fd < 0) {
@@ -41,10 +42,37 @@ Camera::Camera(std::string & devpath)
 
 Camera::~Camera()
 {
+    release_dmabufs();
+    delete m_arena;
     delete m_formatObj;
     delete m_brightness;
 }
 
+/**
+ * Switch the device between blocking and non-blocking mode. In non-blocking
+ * mode wait_buffer_ready returns -1 rather than waiting for a buffer, which
+ * lets the caller multiplex several cameras with poll/epoll on fd().
+ *
+ * @param[in] enable True for non-blocking
+ *
+ * @return true on success
+ */
+bool Camera::set_nonblocking(bool enable)
+{
+    int flags = fcntl(m_fd, F_GETFL);
+    if(flags == -1) {
+        LOG_ERRNO_AS_ERROR("F_GETFL");
+        return false;
+    }
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if(fcntl(m_fd, F_SETFL, flags) == -1) {
+        LOG_ERRNO_AS_ERROR("F_SETFL");
+        return false;
+    }
+    m_nonblocking = enable;
+    return true;
+}
+
 /**
  * Initialisation
  *
@@ -53,6 +81,16 @@ Camera::~Camera()
 bool Camera::init()
 {        
     if(check_can_do_capture()) {
+        /* A saved profile lets us skip enumerating the device */
+        m_use_profile = m_profile.load();
+        if(m_use_profile) {
+            m_input = m_profile.input;
+            if(set_input()) {
+                return true;
+            }
+            LOG_WARN("Profile input %i no longer valid", m_input);
+            m_use_profile = false;
+        }
         if(find_suitable_input()) {
             if(set_input()) {
                 return true;
@@ -67,7 +105,7 @@ bool Camera::init()
  *
  * returns those capabilities
  */
-bool Camera::check_can_do_capture() const
+bool Camera::check_can_do_capture()
 {
     struct v4l2_capability cap;
     uint32_t caps;
@@ -82,6 +120,13 @@ bool Camera::check_can_do_capture() const
 
     LOG_INFO("%.16s, Card: %.32s, ver: 0x%x, bus: %.32s",
             cap.driver, cap.card, cap.version, cap.bus_info);
+    m_profile.driver.assign(reinterpret_cast<const char *>(cap.driver),
+            strnlen(reinterpret_cast<const char *>(cap.driver), sizeof(cap.driver)));
+    m_profile.bus_info.assign(reinterpret_cast<const char *>(cap.bus_info),
+            strnlen(reinterpret_cast<const char *>(cap.bus_info), sizeof(cap.bus_info)));
+    m_profile.version = cap.version;
+    m_card.assign(reinterpret_cast<const char *>(cap.card),
+            strnlen(reinterpret_cast<const char *>(cap.card), sizeof(cap.card)));
 
     caps = cap.capabilities;
     LOG_INFO("Card capabilites are 0x%X (%s)",
@@ -93,6 +138,8 @@ bool Camera::check_can_do_capture() const
             caps, cap2str(caps));
     }
 
+    m_caps = caps;
+
     if((caps & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE)) == 0) {
         LOG_ERROR("Cant do video capture");
         return false;
@@ -253,7 +300,16 @@ void Camera::check_controls()
     struct v4l2_queryctrl control;
     int i;
     uint32_t id = 0;
+
+    if(m_use_profile) {
+        const ControlDesc * desc = m_profile.find_control(V4L2_CID_BRIGHTNESS);
+        if(desc && !m_brightness) {
+            m_brightness = create_control(desc->id, desc->type);
+        }
+        return;
+    }
     LOG_DEBUG("Check controls");
+    m_profile.controls.clear();
     for(i = 0; i < 100; i++) {
         int retVal;
         int32_t value;
@@ -266,6 +322,14 @@ void Camera::check_controls()
             break;
         }
         id = control.id;
+        ControlDesc desc;
+        desc.id = id;
+        desc.type = control.type;
+        desc.minimum = control.minimum;
+        desc.maximum = control.maximum;
+        desc.step = control.step;
+        desc.default_value = control.default_value;
+        m_profile.controls.push_back(desc);
         LOG_INFO("Control 0x%X (%.24s)", id, control.name);
         LOG_INFO("Control type: %s", ctrlType2str(control.type));
 
@@ -357,6 +421,7 @@ bool Camera::find_suitable_input()
             m_input = input.index;
         }
     }
+    m_profile.input = m_input;
     return m_input >= 0 ? true : false;
 }
  
@@ -428,6 +493,10 @@ uint32_t Camera::find_suitable_format()
             LOG_INFO("Buffer type: %s", bufType2str(desc.type));
             LOG_INFO("Format %s", pixelfmt2str(desc.pixelformat));
             LOG_INFO("Fmt flags: 0x%x (%s)", desc.flags, fmtdescflag2str(desc.flags));
+            if(!format_supported(desc.pixelformat)) {
+                LOG_INFO("Not supported, skipping");
+                continue;
+            }
             m_buf_type = desc.type;
             return desc.pixelformat;
         }
@@ -438,7 +507,7 @@ uint32_t Camera::find_suitable_format()
 /**
  * Set Capture parameters
  */
-void Camera::set_capture_params() const
+void Camera::set_capture_params()
 {
     struct v4l2_streamparm params;
     struct v4l2_captureparm * capture = &params.parm.capture;
@@ -457,7 +526,77 @@ void Camera::set_capture_params() const
     LOG_INFO("Capture mode=0x%X (%s)",
             capture->capturemode, capcap2str(capture->capturemode));
     LOG_INFO("Read buffers=%i", capture->readbuffers);
-// struct v4l2_fract  timeperframe;  /*  Time per frame in seconds */
+    LOG_INFO("Time per frame=%u/%u", capture->timeperframe.numerator,
+            capture->timeperframe.denominator);
+
+    /* Apply any interval picked when the format was negotiated */
+    if(m_interval.numerator && m_interval.denominator) {
+        set_frame_interval(m_interval.numerator, m_interval.denominator);
+    }
+    else {
+        m_interval = capture->timeperframe;
+    }
+}
+
+/**
+ * Ask for a frame interval (time per frame, 1/30 for 30fps). May be called
+ * while streaming; drivers that refuse (EBUSY, e.g. uvcvideo) have the
+ * stream stopped, the interval set and the stream restarted with the same
+ * buffers queued.
+ *
+ * @param[in] numerator Seconds numerator
+ * @param[in] denominator Seconds denominator
+ *
+ * @return true if the driver took it, frame_interval() then says what was
+ * actually granted
+ */
+bool Camera::set_frame_interval(uint32_t numerator, uint32_t denominator)
+{
+    struct v4l2_streamparm params;
+    bool requeue[VIDEO_MAX_FRAME];
+    bool restarted = false;
+    int i;
+
+    memset(&params, 0, sizeof(params));
+    params.type = m_buf_type;
+    if(ioctl(m_fd, VIDIOC_G_PARM, &params) == -1) {
+        LOG_ERRNO_AS_ERROR("VIDIOC_G_PARM");
+        return false;
+    }
+    if((params.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) == 0) {
+        LOG_WARN("Device can't set the frame interval");
+        return false;
+    }
+    params.parm.capture.timeperframe.numerator = numerator;
+    params.parm.capture.timeperframe.denominator = denominator;
+
+    int status = ioctl(m_fd, VIDIOC_S_PARM, &params);
+    if((status == -1) && (errno == EBUSY) && m_streaming) {
+        LOG_INFO("Restarting stream to change the frame interval");
+        for(i = 0; i < m_num_bufs; i++) {
+            requeue[i] = m_bufs[i].queued;
+        }
+        disable_capture();
+        status = ioctl(m_fd, VIDIOC_S_PARM, &params);
+        restarted = true;
+    }
+    if(status == -1) {
+        LOG_ERRNO_AS_ERROR("VIDIOC_S_PARM");
+    }
+    else {
+        m_interval = params.parm.capture.timeperframe;
+        LOG_INFO("Time per frame asked %u/%u, got %u/%u", numerator, denominator,
+                m_interval.numerator, m_interval.denominator);
+    }
+    if(restarted) {
+        for(i = 0; i < m_num_bufs; i++) {
+            if(requeue[i]) {
+                queue_buffer(i);
+            }
+        }
+        enable_capture();
+    }
+    return status != -1;
 }
 
 static void print_capture_format(struct v4l2_pix_format * pix)
@@ -470,16 +609,33 @@ static void print_capture_format(struct v4l2_pix_format * pix)
     LOG_INFO("Image size %u", pix->sizeimage);
 }
 
+static void print_capture_format(struct v4l2_pix_format_mplane * pix)
+{
+    unsigned p;
+    LOG_INFO("Res = %u x %u", pix->width, pix->height);
+    LOG_INFO("Colorspace = %u (%s)", pix->colorspace, colorspace2str(pix->colorspace));
+    LOG_INFO("Format %s", pixelfmt2str(pix->pixelformat));
+    LOG_INFO("Field %u", pix->field);
+    LOG_INFO("Planes %u", pix->num_planes);
+    for(p = 0; p < pix->num_planes; p++) {
+        LOG_INFO("Plane %u, bytes per line %u, size %u", p,
+                pix->plane_fmt[p].bytesperline, pix->plane_fmt[p].sizeimage);
+    }
+}
+
 /**
  * Set the Format to that one previously selected by the call to
  * find_suitable_format
  *
+ * @param[in] pixelformat The V4L2_PIX_FMT_xxx
+ * @param[in] width Frame width, 0 to keep the current size
+ * @param[in] height Frame height
+ *
  * @return true on success
  */
-bool Camera::set_format(uint32_t pixelformat)
+bool Camera::set_format(uint32_t pixelformat, unsigned width, unsigned height)
 {
     struct v4l2_format fmt;
-    struct v4l2_pix_format * pix;
     int retVal;
 
     memset(&fmt, 0, sizeof(fmt));
@@ -489,12 +645,31 @@ bool Camera::set_format(uint32_t pixelformat)
     if(retVal == -1) {
         return false;
     }
-    pix = &fmt.fmt.pix;
-    print_capture_format(pix);
+    if(is_mplane()) {
+        print_capture_format(&fmt.fmt.pix_mp);
+        fmt.fmt.pix_mp.pixelformat = pixelformat;
+        if(width && height) {
+            fmt.fmt.pix_mp.width = width;
+            fmt.fmt.pix_mp.height = height;
+            memset(fmt.fmt.pix_mp.plane_fmt, 0, sizeof(fmt.fmt.pix_mp.plane_fmt));
+        }
+    }
+    else {
+        struct v4l2_pix_format * pix = &fmt.fmt.pix;
+        print_capture_format(pix);
+        if(width && height) {
+            /* Let the driver work out the line and image sizes */
+            pix->width = width;
+            pix->height = height;
+            pix->bytesperline = 0;
+            pix->sizeimage = 0;
+        }
+        else {
+            pix->sizeimage = pix->height * pix->bytesperline;
+        }
+        pix->pixelformat = pixelformat;
+    }
 
-    pix->sizeimage = pix->height * pix->bytesperline;
-    pix->pixelformat = pixelformat;
-    
     retVal = ioctl(m_fd, VIDIOC_S_FMT, &fmt);
     if(retVal == -1) {
         LOG_ERRNO_AS_ERROR("VIDIOC_S_FMT");
@@ -505,16 +680,109 @@ bool Camera::set_format(uint32_t pixelformat)
     if(retVal == -1) {
         return false;
     }
-    print_capture_format(pix);
 
-    pixelformat = pix->pixelformat;
-    m_formatObj = create_format_obj(pixelformat);
-    m_formatObj->init(pix->width, pix->height, pix->bytesperline);
+    if(is_mplane()) {
+        struct v4l2_pix_format_mplane * pix = &fmt.fmt.pix_mp;
+        unsigned bytesperline[VIDEO_MAX_PLANES];
+        unsigned sizeimage[VIDEO_MAX_PLANES];
+        unsigned p;
+
+        print_capture_format(pix);
+        for(p = 0; p < pix->num_planes; p++) {
+            bytesperline[p] = pix->plane_fmt[p].bytesperline;
+            sizeimage[p] = pix->plane_fmt[p].sizeimage;
+        }
+        delete m_formatObj;
+        m_formatObj = create_format_obj(pix->pixelformat);
+        if(!m_formatObj) {
+            LOG_ERROR("Driver chose %s, which we do not support",
+                    pixelfmt2str(pix->pixelformat));
+            return false;
+        }
+        m_formatObj->init_planes(pix->width, pix->height, pix->num_planes,
+                bytesperline, sizeimage);
+        m_formatObj->set_colorimetry(pix->colorspace, pix->ycbcr_enc,
+                pix->quantization);
+    }
+    else {
+        struct v4l2_pix_format * pix = &fmt.fmt.pix;
+
+        print_capture_format(pix);
+        delete m_formatObj;
+        m_formatObj = create_format_obj(pix->pixelformat);
+        if(!m_formatObj) {
+            LOG_ERROR("Driver chose %s, which we do not support",
+                    pixelfmt2str(pix->pixelformat));
+            return false;
+        }
+        m_formatObj->init(pix->width, pix->height, pix->bytesperline, pix->sizeimage);
+        /* The extended fields are only valid if the driver says so */
+        if(pix->priv == V4L2_PIX_FMT_PRIV_MAGIC) {
+            m_formatObj->set_colorimetry(pix->colorspace, pix->ycbcr_enc,
+                    pix->quantization);
+        }
+        else {
+            m_formatObj->set_colorimetry(pix->colorspace, V4L2_YCBCR_ENC_DEFAULT,
+                    V4L2_QUANTIZATION_DEFAULT);
+        }
+    }
+    m_converter.set_for_format(*m_formatObj);
+    m_profile.buf_type = m_buf_type;
+    m_profile.pixelformat = m_formatObj->pix_fmt();
+    m_profile.width = m_formatObj->width();
+    m_profile.height = m_formatObj->height();
+    m_profile.bytesperline = m_formatObj->bytesperline();
     return true;
 }
 
+/**
+ * Apply the format from the saved profile and check the driver still
+ * agrees with it, much cheaper than enumerating
+ *
+ * @return true if the profile format is now set
+ */
+bool Camera::apply_profile_format(const std::string & target)
+{
+    if(!m_use_profile || (m_profile.target != target)) {
+        m_use_profile = false;
+        return false;
+    }
+    const CameraProfile cached = m_profile;
+    m_buf_type = cached.buf_type;
+    if(set_format(cached.pixelformat, cached.width, cached.height)
+            && (m_formatObj->pix_fmt() == cached.pixelformat)
+            && (m_formatObj->width() == cached.width)
+            && (m_formatObj->height() == cached.height)
+            && (m_formatObj->bytesperline() == cached.bytesperline)) {
+        m_interval.numerator = cached.interval_num;
+        m_interval.denominator = cached.interval_den;
+        return true;
+    }
+    LOG_WARN("Profile format no longer valid, enumerating");
+    m_use_profile = false;
+    return false;
+}
+
+/**
+ * Save what was found by enumeration, if anything was, so the next start
+ * can skip it
+ */
+bool Camera::save_profile()
+{
+    if(m_use_profile) {
+        return true;
+    }
+    m_profile.interval_num = m_interval.numerator;
+    m_profile.interval_den = m_interval.denominator;
+    return m_profile.save();
+}
+
 bool Camera::select_format()
 {
+    if(apply_profile_format("first")) {
+        return true;
+    }
+    m_profile.target = "first";
     const uint32_t pixelformat = find_suitable_format();
     if(pixelformat) {
         return set_format(pixelformat);
@@ -522,13 +790,110 @@ bool Camera::select_format()
     return false;
 }
 
+/**
+ * Pick the format, frame size and frame rate that best meet the target
+ * out of everything the device offers
+ *
+ * @return true on success
+ */
+bool Camera::select_format(const CaptureTarget & target)
+{
+    FormatNegotiator negotiator(m_fd);
+    char desc[80];
+
+    snprintf(desc, sizeof(desc), "%ux%u@%u,%llu%s", target.min_width,
+            target.min_height, target.target_fps,
+            (unsigned long long) target.max_bandwidth,
+            target.prefer_compressed ? ",compressed" : "");
+    if(apply_profile_format(desc)) {
+        return true;
+    }
+    m_profile.target = desc;
+
+    negotiator.enumerate(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    negotiator.enumerate(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+    const FormatCandidate * best = negotiator.best(target);
+    if(!best) {
+        LOG_ERROR("No format meets the target");
+        return false;
+    }
+    m_buf_type = best->buf_type;
+    m_interval.numerator = best->interval_num;
+    m_interval.denominator = best->interval_den;
+    return set_format(best->pixelformat, best->width, best->height);
+}
+
+/**
+ * Fill in a v4l2_buffer for buffer i, for multi-planar devices the plane
+ * array is hooked in (and must stay in scope for the ioctl)
+ */
+void Camera::init_v4l2_buffer(struct v4l2_buffer & buffer,
+        struct v4l2_plane * planes, int i) const
+{
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.type = m_buf_type;
+    buffer.memory = m_memory;
+    buffer.index = i;
+    if(is_mplane()) {
+        memset(planes, 0, VIDEO_MAX_PLANES * sizeof(struct v4l2_plane));
+        buffer.m.planes = planes;
+        buffer.length = VIDEO_MAX_PLANES;
+    }
+}
+
+/**
+ * Make sure the buffer table exists. It has room for VIDEO_MAX_FRAME so
+ * that growing the pool never moves an entry other threads may be reading.
+ */
+void Camera::alloc_buffer_table()
+{
+    if(!m_bufs) {
+        m_bufs = new CaptureBuffer[VIDEO_MAX_FRAME];
+    }
+    memset(m_bufs, 0, VIDEO_MAX_FRAME * sizeof(CaptureBuffer));
+    m_num_queued = 0;
+}
+
+/**
+ * Query the driver for buffer i and mmap each of its planes
+ */
+void Camera::map_buffer(int i)
+{
+    struct v4l2_buffer buffer;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    unsigned p;
+    int status;
+
+    init_v4l2_buffer(buffer, planes, i);
+    status = ioctl(m_fd, VIDIOC_QUERYBUF, &buffer);
+    if(status == -1) {
+        LOG_ERROR("Failed to get buffer details");
+        throw Camera_error();
+//        exit(EXIT_FAILURE);
+    }
+    CaptureBuffer & buf = m_bufs[i];
+    buf.num_planes = is_mplane() ? buffer.length : 1;
+    for(p = 0; p < buf.num_planes; p++) {
+        const uint32_t length = is_mplane() ? planes[p].length : buffer.length;
+        const uint32_t offset = is_mplane() ? planes[p].m.mem_offset : buffer.m.offset;
+        uint8_t * start = reinterpret_cast<uint8_t *>(mmap(NULL, length,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, offset));
+        if(start == MAP_FAILED) {
+            LOG_ERROR("Failed to map buffer");
+            throw Camera_error();
+//            exit(EXIT_FAILURE);
+        }
+        LOG_INFO("MMAP, %p, plane=%u, len=%u", start, p, length);
+        buf.start[p] = start;
+        buf.length[p] = length;
+    }
+}
+
 int Camera::request_buffers(int max_num)
 {
-    unsigned i;
+    int i;
     int status;
     struct v4l2_requestbuffers reqbuf;
-    uint8_t ** starts = 0;
-    size_t * lengths = 0;
 
     memset(&reqbuf, 0, sizeof(reqbuf));
     reqbuf.type = m_buf_type;
@@ -541,38 +906,225 @@ int Camera::request_buffers(int max_num)
         throw Camera_error();
 //        exit(EXIT_FAILURE);
     }
-    starts = new uint8_t*[reqbuf.count * sizeof(void *)];
-    lengths = new size_t[reqbuf.count * sizeof(size_t)];
-    for(i = 0; i < reqbuf.count; i++) {
-        struct v4l2_buffer buffer;
-        uint8_t * start;
+    m_memory = V4L2_MEMORY_MMAP;
+    m_num_bufs = reqbuf.count < VIDEO_MAX_FRAME ? reqbuf.count : VIDEO_MAX_FRAME;
+    alloc_buffer_table();
+    for(i = 0; i < m_num_bufs; i++) {
+        map_buffer(i);
+    }
+    return m_num_bufs;
+}
+
+/**
+ * Add buffers while the camera may be streaming (VIDIOC_CREATE_BUFS), for
+ * growing the pool when consumers fall behind. Only for driver allocated
+ * buffers.
+ *
+ * @param[in] count How many more buffers
+ * @param[out] first Index of the first new buffer
+ *
+ * @return Number of buffers actually added, 0 on failure
+ */
+int Camera::create_buffers(int count, int & first)
+{
+    struct v4l2_create_buffers create;
+    unsigned i;
+
+    if(m_memory != V4L2_MEMORY_MMAP) {
+        LOG_ERROR("Can only grow driver allocated buffers");
+        return 0;
+    }
+    if(count > VIDEO_MAX_FRAME - m_num_bufs) {
+        count = VIDEO_MAX_FRAME - m_num_bufs;
+    }
+    if(count <= 0) {
+        return 0;
+    }
 
-        memset(&buffer, 0, sizeof(buffer));
-        buffer.type = reqbuf.type;
-        buffer.memory = reqbuf.memory;
-        buffer.index = i;
+    memset(&create, 0, sizeof(create));
+    create.count = count;
+    create.memory = m_memory;
+    create.format.type = m_buf_type;
+    if(ioctl(m_fd, VIDIOC_G_FMT, &create.format) == -1) {
+        LOG_ERRNO_AS_ERROR("VIDIOC_G_FMT");
+        return 0;
+    }
+    if(ioctl(m_fd, VIDIOC_CREATE_BUFS, &create) == -1) {
+        LOG_ERRNO_AS_ERROR("VIDIOC_CREATE_BUFS");
+        return 0;
+    }
+    if(create.index + create.count > VIDEO_MAX_FRAME) {
+        LOG_ERROR("Driver created buffers beyond %u", VIDEO_MAX_FRAME);
+        return 0;
+    }
+    for(i = create.index; i < create.index + create.count; i++) {
+        map_buffer(i);
+    }
+    if(static_cast<int>(create.index + create.count) > m_num_bufs) {
+        m_num_bufs = create.index + create.count;
+    }
+    LOG_INFO("Created %u buffers from %u", create.count, create.index);
+    first = create.index;
+    return create.count;
+}
 
-        status = ioctl(m_fd, VIDIOC_QUERYBUF, &buffer);
-        if(status == -1) {
-            LOG_ERROR("Failed to get buffer details");
-            throw Camera_error();
-//            exit(EXIT_FAILURE);
+/**
+ * Free a buffer we have dequeued and no longer want, if the kernel can
+ * (VIDIOC_REMOVE_BUFS, Linux 6.10). Otherwise it stays allocated and the
+ * caller should just not queue it again.
+ *
+ * @return true if the memory was given back
+ */
+bool Camera::remove_buffer(int i)
+{
+#ifdef VIDIOC_REMOVE_BUFS
+    struct v4l2_remove_buffers remove;
+    CaptureBuffer & buf = m_bufs[i];
+    unsigned p;
+
+    if(buf.queued || (m_memory != V4L2_MEMORY_MMAP)) {
+        return false;
+    }
+    memset(&remove, 0, sizeof(remove));
+    remove.index = i;
+    remove.count = 1;
+    remove.type = m_buf_type;
+    for(p = 0; p < buf.num_planes; p++) {
+        munmap(buf.start[p], buf.length[p]);
+    }
+    if(ioctl(m_fd, VIDIOC_REMOVE_BUFS, &remove) == -1) {
+        LOG_ERRNO_AS_ERROR("VIDIOC_REMOVE_BUFS");
+        map_buffer(i);
+        return false;
+    }
+    memset(&buf, 0, sizeof(buf));
+    return true;
+#else
+    (void) i;
+    return false;
+#endif
+}
+
+/**
+ * Request buffers that we provide (V4L2_MEMORY_USERPTR). The frames are
+ * placed in one contiguous arena sized from the negotiated format, each
+ * frame slot (and each plane within it) page aligned.
+ *
+ * @param[in] max_num Number of buffers wanted
+ * @param[in] huge_pages Back the arena with 2MB huge pages if possible
+ *
+ * @return Number of buffers
+ */
+int Camera::request_user_buffers(int max_num, bool huge_pages)
+{
+    int i;
+    unsigned p;
+    int status;
+    struct v4l2_requestbuffers reqbuf;
+    size_t plane_offsets[VIDEO_MAX_PLANES];
+    size_t frame_bytes = 0;
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const unsigned num_planes = m_formatObj->num_planes();
+
+    memset(&reqbuf, 0, sizeof(reqbuf));
+    reqbuf.type = m_buf_type;
+    reqbuf.memory = V4L2_MEMORY_USERPTR;
+    reqbuf.count = max_num;
+
+    status = ioctl(m_fd, VIDIOC_REQBUFS, &reqbuf);
+    if(status == -1) {
+        LOG_ERRNO_AS_ERROR("VIDIOC_REQBUFS");
+        throw Camera_error();
+    }
+    m_memory = V4L2_MEMORY_USERPTR;
+    m_num_bufs = reqbuf.count < VIDEO_MAX_FRAME ? reqbuf.count : VIDEO_MAX_FRAME;
+    for(p = 0; p < num_planes; p++) {
+        plane_offsets[p] = frame_bytes;
+        frame_bytes += ((m_formatObj->plane_size(p) + page_size - 1) / page_size) * page_size;
+    }
+    if(!m_arena) {
+        m_arena = new FrameArena();
+    }
+    if(!m_arena->allocate(m_num_bufs, frame_bytes, huge_pages)) {
+        throw Camera_error();
+    }
+    alloc_buffer_table();
+    for(i = 0; i < m_num_bufs; i++) {
+        m_bufs[i].num_planes = num_planes;
+        for(p = 0; p < num_planes; p++) {
+            m_bufs[i].start[p] = m_arena->frame(i) + plane_offsets[p];
+            m_bufs[i].length[p] = m_formatObj->plane_size(p);
         }
-        start = reinterpret_cast<uint8_t *>(mmap(NULL, buffer.length, PROT_READ | PROT_WRITE, MAP_SHARED,
-                     m_fd, buffer.m.offset));
-        if(start == MAP_FAILED) {
-            LOG_ERROR("Failed to map buffer");
-            throw Camera_error();
-//            exit(EXIT_FAILURE);
+    }
+    return m_num_bufs;
+}
+
+/**
+ * Export every buffer as a dma-buf (VIDIOC_EXPBUF) so that consumers can map
+ * the frames without copying them out of our mmap'ed region. Must be called
+ * after request_buffers.
+ *
+ * @return true on success
+ */
+bool Camera::export_buffers()
+{
+    int i;
+    unsigned p;
+
+    if(m_memory != V4L2_MEMORY_MMAP) {
+        LOG_ERROR("Can only export driver allocated buffers");
+        return false;
+    }
+    release_dmabufs();
+    m_dmabufs = new DmaBuf[m_num_bufs];
+    m_num_dmabufs = m_num_bufs;
+    memset(m_dmabufs, 0, m_num_bufs * sizeof(DmaBuf));
+    for(i = 0; i < m_num_bufs; i++) {
+        for(p = 0; p < m_bufs[i].num_planes; p++) {
+            struct v4l2_exportbuffer expbuf;
+
+            memset(&expbuf, 0, sizeof(expbuf));
+            expbuf.type = m_buf_type;
+            expbuf.index = i;
+            expbuf.plane = p;
+            expbuf.flags = O_RDONLY | O_CLOEXEC;
+
+            if(ioctl(m_fd, VIDIOC_EXPBUF, &expbuf) == -1) {
+                LOG_ERRNO_AS_ERROR("VIDIOC_EXPBUF");
+                release_dmabufs();
+                return false;
+            }
+            m_dmabufs[i].num_planes = p + 1;
+            m_dmabufs[i].planes[p].fd = expbuf.fd;
+            m_dmabufs[i].planes[p].offset = 0;
+            m_dmabufs[i].planes[p].length = m_bufs[i].length[p];
+            m_dmabufs[i].planes[p].bytesperline = m_formatObj->plane_bytesperline(p);
+            LOG_INFO("EXPBUF %i, plane=%u, fd=%i, len=%zu", i, p, expbuf.fd,
+                    m_bufs[i].length[p]);
         }
-        LOG_INFO("MMAP, %p, len=%u", start, buffer.length);
-        starts[i] = start;
-        lengths[i] = buffer.length;
     }
-    m_buf_starts = starts;
-    m_buf_lengths = lengths;
-    m_num_bufs = reqbuf.count;
-    return reqbuf.count;
+    return true;
+}
+
+/**
+ * Close any dma-buf fds handed out by export_buffers
+ */
+void Camera::release_dmabufs()
+{
+    int i;
+    unsigned j;
+
+    if(!m_dmabufs) {
+        return;
+    }
+    for(i = 0; i < m_num_dmabufs; i++) {
+        for(j = 0; j < m_dmabufs[i].num_planes; j++) {
+            ::close(m_dmabufs[i].planes[j].fd);
+        }
+    }
+    delete [] m_dmabufs;
+    m_dmabufs = 0;
+    m_num_dmabufs = 0;
 }
 
 /**
@@ -581,12 +1133,14 @@ int Camera::request_buffers(int max_num)
 void Camera::enable_capture()
 {
     const int arg = m_buf_type;
+    m_stats.reset();
     const int status = ioctl(m_fd, VIDIOC_STREAMON, &arg);
     if(status == -1) {
         LOG_ERROR("Failed to get buffer details");
         throw Camera_error();
 //        exit(EXIT_FAILURE);
     }
+    m_streaming = true;
 }
 
 /**
@@ -601,18 +1155,36 @@ void Camera::disable_capture()
         throw Camera_error();
 //        exit(EXIT_FAILURE);
     }
+    m_streaming = false;
+    /* STREAMOFF hands every buffer back to us */
+    for(int i = 0; i < m_num_bufs; i++) {
+        m_bufs[i].queued = false;
+    }
+    m_num_queued = 0;
 }
 
 
 void Camera::queue_buffer(int i)
 {
     struct v4l2_buffer buffer;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    unsigned p;
     int status;
 
-    memset(&buffer, 0, sizeof(buffer));
-    buffer.type = m_buf_type;
-    buffer.memory = V4L2_MEMORY_MMAP;
-    buffer.index = i;
+    init_v4l2_buffer(buffer, planes, i);
+    if(m_memory == V4L2_MEMORY_USERPTR) {
+        if(is_mplane()) {
+            buffer.length = m_bufs[i].num_planes;
+            for(p = 0; p < m_bufs[i].num_planes; p++) {
+                planes[p].m.userptr = reinterpret_cast<unsigned long>(m_bufs[i].start[p]);
+                planes[p].length = m_bufs[i].length[p];
+            }
+        }
+        else {
+            buffer.m.userptr = reinterpret_cast<unsigned long>(m_bufs[i].start[0]);
+            buffer.length = m_bufs[i].length[0];
+        }
+    }
 
     status = ioctl(m_fd, VIDIOC_QBUF, &buffer);
     if(status == -1) {
@@ -620,6 +1192,8 @@ void Camera::queue_buffer(int i)
         throw Camera_error();
 //        exit(EXIT_FAILURE);
     }
+    m_bufs[i].queued = true;
+    m_num_queued++;
 }
 
 /**
@@ -630,14 +1204,11 @@ void Camera::queue_buffer(int i)
 uint32_t Camera::query_buffer(int i)
 {
     struct v4l2_buffer buffer;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
     int status;
 
-    memset(&buffer, 0, sizeof(buffer));
-    buffer.type = m_buf_type;
-    buffer.memory = V4L2_MEMORY_MMAP;
-    buffer.index = i;
-
-    status = ioctl(m_fd, VIDIOC_QBUF, &buffer);
+    init_v4l2_buffer(buffer, planes, i);
+    status = ioctl(m_fd, VIDIOC_QUERYBUF, &buffer);
     if(status == -1) {
         LOG_ERROR("Failed to get buffer details");
         throw Camera_error();
@@ -648,47 +1219,73 @@ uint32_t Camera::query_buffer(int i)
 
 /*
  * Wait for a buffer to be ready
+ *
+ * @return the buffer index, or -1 if in non-blocking mode and no buffer
+ * is ready yet
  */
 int Camera::wait_buffer_ready(uint32_t * bytes_avail)
+{
+    FrameMeta meta;
+    const int n = wait_buffer_ready(meta);
+    *bytes_avail = meta.bytesused;
+    return n;
+}
+
+/*
+ * Wait for a buffer to be ready, filling in what the driver reports about
+ * the frame and updating the running stats
+ *
+ * @param[out] meta The frame's sequence, timestamp etc
+ *
+ * @return the buffer index, or -1 if in non-blocking mode and no buffer
+ * is ready yet
+ */
+int Camera::wait_buffer_ready(FrameMeta & meta)
 {
     struct v4l2_buffer buffer;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    unsigned p;
     int status;
 
-    memset(&buffer, 0, sizeof(buffer));
-    buffer.type = m_buf_type;
-    buffer.memory = V4L2_MEMORY_MMAP;
-
+    init_v4l2_buffer(buffer, planes, 0);
     status = ioctl(m_fd, VIDIOC_DQBUF, &buffer);
     if(status == -1) {
+        if(m_nonblocking && (errno == EAGAIN)) {
+            return -1;
+        }
         LOG_ERRNO_AS_ERROR("Failed to get buffer details");
         throw Camera_error();
 //        exit(EXIT_FAILURE);
     }
-    *bytes_avail = buffer.bytesused;
-    return buffer.index;
-
-}
-
-int Camera::check_quality(int n, int left, uint32_t bytes_avail)
-{
-    ImageQuality qual;
-    uint8_t * src = m_buf_starts[n];
-
-    m_formatObj->check_quality(src, bytes_avail, qual);
-
-    LOG_INFO("Luma, min=%i, max=%i, mean=%i", qual.luma_min, qual.luma_max,
-            qual.luma_mean);
-    if(qual.luma_mean > 128) {
-        set_control_value(m_brightness->get_id(), get_control_value(m_brightness->get_id())-1);
+    CaptureBuffer & buf = m_bufs[buffer.index];
+    buf.queued = false;
+    m_num_queued--;
+    if(is_mplane()) {
+        for(p = 0; p < buf.num_planes; p++) {
+            buf.bytesused[p] = planes[p].bytesused;
+        }
     }
     else {
-        set_control_value(m_brightness->get_id(), get_control_value(m_brightness->get_id())+1);
+        buf.bytesused[0] = buffer.bytesused;
     }
-    return left == 0;
+
+    meta.dequeued_ns = monotonic_ns();
+    meta.index = buffer.index;
+    meta.sequence = buffer.sequence;
+    meta.flags = buffer.flags;
+    meta.field = buffer.field;
+    meta.bytesused = buf.bytesused[0];
+    meta.timestamp_ns = static_cast<uint64_t>(buffer.timestamp.tv_sec) * 1000000000ULL
+            + static_cast<uint64_t>(buffer.timestamp.tv_usec) * 1000ULL;
+    meta.monotonic = (buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK)
+            == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    m_stats.record(meta);
+    return buffer.index;
 }
 
 void Camera::close()
 {
+    release_dmabufs();
     ::close(m_fd);
     m_fd=0;
 }
@@ -2,31 +2,82 @@
 #define _CAPTURE_H_
 
 #include <string>
+#include <exception>
 
 #include <stdint.h>
 #include <stdbool.h>
 
 #include "format.h"
 #include "control.h"
+#include "frame.h"
+#include "stats.h"
+#include "negotiate.h"
+#include "profile.h"
+#include "framesource.h"
 
 class BaseFormat;
 class BaseControl;
+class FrameArena;
 
-class Camera : public CtrlCallback
+class Camera_error : public std::exception
+{
+};
+
+/**
+ * Where a capture buffer lives in our address space, one entry per plane
+ * (single-planar formats use just the first)
+ */
+struct CaptureBuffer
+{
+    unsigned num_planes;
+    uint8_t * start[VIDEO_MAX_PLANES];
+    size_t length[VIDEO_MAX_PLANES];
+    uint32_t bytesused[VIDEO_MAX_PLANES];
+    bool queued;            /* Currently owned by the driver */
+};
+
+/**
+ * A capture buffer exported as dma-buf, one fd per plane. The fds can be
+ * passed to another process (e.g. over a unix socket) and mmap'ed there.
+ */
+struct DmaBuf
+{
+    unsigned num_planes;
+    struct {
+        int fd;
+        uint32_t offset;        /* Start of the plane data in the dma-buf */
+        uint32_t length;        /* Size of the dma-buf */
+        uint32_t bytesperline;
+    } planes[VIDEO_MAX_PLANES];
+};
+
+class Camera : public FrameSource
 {
 private:
     int m_fd;
     int m_buf_type; /* see enum v4l2_buf_type */
+    int m_memory;   /* see enum v4l2_memory */
     
     BaseFormat * m_formatObj;
 
-    uint8_t ** m_buf_starts;
-    size_t * m_buf_lengths;
+    CaptureBuffer * m_bufs;
     int m_num_bufs;
+    int m_num_queued;
+    DmaBuf * m_dmabufs;
+    int m_num_dmabufs;
+    FrameArena * m_arena;
     
     BaseControl * m_brightness;
     uint32_t m_contrast;
     int m_input;
+    uint32_t m_caps;    /* Device capabilities, V4L2_CAP_xxx */
+    std::string m_card;
+    bool m_nonblocking;
+    bool m_streaming;
+    FrameStats m_stats;
+    struct v4l2_fract m_interval;   /* Negotiated time per frame */
+    CameraProfile m_profile;
+    bool m_use_profile;             /* Profile loaded and still valid */
 
 private:
     virtual bool set_control_value(int id, int32_t value);
@@ -34,12 +85,18 @@ private:
 
     void set_control(int id, float percent);
     uint32_t query_buffer(int i);
-    bool check_can_do_capture() const;
+    bool check_can_do_capture();
+    bool apply_profile_format(const std::string & target);
     bool select_camera_input();
     bool find_suitable_input();
     bool set_input();
     uint32_t find_suitable_format();
-    bool set_format(uint32_t pixelformat);
+    bool set_format(uint32_t pixelformat, unsigned width = 0, unsigned height = 0);
+    void release_dmabufs();
+    void alloc_buffer_table();
+    void map_buffer(int i);
+    void init_v4l2_buffer(struct v4l2_buffer & buffer,
+            struct v4l2_plane * planes, int i) const;
 
 public:
     friend BaseControl;
@@ -47,24 +104,45 @@ public:
     Camera(std::string &);
     ~Camera();
     bool init();
+    virtual bool set_nonblocking(bool enable);
+    virtual bool is_nonblocking() const {return m_nonblocking;};
+    virtual int fd() const {return m_fd;};
     bool select_format();
-    unsigned height() const {return m_formatObj ? m_formatObj->height() : 0;};
-    unsigned width() const {return m_formatObj ? m_formatObj->width() : 0;};
-
-    int check_quality(int n, int left, uint32_t bytes_avail);
-    int request_buffers(int max_num);
+    bool select_format(const CaptureTarget & target);
+    bool save_profile();
+    bool using_profile() const {return m_use_profile;};
+    uint32_t caps() const {return m_caps;};
+    const std::string & card() const {return m_card;};
+    const CameraProfile & profile() const {return m_profile;};
+    virtual int request_buffers(int max_num);
+    int request_user_buffers(int max_num, bool huge_pages);
+    int create_buffers(int count, int & first);
+    bool remove_buffer(int i);
+    int num_buffers() const {return m_num_bufs;};
+    int num_queued() const {return m_num_queued;};
     int wait_buffer_ready(uint32_t * bytes_avail);
+    virtual int wait_buffer_ready(FrameMeta & meta);
+    virtual const FrameStats & stats() const {return m_stats;};
+    virtual uint32_t brightness_control() const {return m_brightness ? m_brightness->get_id() : 0;};
     void check_standards();
-    void close();
+    virtual void close();
     void check_controls();
-    void disable_capture();
-    uint8_t * buf_start(int n) const {return m_buf_starts[n];};
-    void set_capture_params() const;
-    void queue_buffer(int i);
-    void enable_capture();
+    virtual void disable_capture();
+    bool is_mplane() const {return m_buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;};
+    virtual uint8_t * buf_start(int n, unsigned plane = 0) const {return m_bufs[n].start[plane];};
+    uint32_t bytes_used(int n, unsigned plane = 0) const {return m_bufs[n].bytesused[plane];};
+    unsigned num_planes(int n) const {return m_bufs[n].num_planes;};
+    bool export_buffers();
+    const DmaBuf * dmabuf(int n) const {return m_dmabufs ? &m_dmabufs[n] : 0;};
+    void set_capture_params();
+    bool set_frame_interval(uint32_t numerator, uint32_t denominator);
+    struct v4l2_fract frame_interval() const {return m_interval;};
+    bool streaming() const {return m_streaming;};
+    virtual void queue_buffer(int i);
+    virtual void enable_capture();
     void check_format();
     void check_input();
-    BaseFormat * fmt() const { return m_formatObj;};
+    virtual BaseFormat * fmt() const { return m_formatObj;};
 };
 
 #endif
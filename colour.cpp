@@ -0,0 +1,284 @@
+#include <vector>
+
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "logging.h"
+#include "format.h"
+#include "colour.h"
+#include "pixkernel.h"
+
+#define FRAC_BITS (ColourConverter::FRAC_BITS)
+#define ROUND (1 << (FRAC_BITS - 1))
+
+static inline uint8_t clamp8(int val)
+{
+    return val < 0 ? 0 : (val > 255 ? 255 : val);
+}
+
+/**
+ * One row of 4:2:x Y'CbCr to RGB24, u and v hold a sample per two pixels.
+ * This is the reference the kernels in pixkernel.cpp must match exactly.
+ */
+void yuv_row_scalar(const YuvCoeffs & c, const uint8_t * y, const uint8_t * u,
+        const uint8_t * v, unsigned width, uint8_t * rgb)
+{
+    unsigned x;
+
+    for(x = 0; x < width; x++) {
+        const int yy = c.cy * (y[x] - c.y_offset) + ROUND;
+        const int uu = u[x >> 1] - 128;
+        const int vv = v[x >> 1] - 128;
+        rgb[0] = clamp8((yy + c.crv * vv) >> FRAC_BITS);
+        rgb[1] = clamp8((yy - c.cgu * uu - c.cgv * vv) >> FRAC_BITS);
+        rgb[2] = clamp8((yy + c.cbu * uu) >> FRAC_BITS);
+        rgb += 3;
+    }
+}
+
+/**
+ * @param[in] matrix Which standard
+ * @param[in] full_range Y' and Cb,Cr use all of 0 to 255, as in JPEG,
+ *            rather than 16 to 235 and 16 to 240
+ * @param[in] layout How convert() packs its output
+ */
+ColourConverter::ColourConverter(ColourMatrix matrix, bool full_range,
+        PixelLayout layout) : m_layout(layout), m_kernel(NULL), m_kernel_fmt(0)
+{
+    set(matrix, full_range);
+}
+
+void ColourConverter::set(ColourMatrix matrix, bool full_range)
+{
+    m_matrix = with_standard(matrix, [](auto traits) {return decltype(traits)::ID;});
+    m_full_range = full_range;
+    m_coeffs = matrix_coeffs(matrix, full_range);
+    m_row_kernel = find_row_kernel(matrix, full_range, m_layout);
+    m_rgb_kernels = find_rgb_kernels(matrix, full_range);
+    m_kernel_fmt = 0;
+}
+
+void ColourConverter::set_layout(PixelLayout layout)
+{
+    m_layout = layout;
+    set(m_matrix, m_full_range);
+}
+
+/**
+ * Pick the kernel for frames of pixelformat
+ */
+void ColourConverter::select(uint32_t pixelformat) const
+{
+    m_kernel = find_pixel_kernel(pixelformat, m_matrix, m_full_range, m_layout);
+    m_kernel_fmt = pixelformat;
+}
+
+/**
+ * Use whichever matrix and range the driver reported for the format, and
+ * pick the kernel for it now rather than on the first frame
+ */
+void ColourConverter::set_for_format(const BaseFormat & fmt)
+{
+    const unsigned enc = fmt.ycbcr_enc();
+    ColourMatrix matrix = static_cast<ColourMatrix>(0);
+
+#define COLOUR_MATCH(id, kr, kb, name, full_name, std_enc, other_enc) \
+    if((enc == (std_enc)) || (enc == (other_enc))) { \
+        matrix = COLOUR_##id; \
+    }
+    COLOUR_STANDARDS(COLOUR_MATCH)
+#undef COLOUR_MATCH
+    set(matrix, fmt.quantization() == V4L2_QUANTIZATION_FULL_RANGE);
+    select(fmt.pix_fmt());
+    LOG_DEBUG("%s frames are %s, %s pixel kernel", fmt.pix_fmt_str().c_str(),
+            name(), m_kernel ? pixel_kernel_isa() : "no");
+}
+
+const char * ColourConverter::name() const
+{
+    return with_standard(m_matrix, [this](auto traits) {
+        return m_full_range ? decltype(traits)::FULL_NAME : decltype(traits)::NAME;
+    });
+}
+
+/**
+ * Convert one row of 4:2:x samples
+ *
+ * @param[in] y width luma samples
+ * @param[in] u, v (width + 1) / 2 chroma samples each
+ * @param[in] width Pixels in the row
+ * @param[out] rgb width * 3 bytes
+ */
+void ColourConverter::yuv_row(const uint8_t * y, const uint8_t * u, const uint8_t * v,
+        unsigned width, uint8_t * rgb) const
+{
+    m_row_kernel(y, u, v, width, rgb);
+}
+
+/**
+ * Make sure the kernel for fmt is picked, before sharing the converter
+ * between threads
+ *
+ * @return false if fmt cannot be converted
+ */
+bool ColourConverter::prepare(const BaseFormat & fmt) const
+{
+    if(fmt.pix_fmt() != m_kernel_fmt) {
+        select(fmt.pix_fmt());
+    }
+    return m_kernel != NULL;
+}
+
+/**
+ * Convert a whole frame to packed RGB
+ *
+ * @param[in] fmt The frame's format
+ * @param[in] planes Start of each plane, only the first is used unless
+ *            the format is multi-planar
+ * @param[in] bytes Bytes in the first plane
+ * @param[out] dst width * 3 bytes for each row
+ * @param[in] dst_stride Distance between rows of dst
+ *
+ * @return false if the format cannot be converted or the frame is short
+ */
+bool ColourConverter::convert(const BaseFormat & fmt, const uint8_t * const * planes,
+        unsigned bytes, uint8_t * dst, unsigned dst_stride) const
+{
+    return prepare(fmt) && convert_rows(fmt, planes, bytes, 0, fmt.height(), dst,
+            dst_stride);
+}
+
+/**
+ * Convert a band of rows, prepare() must have been called for fmt
+ *
+ * @param[in] first_row, num_rows The band
+ * @param[out] dst Where row 0 of the frame goes
+ */
+bool ColourConverter::convert_rows(const BaseFormat & fmt, const uint8_t * const * planes,
+        unsigned bytes, unsigned first_row, unsigned num_rows, uint8_t * dst,
+        unsigned dst_stride) const
+{
+    static thread_local std::vector<uint8_t> scratch;
+
+    if(fmt.compressed() || (bytes < fmt.plane_size(0))
+            || (fmt.pix_fmt() != m_kernel_fmt) || !m_kernel) {
+        return false;
+    }
+    if(first_row >= fmt.height()) {
+        return true;
+    }
+    if(num_rows > fmt.height() - first_row) {
+        num_rows = fmt.height() - first_row;
+    }
+    scratch.resize(2 * fmt.width() + 2);
+    m_kernel(fmt, planes, first_row, num_rows, &scratch[0], dst, dst_stride);
+    return true;
+}
+
+/**
+ * Convert RGB24 to YUYV, each pair of pixels sharing the chroma of their
+ * average
+ */
+void ColourConverter::rgb24_to_yuyv(const uint8_t * src, unsigned width,
+        unsigned height, unsigned src_stride, uint8_t * dst, unsigned dst_stride) const
+{
+    unsigned row;
+
+    for(row = 0; row < height; row++) {
+        m_rgb_kernels.yuyv(src + static_cast<size_t>(row) * src_stride, width,
+                dst + static_cast<size_t>(row) * dst_stride);
+    }
+}
+
+/**
+ * Convert RGB24 to contiguous YUV420 (I420) with no row padding, each 2x2
+ * block sharing the chroma of its average
+ *
+ * @param[out] dst width * height luma, then two planes of
+ *             ((width + 1) / 2) * ((height + 1) / 2) chroma
+ */
+void ColourConverter::rgb24_to_yuv420(const uint8_t * src, unsigned width,
+        unsigned height, unsigned src_stride, uint8_t * dst) const
+{
+    const unsigned c_width = (width + 1) / 2;
+    const unsigned c_height = (height + 1) / 2;
+    uint8_t * u = dst + static_cast<size_t>(width) * height;
+    uint8_t * v = u + static_cast<size_t>(c_width) * c_height;
+    unsigned row;
+
+    for(row = 0; row < height; row++) {
+        m_rgb_kernels.luma(src + static_cast<size_t>(row) * src_stride, width,
+                dst + static_cast<size_t>(row) * width);
+    }
+    for(row = 0; row < c_height; row++) {
+        const uint8_t * p0 = src + static_cast<size_t>(2 * row) * src_stride;
+        const uint8_t * p1 = (2 * row + 1 < height) ? p0 + src_stride : p0;
+        m_rgb_kernels.chroma420(p0, p1, width, u + row * c_width, v + row * c_width);
+    }
+}
+
+/**
+ * Luma of one pixel
+ */
+static inline uint8_t rgb_y(const YuvCoeffs & c, const uint8_t * p)
+{
+    return clamp8(c.y_offset
+            + ((c.yr * p[0] + c.yg * p[1] + c.yb * p[2] + ROUND) >> FRAC_BITS));
+}
+
+/**
+ * Chroma of the sum of 1 << log2_n pixels, so of their average
+ */
+static inline void rgb_uv(const YuvCoeffs & c, int r, int g, int b, unsigned log2_n,
+        uint8_t & u, uint8_t & v)
+{
+    const unsigned shift = FRAC_BITS + log2_n;
+    const int round = 1 << (shift - 1);
+    u = clamp8(128 + ((c.ur * r + c.ug * g + c.ub * b + round) >> shift));
+    v = clamp8(128 + ((c.vr * r + c.vg * g + c.vb * b + round) >> shift));
+}
+
+/*
+ * The references the RGB to Y'CbCr kernels in pixkernel.cpp must match
+ * exactly, an odd last pixel pairs with itself
+ */
+
+void rgb_yuyv_row_scalar(const YuvCoeffs & c, const uint8_t * rgb, unsigned width,
+        uint8_t * yuyv)
+{
+    unsigned x;
+
+    for(x = 0; x < width; x += 2) {
+        const uint8_t * p1 = (x + 1 < width) ? rgb + 3 : rgb;
+        yuyv[0] = rgb_y(c, rgb);
+        yuyv[2] = rgb_y(c, p1);
+        rgb_uv(c, rgb[0] + p1[0], rgb[1] + p1[1], rgb[2] + p1[2], 1, yuyv[1], yuyv[3]);
+        rgb += 6;
+        yuyv += 4;
+    }
+}
+
+void rgb_luma_row_scalar(const YuvCoeffs & c, const uint8_t * rgb, unsigned width,
+        uint8_t * y)
+{
+    unsigned x;
+
+    for(x = 0; x < width; x++) {
+        y[x] = rgb_y(c, rgb + 3 * x);
+    }
+}
+
+void rgb_chroma420_row_scalar(const YuvCoeffs & c, const uint8_t * rgb0,
+        const uint8_t * rgb1, unsigned width, uint8_t * u, uint8_t * v)
+{
+    unsigned x;
+
+    for(x = 0; x < (width + 1) / 2; x++) {
+        const unsigned x0 = 6 * x;
+        const unsigned x1 = (2 * x + 1 < width) ? x0 + 3 : x0;
+        rgb_uv(c, rgb0[x0] + rgb0[x1] + rgb1[x0] + rgb1[x1],
+                rgb0[x0 + 1] + rgb0[x1 + 1] + rgb1[x0 + 1] + rgb1[x1 + 1],
+                rgb0[x0 + 2] + rgb0[x1 + 2] + rgb1[x0 + 2] + rgb1[x1 + 2], 2,
+                u[x], v[x]);
+    }
+}
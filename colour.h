@@ -0,0 +1,152 @@
+#ifndef _COLOUR_H_
+#define _COLOUR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+class BaseFormat;
+
+/**
+ * The Y'CbCr standards we know, each as
+ *
+ *   X(id, Kr, Kb, name, full range name, ycbcr_enc, other ycbcr_enc)
+ *
+ * with Kr and Kb as in the README and the two V4L2_YCBCR_ENC_xxx values
+ * drivers report it as. The enum, the coefficients, the names and every
+ * kernel instance come from this list, so a new standard is a line here.
+ * The first is used for anything else. JPEG is BT.601 at full range.
+ */
+#define COLOUR_STANDARDS(X) \
+    X(BT601, 0.299, 0.114, "BT.601", "JPEG", \
+            V4L2_YCBCR_ENC_601, V4L2_YCBCR_ENC_XV601) \
+    X(BT709, 0.2126, 0.0722, "BT.709", "BT.709 full range", \
+            V4L2_YCBCR_ENC_709, V4L2_YCBCR_ENC_XV709) \
+    X(BT2020, 0.2627, 0.0593, "BT.2020", "BT.2020 full range", \
+            V4L2_YCBCR_ENC_BT2020, V4L2_YCBCR_ENC_BT2020_CONST_LUM)
+
+#define COLOUR_ENUM(id, ...) COLOUR_##id,
+enum ColourMatrix
+{
+    COLOUR_STANDARDS(COLOUR_ENUM)
+};
+#undef COLOUR_ENUM
+
+/**
+ * Coefficients in FRAC_BITS fixed point, worked out once from Kr, Kb and
+ * the range so the kernels only multiply, add and shift
+ */
+struct YuvCoeffs
+{
+    /* Y'CbCr to R'G'B' */
+    int y_offset;
+    int cy;
+    int crv;
+    int cgu;
+    int cgv;
+    int cbu;
+
+    /* R'G'B' to Y'CbCr */
+    int yr, yg, yb;
+    int ur, ug, ub;
+    int vr, vg, vb;
+};
+
+/**
+ * How converted pixels are packed
+ */
+enum PixelLayout
+{
+    PIXEL_RGB24,
+    PIXEL_BGR24,
+};
+
+/**
+ * Converts rows first_row to first_row + num_rows - 1 of a frame of one
+ * format. dst is where row 0 goes, and scratch must hold 2 * width + 2
+ * bytes.
+ */
+typedef void (*PixelKernel)(const BaseFormat & fmt, const uint8_t * const * planes,
+        unsigned first_row, unsigned num_rows, uint8_t * scratch, uint8_t * dst,
+        unsigned dst_stride);
+
+/**
+ * Converts a row of planar samples with a chroma sample per two pixels
+ */
+typedef void (*PixelRowKernel)(const uint8_t * y, const uint8_t * u,
+        const uint8_t * v, unsigned width, uint8_t * out);
+
+/**
+ * Rows of RGB24 to Y'CbCr. yuyv packs a row as YUYV, each pair of pixels
+ * sharing the chroma of their average. luma writes just the Y' of each
+ * pixel, and chroma420 the Cb and Cr of each 2x2 block of two rows (pass
+ * the same row twice for the last of an odd height).
+ */
+typedef void (*RgbRowKernel)(const uint8_t * rgb, unsigned width, uint8_t * out);
+typedef void (*RgbChromaKernel)(const uint8_t * rgb0, const uint8_t * rgb1,
+        unsigned width, uint8_t * u, uint8_t * v);
+
+struct RgbToYuvKernels
+{
+    RgbRowKernel yuyv;
+    RgbRowKernel luma;
+    RgbChromaKernel chroma420;
+};
+
+/**
+ * Converts frames between Y'CbCr and packed RGB for one matrix, range and
+ * layout. The kernel for a format is picked once, when the format is set,
+ * with all of those fixed at compile time. Once it has been, bands of the
+ * same frame can be converted from several threads at once.
+ */
+class ColourConverter
+{
+private:
+    ColourMatrix m_matrix;
+    bool m_full_range;
+    PixelLayout m_layout;
+    YuvCoeffs m_coeffs;
+    PixelRowKernel m_row_kernel;
+    RgbToYuvKernels m_rgb_kernels;
+    mutable PixelKernel m_kernel;
+    mutable uint32_t m_kernel_fmt;
+
+    void select(uint32_t pixelformat) const;
+
+public:
+    static const unsigned FRAC_BITS = 13;
+
+    ColourConverter(ColourMatrix matrix = COLOUR_BT601, bool full_range = false,
+            PixelLayout layout = PIXEL_RGB24);
+
+    void set(ColourMatrix matrix, bool full_range);
+    void set_layout(PixelLayout layout);
+    void set_for_format(const BaseFormat & fmt);
+    const char * name() const;
+    const YuvCoeffs & coeffs() const {return m_coeffs;};
+    PixelLayout layout() const {return m_layout;};
+
+    bool prepare(const BaseFormat & fmt) const;
+    bool convert(const BaseFormat & fmt, const uint8_t * const * planes,
+            unsigned bytes, uint8_t * dst, unsigned dst_stride) const;
+    bool convert_rows(const BaseFormat & fmt, const uint8_t * const * planes,
+            unsigned bytes, unsigned first_row, unsigned num_rows, uint8_t * dst,
+            unsigned dst_stride) const;
+    void yuv_row(const uint8_t * y, const uint8_t * u, const uint8_t * v,
+            unsigned width, uint8_t * rgb) const;
+
+    void rgb24_to_yuyv(const uint8_t * src, unsigned width, unsigned height,
+            unsigned src_stride, uint8_t * dst, unsigned dst_stride) const;
+    void rgb24_to_yuv420(const uint8_t * src, unsigned width, unsigned height,
+            unsigned src_stride, uint8_t * dst) const;
+};
+
+extern void yuv_row_scalar(const YuvCoeffs & c, const uint8_t * y,
+        const uint8_t * u, const uint8_t * v, unsigned width, uint8_t * rgb);
+extern void rgb_yuyv_row_scalar(const YuvCoeffs & c, const uint8_t * rgb,
+        unsigned width, uint8_t * yuyv);
+extern void rgb_luma_row_scalar(const YuvCoeffs & c, const uint8_t * rgb,
+        unsigned width, uint8_t * y);
+extern void rgb_chroma420_row_scalar(const YuvCoeffs & c, const uint8_t * rgb0,
+        const uint8_t * rgb1, unsigned width, uint8_t * u, uint8_t * v);
+
+#endif
@@ -11,6 +11,7 @@
 class CtrlCallback
 {
 public:
+    virtual ~CtrlCallback() {};
     virtual bool set_control_value(int, int32_t) = 0;
     virtual int32_t get_control_value(int) = 0;
 };
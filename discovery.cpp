@@ -0,0 +1,240 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capture.h"
+#include "logging.h"
+#include "discovery.h"
+
+#define V4L2_MAJOR  (81)
+
+/**
+ * Give a devpath, check that it is a devnode for a v4l2 device
+ * (should do this before attempting to open a device)
+ *
+ * @param[in] devpath The devpath
+ *
+ * @return true if so
+ */
+static bool check_is_camera_dev(std::string & devpath)
+{
+    struct stat buf;
+    const int status = ::stat(devpath.c_str(), &buf);
+    if(status == 0) {
+        if((buf.st_mode & (S_IFBLK | S_IFCHR)) != 0) {
+            /* A dev node */
+            if(major(buf.st_rdev) == V4L2_MAJOR) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void check_dir_for_camera_dev(std::vector<std::string> & poss,
+        const char * path, const char * prefix)
+{
+    const size_t prefix_len = prefix ? strlen(prefix) : 0;
+    DIR * dir = opendir(path);
+    if(dir) {
+        struct dirent * entry;
+        while(NULL != (entry = readdir(dir))) {
+            if((entry->d_name[0] == '.') 
+                && (((entry->d_name[1] == '.') 
+                  && (entry->d_name[2] == '\0'))
+                  || (entry->d_name[1] == '\0'))) {
+                continue;
+            }
+            if(prefix_len > 0) {
+                if(strncmp(entry->d_name, prefix, prefix_len) != 0) {
+                    continue;
+                }
+            }
+            std::string devpath(path);
+            devpath += "/";
+            devpath += entry->d_name;
+            if(check_is_camera_dev(devpath)) {
+                LOG_DEBUG("Found file %s", devpath.c_str());
+                poss.push_back(devpath);
+            }
+        }
+        closedir(dir);
+    }
+}
+
+#if 0
+void parse_for_dev_details(string & filepath)
+{
+    filepath += "/dev";
+    FILE * in_fp = fopen(filepa
+}
+#endif
+
+/**
+ * Shared between discover_cameras and one probe thread. If the probe
+ * outlives the timeout it is abandoned and the thread cleans up after
+ * itself whenever the device finally answers.
+ */
+struct Probe
+{
+    std::string devpath;
+    Camera * cam;
+    bool done;
+    bool abandoned;
+};
+
+struct ProbeSet
+{
+    std::mutex lock;
+    std::condition_variable changed;
+    unsigned outstanding;
+};
+
+static void probe_thread(std::shared_ptr<ProbeSet> set, std::shared_ptr<Probe> probe)
+{
+    Camera * cam = NULL;
+    try {
+        cam = new Camera(probe->devpath);
+        if(!cam->init()) {
+            cam->close();
+            delete cam;
+            cam = NULL;
+        }
+    }
+    catch(Camera_error &) {
+        cam = NULL;
+    }
+
+    std::lock_guard<std::mutex> guard(set->lock);
+    if(probe->abandoned) {
+        LOG_WARN("%s answered too late", probe->devpath.c_str());
+        if(cam) {
+            cam->close();
+            delete cam;
+        }
+    }
+    else {
+        probe->cam = cam;
+        probe->done = true;
+        set->outstanding--;
+        set->changed.notify_all();
+    }
+}
+
+/**
+ * Higher is better: streaming capture devices with a camera input first,
+ * then those we already have a profile for
+ */
+static int rank_camera(Camera * cam)
+{
+    int rank = 0;
+    const uint32_t caps = cam->caps();
+    if(caps & V4L2_CAP_VIDEO_CAPTURE) {
+        rank += 4;
+    }
+    if(caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+        rank += 2;
+    }
+    if(cam->using_profile()) {
+        rank += 1;
+    }
+    return rank;
+}
+
+static bool by_rank(const CameraInfo & a, const CameraInfo & b)
+{
+    return a.rank > b.rank;
+}
+
+/**
+ * Probe every v4l2 node at once, so one slow or wedged device doesn't
+ * hold up the rest.
+ *
+ * @param[in] timeout_ms How long to wait for all the probes
+ *
+ * @return Usable cameras, best first
+ */
+std::vector<CameraInfo> discover_cameras(unsigned timeout_ms)
+{
+    std::vector<std::string> poss;
+    std::vector<std::shared_ptr<Probe> > probes;
+    std::vector<CameraInfo> found;
+    std::vector<std::string>::iterator p;
+    unsigned i;
+
+    check_dir_for_camera_dev(poss, "/dev/v4l/by-path", NULL);
+    if(poss.empty()) {
+        check_dir_for_camera_dev(poss, "/dev", "video");
+    }
+
+    std::shared_ptr<ProbeSet> set(new ProbeSet);
+    set->outstanding = poss.size();
+    for(p = poss.begin(); p != poss.end(); p++) {
+        LOG_INFO("Possible camera %s", p->c_str());
+        std::shared_ptr<Probe> probe(new Probe);
+        probe->devpath = *p;
+        probe->cam = NULL;
+        probe->done = false;
+        probe->abandoned = false;
+        probes.push_back(probe);
+        std::thread(probe_thread, set, probe).detach();
+    }
+
+    std::unique_lock<std::mutex> guard(set->lock);
+    set->changed.wait_for(guard, std::chrono::milliseconds(timeout_ms),
+            [&set] {return set->outstanding == 0;});
+    for(i = 0; i < probes.size(); i++) {
+        Probe & probe = *probes[i];
+        if(!probe.done) {
+            LOG_WARN("%s timed out", probe.devpath.c_str());
+            probe.abandoned = true;
+        }
+        else if(probe.cam) {
+            CameraInfo info;
+            info.devpath = probe.devpath;
+            info.cam = probe.cam;
+            info.caps = probe.cam->caps();
+            info.rank = rank_camera(probe.cam);
+            found.push_back(info);
+        }
+    }
+    guard.unlock();
+
+    std::stable_sort(found.begin(), found.end(), by_rank);
+    return found;
+}
+
+/**
+ * Find the best camera, any others found are closed
+ */
+Camera * find_camera_dev()
+{
+    std::vector<CameraInfo> found = discover_cameras(PROBE_TIMEOUT_MS);
+    std::vector<CameraInfo>::iterator p;
+    Camera * best = NULL;
+
+    for(p = found.begin(); p != found.end(); p++) {
+        if(!best) {
+            LOG_INFO("Using camera %s (%s)", p->devpath.c_str(), p->cam->card().c_str());
+            best = p->cam;
+        }
+        else {
+            p->cam->close();
+            delete p->cam;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,33 @@
+#ifndef _DISCOVERY_H_
+#define _DISCOVERY_H_
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+class Camera;
+
+/* How long a device gets to open and answer before we give up on it */
+#define PROBE_TIMEOUT_MS (2000)
+
+/**
+ * A camera found by discover_cameras, already opened and initialised. The
+ * caller owns cam.
+ */
+struct CameraInfo
+{
+    std::string devpath;
+    Camera * cam;
+    uint32_t caps;
+    int rank;
+};
+
+extern void check_dir_for_camera_dev(std::vector<std::string> & poss,
+        const char * path, const char * prefix);
+
+extern std::vector<CameraInfo> discover_cameras(unsigned timeout_ms);
+
+extern Camera * find_camera_dev();
+
+#endif
@@ -1,6 +1,11 @@
+#include <map>
 #include <string>
 
+#include <math.h>
+#include <string.h>
+
 #include "format.h"
+#include "luma.h"
 
 const std::string BaseFormat::pix_fmt_str() const
 {
@@ -13,50 +18,437 @@ const std::string BaseFormat::pix_fmt_str() const
     return buf;
 }
 
-void BaseFormat::init(unsigned width, unsigned height, unsigned bytesperline)
+void BaseFormat::init(unsigned width, unsigned height, unsigned bytesperline,
+        unsigned sizeimage)
 {
     m_width = width;
     m_height = height;
     m_bytesperline = bytesperline;
+    m_sizeimage = sizeimage;
+    m_num_planes = 1;
+    m_plane_bytesperline[0] = bytesperline;
+    m_plane_size[0] = image_size();
 }
 
-BaseFormat * create_format_obj(uint32_t pixelformat)
+/**
+ * Initialise for a multi-planar (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) format
+ * where each plane is in its own buffer. bytesperline() and image_size()
+ * then describe the first plane, which is luma for the YUV formats.
+ */
+void BaseFormat::init_planes(unsigned width, unsigned height, unsigned num_planes,
+        const unsigned * bytesperline, const unsigned * sizeimage)
 {
-    switch(pixelformat)
-    {
-    case YUYV::PIX_FMT:
-        return new YUYV();
+    unsigned p;
+
+    init(width, height, bytesperline[0], sizeimage[0]);
+    m_num_planes = num_planes;
+    for(p = 0; p < num_planes; p++) {
+        m_plane_bytesperline[p] = bytesperline[p];
+        m_plane_size[p] = sizeimage[p];
     }
-    return NULL;
 }
 
+/**
+ * Record how the driver says the samples are encoded, from the fields of
+ * the same names in v4l2_pix_format
+ */
+void BaseFormat::set_colorimetry(uint32_t colorspace, uint32_t ycbcr_enc,
+        uint32_t quantization)
+{
+    m_colorspace = colorspace;
+    m_ycbcr_enc = ycbcr_enc;
+    m_quantization = quantization;
+}
 
-uint32_t YUYV::pix_fmt() const {return PIX_FMT;};
+/**
+ * @return The Y'CbCr encoding, with the default worked out from the
+ * colorspace as the V4L2 spec says
+ */
+uint32_t BaseFormat::ycbcr_enc() const
+{
+    if(m_ycbcr_enc != V4L2_YCBCR_ENC_DEFAULT) {
+        return m_ycbcr_enc;
+    }
+    return V4L2_MAP_YCBCR_ENC_DEFAULT(m_colorspace);
+}
+
+/**
+ * @return Full or limited range, with the default worked out as the V4L2
+ * spec says
+ */
+uint32_t BaseFormat::quantization() const
+{
+    if(m_quantization != V4L2_QUANTIZATION_DEFAULT) {
+        return m_quantization;
+    }
+    const bool rgb = (pix_fmt() == V4L2_PIX_FMT_RGB24);
+    return V4L2_MAP_QUANTIZATION_DEFAULT(rgb, m_colorspace, ycbcr_enc());
+}
+
+/**
+ * Bytes needed to hold one frame, the driver's sizeimage if it gave one
+ */
+unsigned BaseFormat::image_size() const
+{
+    const unsigned min_size = min_image_size();
+    return m_sizeimage > min_size ? m_sizeimage : min_size;
+}
+
+/**
+ * Add a weighted region, clipped to the frame
+ *
+ * @param[in] left, top Top left corner, as fractions of the frame size
+ * @param[in] width, height Size, as fractions of the frame size
+ * @param[in] weight How many times each sample in it counts
+ */
+void MeteringConfig::add_region(float left, float top, float width, float height,
+        unsigned weight)
+{
+    MeteringRegion region;
+
+    region.left = left < 0 ? 0 : left;
+    region.top = top < 0 ? 0 : top;
+    region.width = region.left + width > 1 ? 1 - region.left : width;
+    region.height = region.top + height > 1 ? 1 - region.top : height;
+    region.weight = weight;
+    if((region.width > 0) && (region.height > 0) && (weight > 0)) {
+        regions.push_back(region);
+    }
+}
 
-void YUYV::check_quality(uint8_t * data, unsigned bytes, ImageQuality & qual) const
-{
-    unsigned int min_luma = 255;
-    unsigned int max_luma = 0;
-    __u64 luma_sum = 0;
-//    int luma_mean;
-    unsigned x, y;
-
-    const unsigned extra = m_bytesperline - m_width*2;
-    for(y = 0; y < m_height; y++) {
-        for(x = 0; x < m_width; x++) {
-            const uint8_t val = *data++;
-            data++;
-            if(val > max_luma) {
-                max_luma = val;
+/**
+ * The usual centre weighted pattern, the whole frame plus the middle half
+ * of it again three times over, so the centre is three quarters of the
+ * result
+ */
+MeteringConfig MeteringConfig::center_weighted(unsigned step)
+{
+    MeteringConfig config(step);
+
+    config.add_region(0, 0, 1, 1, 1);
+    config.add_region(0.25, 0.25, 0.5, 0.5, 3);
+    return config;
+}
+
+QualitySums::QualitySums(bool histogram) : sum(0), count(0), min(255), max(0),
+    with_histogram(histogram)
+{
+    if(with_histogram) {
+        memset(this->histogram, 0, sizeof(this->histogram));
+    }
+}
+
+void QualitySums::merge(const QualitySums & other)
+{
+    unsigned i;
+
+    sum += other.sum;
+    count += other.count;
+    if(other.count) {
+        if(other.min < min) {
+            min = other.min;
+        }
+        if(other.max > max) {
+            max = other.max;
+        }
+    }
+    if(with_histogram && other.with_histogram) {
+        for(i = 0; i < LUMA_LEVELS; i++) {
+            histogram[i] += other.histogram[i];
+        }
+    }
+}
+
+/**
+ * Fill in qual from the totals
+ */
+void QualitySums::finish(ImageQuality & qual) const
+{
+    unsigned i;
+
+    qual.luma_mean = count ? static_cast<unsigned>(sum / count) : 0;
+    qual.luma_max = max;
+    qual.luma_min = min;
+    if(!qual.with_histogram || !with_histogram) {
+        return;
+    }
+    memcpy(qual.histogram, histogram, sizeof(qual.histogram));
+    if(!count) {
+        return;
+    }
+
+    const double mean = static_cast<double>(sum) / count;
+    double var = 0;
+    uint64_t clipped = 0;
+    for(i = 0; i < LUMA_LEVELS; i++) {
+        const double d = i - mean;
+        var += d * d * histogram[i];
+        if(i >= LUMA_CLIP_LEVEL) {
+            clipped += histogram[i];
+        }
+    }
+    qual.luma_p1 = luma_percentile(histogram, count, 1.0);
+    qual.luma_p50 = luma_percentile(histogram, count, 50.0);
+    qual.luma_p99 = luma_percentile(histogram, count, 99.0);
+    qual.clipped = static_cast<float>(clipped) / count;
+    qual.contrast = sqrt(var / count) / 255.0;
+}
+
+/**
+ * Add the luma samples of one band of rows to sums, over the metering
+ * regions. Regions and the sub-sampling grid are laid over the whole
+ * image, so any split into bands gives the same totals.
+ *
+ * @param[in] band The first luma sample of row first_row
+ * @param[in] width Samples per row
+ * @param[in] height Rows in the whole image, which may be short of m_height
+ * @param[in] bytesperline Distance between rows
+ * @param[in] pixel_stride Distance between luma samples in a row
+ * @param[in] step_x, step_y Sub-sampling, 1 if luma is already sub-sampled
+ * @param[in] first_row, num_rows The band
+ * @param[in,out] sums Totals to add to
+ */
+void BaseFormat::luma_sums(const uint8_t * band, unsigned width, unsigned height,
+        unsigned bytesperline, unsigned pixel_stride, unsigned step_x,
+        unsigned step_y, unsigned first_row, unsigned num_rows,
+        QualitySums & sums) const
+{
+    if(!step_x) {
+        step_x = 1;
+    }
+    if(!step_y) {
+        step_y = 1;
+    }
+    /* Called for every band of every frame, so no copy of the regions */
+    static const MeteringRegion whole = {0, 0, 1, 1, 1};
+    const std::vector<MeteringRegion> & regions = m_metering.regions;
+    const MeteringRegion * p = regions.empty() ? &whole : &regions[0];
+    const MeteringRegion * const end = regions.empty() ? &whole + 1 : p + regions.size();
+    const unsigned band_end = first_row + num_rows;
+    uint32_t hist[LUMA_LEVELS];
+    unsigned i;
+
+    for(; p != end; p++) {
+        const unsigned x0 = p->left * width;
+        const unsigned y0 = p->top * height;
+        const unsigned x1 = (p->left + p->width) * width;
+        const unsigned y1 = (p->top + p->height) * height;
+        const unsigned cols = (x1 - x0 + step_x - 1) / step_x;
+        /* First row of the region's grid inside the band */
+        const unsigned skip = first_row > y0 ? (first_row - y0 + step_y - 1) / step_y : 0;
+        const unsigned top = y0 + skip * step_y;
+        const unsigned bottom = y1 < band_end ? y1 : band_end;
+        LumaStats stats;
+
+        if((x1 <= x0) || (top >= bottom)) {
+            continue;
+        }
+        const unsigned rows = (bottom - top + step_y - 1) / step_y;
+        const uint8_t * start = band + static_cast<size_t>(top - first_row) * bytesperline
+            + x0 * pixel_stride;
+
+        if(sums.with_histogram) {
+            luma_histogram(start, cols, rows, bytesperline * step_y,
+                    pixel_stride * step_x, hist, stats);
+            for(i = 0; i < LUMA_LEVELS; i++) {
+                sums.histogram[i] += hist[i] * p->weight;
             }
-            else if(val < min_luma) {
-                min_luma = val;
+        }
+        else {
+            luma_stats(start, cols, rows, bytesperline * step_y,
+                    pixel_stride * step_x, stats);
+        }
+        sums.sum += stats.sum * p->weight;
+        sums.count += stats.count * p->weight;
+        if(stats.count) {
+            if(stats.min < sums.min) {
+                sums.min = stats.min;
+            }
+            if(stats.max > sums.max) {
+                sums.max = stats.max;
             }
-            luma_sum += val;
         }
-        data += extra;
     }
-    qual.luma_mean = static_cast<int>(luma_sum/(m_width*m_height));
-    qual.luma_max = max_luma;
-    qual.luma_min = min_luma;
 }
+
+/**
+ * Luma statistics over the whole frame, or as many complete rows as the
+ * driver filled
+ *
+ * @param[in] data The frame
+ * @param[in] bytes Bytes the driver put in the buffer
+ * @param[out] qual The statistics
+ *
+ * @return true if the frame could be measured
+ */
+bool BaseFormat::check_quality(uint8_t * data, unsigned bytes, ImageQuality & qual) const
+{
+    QualitySums sums(qual.with_histogram);
+
+    if(!quality_sums(data, bytes, 0, m_height, sums)) {
+        return false;
+    }
+    sums.finish(qual);
+    return true;
+}
+
+/**
+ * Complete rows of the first plane in a buffer of bytes
+ */
+unsigned BaseFormat::rows_in(unsigned bytes) const
+{
+    if(m_bytesperline && (bytes / m_bytesperline < m_height)) {
+        return bytes / m_bytesperline;
+    }
+    return m_height;
+}
+
+typedef std::map<uint32_t, FormatFactory> FormatRegistry;
+
+/**
+ * Function local so it is built before the first REGISTER_FORMAT runs,
+ * whichever file that is in
+ */
+static FormatRegistry & registry()
+{
+    static FormatRegistry formats;
+    return formats;
+}
+
+void register_format(uint32_t pixelformat, FormatFactory factory)
+{
+    registry()[pixelformat] = factory;
+}
+
+/**
+ * @return A new format object for pixelformat, or NULL if none is
+ * registered
+ */
+BaseFormat * create_format_obj(uint32_t pixelformat)
+{
+    FormatRegistry::const_iterator p = registry().find(pixelformat);
+    if(p == registry().end()) {
+        return NULL;
+    }
+    return p->second();
+}
+
+/**
+ * @return true if we have a BaseFormat for pixelformat
+ */
+bool format_supported(uint32_t pixelformat)
+{
+    BaseFormat * obj = create_format_obj(pixelformat);
+    delete obj;
+    return obj != NULL;
+}
+
+
+/**
+ * Add one band of rows to sums
+ *
+ * @param[in] data The frame
+ * @param[in] bytes Bytes the driver put in the buffer
+ * @param[in] first_row, num_rows The band, clipped to the rows in bytes
+ * @param[in,out] sums Totals to add to
+ *
+ * @return true if the frame could be measured
+ */
+bool LumaFormat::quality_sums(const uint8_t * data, unsigned bytes,
+        unsigned first_row, unsigned num_rows, QualitySums & sums) const
+{
+    const unsigned rows = rows_in(bytes);
+
+    if(first_row >= rows) {
+        return true;
+    }
+    luma_sums(data + static_cast<size_t>(first_row) * m_bytesperline, m_width, rows,
+            m_bytesperline, luma_stride(), m_metering.step_x, m_metering.step_y,
+            first_row, num_rows, sums);
+    return true;
+}
+
+/**
+ * Copy the luma out as a plain grey image
+ *
+ * @param[in] data The frame
+ * @param[in] bytes Bytes the driver put in the buffer
+ * @param[out] dst width() x height() bytes
+ * @param[in] dst_stride Distance between rows of dst
+ *
+ * @return false if the frame is short
+ */
+bool LumaFormat::extract_luma(const uint8_t * data, unsigned bytes, uint8_t * dst,
+        unsigned dst_stride) const
+{
+    if(rows_in(bytes) < m_height) {
+        return false;
+    }
+    luma_extract(data, m_width, m_height, m_bytesperline, luma_stride(), dst,
+            dst_stride);
+    return true;
+}
+
+uint32_t YUYV::pix_fmt() const {return PIX_FMT;};
+REGISTER_FORMAT(YUYV);
+
+uint32_t GREY::pix_fmt() const {return PIX_FMT;};
+REGISTER_FORMAT(GREY);
+
+uint32_t NV12::pix_fmt() const {return PIX_FMT;};
+REGISTER_FORMAT(NV12);
+
+uint32_t NV12M::pix_fmt() const {return PIX_FMT;};
+REGISTER_FORMAT(NV12M);
+
+uint32_t YUV420::pix_fmt() const {return PIX_FMT;};
+REGISTER_FORMAT(YUV420);
+
+uint32_t RGB24::pix_fmt() const {return PIX_FMT;};
+REGISTER_FORMAT(RGB24);
+
+/**
+ * Luma is converted from only the pixels the metering grid reads, then
+ * measured like any other luma. The grid starts at row 0, so the band is
+ * widened to whole grid rows.
+ */
+bool RGB24::quality_sums(const uint8_t * data, unsigned bytes, unsigned first_row,
+        unsigned num_rows, QualitySums & sums) const
+{
+    static thread_local std::vector<uint8_t> scratch;
+    const unsigned step_x = m_metering.step_x ? m_metering.step_x : 1;
+    const unsigned step_y = m_metering.step_y ? m_metering.step_y : 1;
+    const unsigned rows = rows_in(bytes);
+    const unsigned band_end = first_row + num_rows < rows ? first_row + num_rows : rows;
+    const unsigned cols = (m_width + step_x - 1) / step_x;
+    const unsigned samples = (rows + step_y - 1) / step_y;
+    const unsigned first_sample = (first_row + step_y - 1) / step_y;
+    const unsigned end_sample = (band_end + step_y - 1) / step_y;
+
+    if(first_sample >= end_sample) {
+        return true;
+    }
+    const unsigned band_samples = end_sample - first_sample;
+    scratch.resize(static_cast<size_t>(cols) * band_samples);
+    rgb24_luma(data + static_cast<size_t>(first_sample) * step_y * m_bytesperline,
+            m_width, (band_samples - 1) * step_y + 1, m_bytesperline, step_x, step_y,
+            &scratch[0], cols);
+    luma_sums(&scratch[0], cols, samples, cols, 1, 1, 1, first_sample, band_samples, sums);
+    return true;
+}
+
+bool RGB24::extract_luma(const uint8_t * data, unsigned bytes, uint8_t * dst,
+        unsigned dst_stride) const
+{
+    if(rows_in(bytes) < m_height) {
+        return false;
+    }
+    rgb24_luma(data, m_width, m_height, m_bytesperline, 1, 1, dst, dst_stride);
+    return true;
+}
+
+uint32_t MJPEG::pix_fmt() const {return PIX_FMT;};
+REGISTER_FORMAT(MJPEG);
+
+uint32_t JPEG::pix_fmt() const {return PIX_FMT;};
+REGISTER_FORMAT(JPEG);
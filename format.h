@@ -5,42 +5,297 @@
 #include <linux/videodev2.h>
 
 #include <string>
+#include <vector>
 
+/* Luma at or above this counts as a clipped highlight */
+#define LUMA_CLIP_LEVEL (250)
+
+/**
+ * What check_quality found. Mean, min and max are always filled in; set
+ * with_histogram to also get the histogram and what is derived from it,
+ * at the cost of counting every sample.
+ */
 struct ImageQuality
 {
     unsigned int luma_mean;
     unsigned int luma_max;
     unsigned int luma_min;
+
+    bool with_histogram;
+    uint32_t histogram[256];
+    unsigned int luma_p1;
+    unsigned int luma_p50;
+    unsigned int luma_p99;
+    float clipped;          /* fraction of samples >= LUMA_CLIP_LEVEL */
+    float contrast;         /* RMS contrast, standard deviation / 255 */
+
+    ImageQuality(bool histogram = false) : luma_mean(0), luma_max(0),
+        luma_min(0), with_histogram(histogram), luma_p1(0), luma_p50(0),
+        luma_p99(0), clipped(0), contrast(0) {};
+};
+
+/**
+ * The running totals behind an ImageQuality. Each band of a frame can be
+ * measured into its own QualitySums and the results merged, finish()
+ * then works out what is derived from the totals.
+ */
+struct QualitySums
+{
+    uint64_t sum;
+    uint64_t count;
+    unsigned int min;
+    unsigned int max;
+    bool with_histogram;
+    uint32_t histogram[256];
+
+    QualitySums(bool histogram = false);
+    void merge(const QualitySums & other);
+    void finish(ImageQuality & qual) const;
+};
+
+/**
+ * Part of the frame to meter, as fractions of its width and height
+ */
+struct MeteringRegion
+{
+    float left;
+    float top;
+    float width;
+    float height;
+    unsigned weight;
+};
+
+/**
+ * Which samples check_quality looks at. Only every step_x'th column of
+ * every step_y'th row is read, so the cost follows the number of samples
+ * rather than the resolution. Each region's samples count weight times;
+ * with no regions the whole frame is metered evenly.
+ */
+struct MeteringConfig
+{
+    unsigned step_x;
+    unsigned step_y;
+    std::vector<MeteringRegion> regions;
+
+    MeteringConfig(unsigned step = 1) : step_x(step), step_y(step) {};
+
+    void add_region(float left, float top, float width, float height,
+            unsigned weight = 1);
+    static MeteringConfig center_weighted(unsigned step = 1);
 };
 
 class BaseFormat 
 {
 protected:
+    void luma_sums(const uint8_t * band, unsigned width, unsigned height,
+            unsigned bytesperline, unsigned pixel_stride, unsigned step_x,
+            unsigned step_y, unsigned first_row, unsigned num_rows,
+            QualitySums & sums) const;
+    unsigned rows_in(unsigned bytes) const;
+    virtual unsigned min_image_size() const {return m_bytesperline * m_height;};
+
+    MeteringConfig m_metering;
+
     unsigned m_width;
     unsigned m_height;
     unsigned m_bytesperline;
+    unsigned m_sizeimage;
+    unsigned m_num_planes;
+    unsigned m_plane_bytesperline[VIDEO_MAX_PLANES];
+    unsigned m_plane_size[VIDEO_MAX_PLANES];
+    uint32_t m_colorspace;
+    uint32_t m_ycbcr_enc;
+    uint32_t m_quantization;
 
 public:
+    BaseFormat() : m_width(0), m_height(0), m_bytesperline(0), m_sizeimage(0),
+        m_num_planes(1), m_colorspace(V4L2_COLORSPACE_DEFAULT),
+        m_ycbcr_enc(V4L2_YCBCR_ENC_DEFAULT),
+        m_quantization(V4L2_QUANTIZATION_DEFAULT) {};
+    virtual ~BaseFormat() {};
     virtual uint32_t pix_fmt() const = 0;
-    virtual void check_quality(uint8_t *, unsigned, ImageQuality &) const = 0;
+    virtual bool check_quality(uint8_t * data, unsigned bytes, ImageQuality & qual) const;
+    virtual bool quality_sums(const uint8_t *, unsigned, unsigned, unsigned,
+            QualitySums &) const {return false;};
+    virtual bool extract_luma(const uint8_t * data, unsigned bytes, uint8_t * dst,
+            unsigned dst_stride) const = 0;
+    virtual unsigned default_bytesperline(unsigned width) const {return width;};
+    virtual bool compressed() const {return false;};
+    /* True if the first plane starts with width bytes of luma per row */
+    virtual bool planar_luma() const {return false;};
     const std::string pix_fmt_str() const;
-    void init(unsigned width, unsigned height, unsigned bytesperline);
+    void init(unsigned width, unsigned height, unsigned bytesperline,
+            unsigned sizeimage = 0);
+    void init_planes(unsigned width, unsigned height, unsigned num_planes,
+            const unsigned * bytesperline, const unsigned * sizeimage);
     unsigned height() const {return m_height;};
     unsigned width() const {return m_width;};
+    unsigned bytesperline() const {return m_bytesperline;};
+    unsigned image_size() const;
+    unsigned num_planes() const {return m_num_planes;};
+    unsigned plane_bytesperline(unsigned p) const {return m_plane_bytesperline[p];};
+    unsigned plane_size(unsigned p) const {return m_plane_size[p];};
+    void set_colorimetry(uint32_t colorspace, uint32_t ycbcr_enc, uint32_t quantization);
+    uint32_t colorspace() const {return m_colorspace;};
+    uint32_t ycbcr_enc() const;
+    uint32_t quantization() const;
+    void set_metering(const MeteringConfig & metering) {m_metering = metering;};
+    const MeteringConfig & metering() const {return m_metering;};
 };
 
 BaseFormat * create_format_obj(uint32_t pixelformat);
+bool format_supported(uint32_t pixelformat);
+
+typedef BaseFormat * (*FormatFactory)();
+void register_format(uint32_t pixelformat, FormatFactory factory);
+
+template<class T> BaseFormat * make_format() {return new T();}
+
+/**
+ * Put this by a format's implementation to make create_format_obj (and so
+ * the negotiator) know about it
+ */
+#define REGISTER_FORMAT(cls) \
+    static const bool cls##_registered __attribute__((unused)) = \
+        (register_format(cls::PIX_FMT, make_format<cls>), true)
+
+/**
+ * Formats whose luma can be read where it lies, a run of samples
+ * luma_stride() bytes apart at the start of the buffer (or first plane)
+ */
+class LumaFormat : public BaseFormat
+{
+protected:
+    virtual unsigned luma_stride() const = 0;
+
+public:
+    virtual bool quality_sums(const uint8_t * data, unsigned bytes,
+            unsigned first_row, unsigned num_rows, QualitySums & sums) const;
+    virtual bool extract_luma(const uint8_t * data, unsigned bytes, uint8_t * dst,
+            unsigned dst_stride) const;
+    virtual bool planar_luma() const {return luma_stride() == 1;};
+};
 
 /**
  * In this format each four bytes is two pixels.
  * Each four bytes is two Y's, a Cb and a Cr.
  */
-class YUYV : public BaseFormat
+class YUYV : public LumaFormat
 {
+protected:
+    virtual unsigned luma_stride() const {return 2;};
+
 public:
     static const uint32_t PIX_FMT = V4L2_PIX_FMT_YUYV;
     virtual uint32_t pix_fmt() const;
-    virtual void check_quality(uint8_t *, unsigned, ImageQuality &) const;
+    virtual unsigned default_bytesperline(unsigned width) const {return width * 2;};
+};
+
+/**
+ * 8 bit luma only
+ */
+class GREY : public LumaFormat
+{
+protected:
+    virtual unsigned luma_stride() const {return 1;};
+
+public:
+    static const uint32_t PIX_FMT = V4L2_PIX_FMT_GREY;
+    virtual uint32_t pix_fmt() const;
+};
+
+/**
+ * A plane of Y, then a plane of interleaved Cb,Cr at half the width and
+ * half the height
+ */
+class NV12 : public LumaFormat
+{
+protected:
+    virtual unsigned luma_stride() const {return 1;};
+    /* An odd height still has a chroma row for its last luma row */
+    virtual unsigned min_image_size() const
+    {
+        return m_bytesperline * m_height + m_bytesperline * ((m_height + 1) / 2);
+    };
+
+public:
+    static const uint32_t PIX_FMT = V4L2_PIX_FMT_NV12;
+    virtual uint32_t pix_fmt() const;
+};
+
+/**
+ * NV12 with the two planes in separate buffers
+ */
+class NV12M : public NV12
+{
+protected:
+    virtual unsigned min_image_size() const {return m_bytesperline * m_height;};
+
+public:
+    static const uint32_t PIX_FMT = V4L2_PIX_FMT_NV12M;
+    virtual uint32_t pix_fmt() const;
+};
+
+/**
+ * I420, a plane of Y then a plane each of Cb and Cr at half the width and
+ * half the height
+ */
+class YUV420 : public LumaFormat
+{
+protected:
+    virtual unsigned luma_stride() const {return 1;};
+    virtual unsigned min_image_size() const
+    {
+        return m_bytesperline * m_height + 2 * (m_bytesperline / 2) * ((m_height + 1) / 2);
+    };
+
+public:
+    static const uint32_t PIX_FMT = V4L2_PIX_FMT_YUV420;
+    virtual uint32_t pix_fmt() const;
+};
+
+/**
+ * Three bytes per pixel, R then G then B. Luma has to be worked out, so
+ * only the samples the metering wants are converted.
+ */
+class RGB24 : public BaseFormat
+{
+public:
+    static const uint32_t PIX_FMT = V4L2_PIX_FMT_RGB24;
+    virtual uint32_t pix_fmt() const;
+    virtual bool quality_sums(const uint8_t * data, unsigned bytes,
+            unsigned first_row, unsigned num_rows, QualitySums & sums) const;
+    virtual bool extract_luma(const uint8_t * data, unsigned bytes, uint8_t * dst,
+            unsigned dst_stride) const;
+    virtual unsigned default_bytesperline(unsigned width) const {return width * 3;};
+};
+
+/**
+ * Motion JPEG, each frame a JPEG of varying size. There is nothing to
+ * measure without decoding it, frames are passed through as they are with
+ * MjpegFrame.
+ */
+class MJPEG : public BaseFormat
+{
+protected:
+    virtual unsigned min_image_size() const {return 0;};
+
+public:
+    static const uint32_t PIX_FMT = V4L2_PIX_FMT_MJPEG;
+    virtual uint32_t pix_fmt() const;
+    virtual bool extract_luma(const uint8_t *, unsigned, uint8_t *, unsigned) const {return false;};
+    virtual unsigned default_bytesperline(unsigned) const {return 0;};
+    virtual bool compressed() const {return true;};
+};
+
+/**
+ * Plain JPEG, some cameras use this fourcc for the same stream
+ */
+class JPEG : public MJPEG
+{
+public:
+    static const uint32_t PIX_FMT = V4L2_PIX_FMT_JPEG;
+    virtual uint32_t pix_fmt() const;
 };
 
 #endif
@@ -0,0 +1,22 @@
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * What the driver told us about a dequeued frame
+ */
+struct FrameMeta
+{
+    int index;              /* Buffer index */
+    uint32_t sequence;      /* Driver frame counter, gaps are drops */
+    uint32_t flags;         /* V4L2_BUF_FLAG_xxx */
+    uint32_t field;         /* enum v4l2_field */
+    uint32_t bytesused;     /* Of the first plane */
+    uint64_t timestamp_ns;  /* Driver timestamp */
+    uint64_t dequeued_ns;   /* CLOCK_MONOTONIC when we got it */
+    bool monotonic;         /* timestamp_ns is on CLOCK_MONOTONIC */
+};
+
+#endif
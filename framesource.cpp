@@ -0,0 +1,40 @@
+#include "logging.h"
+#include "framesource.h"
+#include "tiles.h"
+
+/**
+ * Measure the frame in buffer n and nudge the brightness towards mid grey
+ *
+ * @param[in] n The buffer
+ * @param[in] left Frames left before we stop
+ * @param[in] bytes_avail Bytes in the buffer
+ *
+ * @return true when it's time to stop
+ */
+int FrameSource::check_quality(int n, int left, uint32_t bytes_avail)
+{
+    ImageQuality qual(true);
+    uint8_t * src = buf_start(n);
+    const uint32_t id = brightness_control();
+
+    const bool measured = m_tiles ? m_tiles->check_quality(*fmt(), src, bytes_avail, qual)
+        : fmt()->check_quality(src, bytes_avail, qual);
+
+    if(!measured) {
+        LOG_DEBUG("Cannot measure %s frames", fmt()->pix_fmt_str().c_str());
+        return left == 0;
+    }
+
+    LOG_INFO("Luma, min=%i, max=%i, mean=%i, p1=%i, p50=%i, p99=%i, clipped=%.3f, contrast=%.3f",
+            qual.luma_min, qual.luma_max, qual.luma_mean, qual.luma_p1,
+            qual.luma_p50, qual.luma_p99, qual.clipped, qual.contrast);
+    if(id) {
+        if(qual.luma_mean > 128) {
+            set_control_value(id, get_control_value(id)-1);
+        }
+        else {
+            set_control_value(id, get_control_value(id)+1);
+        }
+    }
+    return left == 0;
+}
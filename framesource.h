@@ -0,0 +1,73 @@
+#ifndef _FRAMESOURCE_H_
+#define _FRAMESOURCE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "colour.h"
+#include "control.h"
+#include "format.h"
+#include "frame.h"
+#include "stats.h"
+
+class TileScheduler;
+
+/**
+ * Something that produces frames with V4L2 style buffer semantics: request
+ * a set of buffers, queue them, and dequeue them again as they are filled.
+ * Camera is the real thing, ReplaySource plays back a recording so that
+ * everything downstream can be run without a camera.
+ *
+ * fd() becomes readable when a frame is ready, so sources can be mixed in
+ * the same poll/epoll loop.
+ */
+class FrameSource : public CtrlCallback
+{
+private:
+    TileScheduler * m_tiles;
+
+protected:
+    ColourConverter m_converter;    /* Set for fmt() whenever it changes */
+
+public:
+    FrameSource() : m_tiles(0) {};
+    virtual ~FrameSource() {};
+
+    virtual int fd() const = 0;
+    virtual bool set_nonblocking(bool enable) = 0;
+    virtual bool is_nonblocking() const = 0;
+    virtual BaseFormat * fmt() const = 0;
+
+    virtual int request_buffers(int max_num) = 0;
+    virtual void queue_buffer(int i) = 0;
+    virtual int wait_buffer_ready(FrameMeta & meta) = 0;
+    virtual uint8_t * buf_start(int n, unsigned plane = 0) const = 0;
+    virtual void enable_capture() = 0;
+    virtual void disable_capture() = 0;
+    virtual void close() = 0;
+    virtual const FrameStats & stats() const = 0;
+
+    /**
+     * @return Id of the control check_quality adjusts, 0 if none
+     */
+    virtual uint32_t brightness_control() const = 0;
+
+    unsigned height() const {return fmt() ? fmt()->height() : 0;};
+    unsigned width() const {return fmt() ? fmt()->width() : 0;};
+
+    /**
+     * Measure frames a band at a time across tiles' pool, NULL for one
+     * thread
+     */
+    void set_tiles(TileScheduler * tiles) {m_tiles = tiles;};
+    TileScheduler * tiles() const {return m_tiles;};
+
+    /**
+     * The converter for fmt(), with the matrix and range the source reports
+     * and the kernel for its pixel format already picked
+     */
+    const ColourConverter & converter() const {return m_converter;};
+    int check_quality(int n, int left, uint32_t bytes_avail);
+};
+
+#endif
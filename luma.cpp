@@ -0,0 +1,643 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "logging.h"
+#include "luma.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LUMA_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define LUMA_NEON
+#endif
+
+typedef void (*LumaKernel)(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, LumaStats & stats);
+
+typedef void (*HistKernel)(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, uint32_t (*banks)[LUMA_LEVELS]);
+
+typedef void (*ExtractKernel)(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, uint8_t * dst, unsigned dst_stride);
+
+struct LumaKernels
+{
+    const char * name;
+    LumaKernel packed;      /* pixel_stride 2 */
+    LumaKernel planar;      /* pixel_stride 1 */
+    HistKernel packed_hist;
+    HistKernel planar_hist;
+    ExtractKernel packed_extract;
+};
+
+/*
+ * Histogram kernels count into HIST_BANKS separate tables, consecutive
+ * samples going to different tables. In flat areas most samples are the
+ * same value and with a single table each increment would wait for the
+ * store of the one before.
+ */
+#define HIST_BANKS (4)
+
+/**
+ * One row, or what is left of one after the vector loop
+ */
+static inline void scalar_row(const uint8_t * p, unsigned pixels, unsigned stride,
+        unsigned & min, unsigned & max, uint64_t & sum)
+{
+    unsigned x;
+
+    for(x = 0; x < pixels; x++) {
+        const unsigned val = *p;
+        p += stride;
+        if(val > max) {
+            max = val;
+        }
+        if(val < min) {
+            min = val;
+        }
+        sum += val;
+    }
+}
+
+void luma_stats_scalar(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, unsigned pixel_stride, LumaStats & stats)
+{
+    unsigned y;
+
+    stats.min = 255;
+    stats.max = 0;
+    stats.sum = 0;
+    for(y = 0; y < height; y++) {
+        scalar_row(data, width, pixel_stride, stats.min, stats.max, stats.sum);
+        data += bytesperline;
+    }
+    stats.count = static_cast<uint64_t>(width) * height;
+}
+
+template<unsigned STRIDE>
+static void luma_scalar(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, LumaStats & stats)
+{
+    luma_stats_scalar(data, width, height, bytesperline, STRIDE, stats);
+}
+
+template<unsigned STRIDE>
+static void hist_scalar(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, uint32_t (*banks)[LUMA_LEVELS])
+{
+    unsigned x, y;
+
+    for(y = 0; y < height; y++) {
+        const uint8_t * p = data + static_cast<size_t>(y) * bytesperline;
+        for(x = 0; x + HIST_BANKS <= width; x += HIST_BANKS) {
+            banks[0][p[0]]++;
+            banks[1][p[STRIDE]]++;
+            banks[2][p[2 * STRIDE]]++;
+            banks[3][p[3 * STRIDE]]++;
+            p += HIST_BANKS * STRIDE;
+        }
+        for(; x < width; x++) {
+            banks[0][*p]++;
+            p += STRIDE;
+        }
+    }
+}
+
+static void extract_scalar(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, uint8_t * dst, unsigned dst_stride)
+{
+    unsigned x, y;
+
+    for(y = 0; y < height; y++) {
+        const uint8_t * p = data + static_cast<size_t>(y) * bytesperline;
+        uint8_t * q = dst + static_cast<size_t>(y) * dst_stride;
+        for(x = 0; x < width; x++) {
+            q[x] = p[2 * x];
+        }
+    }
+}
+
+/**
+ * Count 16 samples already gathered into one place
+ */
+static inline void count16(const uint8_t * s, uint32_t (*banks)[LUMA_LEVELS])
+{
+    unsigned i;
+
+    for(i = 0; i < 16; i += HIST_BANKS) {
+        banks[0][s[i]]++;
+        banks[1][s[i + 1]]++;
+        banks[2][s[i + 2]]++;
+        banks[3][s[i + 3]]++;
+    }
+}
+
+/**
+ * Fold the vector lanes into the scalar results
+ */
+static void reduce(const uint8_t * mins, const uint8_t * maxs, unsigned lanes,
+        const uint64_t * sums, unsigned num_sums, LumaStats & stats)
+{
+    unsigned i;
+
+    for(i = 0; i < lanes; i++) {
+        if(mins[i] < stats.min) {
+            stats.min = mins[i];
+        }
+        if(maxs[i] > stats.max) {
+            stats.max = maxs[i];
+        }
+    }
+    for(i = 0; i < num_sums; i++) {
+        stats.sum += sums[i];
+    }
+}
+
+#ifdef LUMA_X86
+
+/**
+ * 16 luma samples per step. For YUYV two loads are masked down to their Y
+ * bytes and packed back together, _mm_sad_epu8 against zero then sums
+ * eight bytes at a time into 64 bit lanes which cannot overflow.
+ */
+template<unsigned STRIDE>
+__attribute__((target("sse2")))
+static void luma_sse2(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, LumaStats & stats)
+{
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    const __m128i zero = _mm_setzero_si128();
+    const unsigned vec_pixels = width & ~15u;
+    __m128i vmin = _mm_set1_epi8(-1);
+    __m128i vmax = zero;
+    __m128i vsum = zero;
+    unsigned x, y;
+
+    stats.min = 255;
+    stats.max = 0;
+    stats.sum = 0;
+    for(y = 0; y < height; y++) {
+        const uint8_t * row = data + static_cast<size_t>(y) * bytesperline;
+        for(x = 0; x < vec_pixels; x += 16) {
+            __m128i luma;
+            if(STRIDE == 2) {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + 2 * x));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + 2 * x + 16));
+                luma = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+            }
+            else {
+                luma = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x));
+            }
+            vmin = _mm_min_epu8(vmin, luma);
+            vmax = _mm_max_epu8(vmax, luma);
+            vsum = _mm_add_epi64(vsum, _mm_sad_epu8(luma, zero));
+        }
+        scalar_row(row + STRIDE * vec_pixels, width - vec_pixels, STRIDE,
+                stats.min, stats.max, stats.sum);
+    }
+
+    uint8_t mins[16], maxs[16];
+    uint64_t sums[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(mins), vmin);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(maxs), vmax);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(sums), vsum);
+    reduce(mins, maxs, 16, sums, 2, stats);
+    stats.count = static_cast<uint64_t>(width) * height;
+}
+
+/**
+ * There is no scatter before AVX-512, so the vector unit only gathers the
+ * luma samples (the costly part for YUYV) and they are counted from a
+ * small aligned buffer.
+ */
+template<unsigned STRIDE>
+__attribute__((target("sse2")))
+static void hist_sse2(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, uint32_t (*banks)[LUMA_LEVELS])
+{
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    const unsigned vec_pixels = width & ~15u;
+    uint8_t samples[16] __attribute__((aligned(16)));
+    unsigned x, y;
+
+    for(y = 0; y < height; y++) {
+        const uint8_t * row = data + static_cast<size_t>(y) * bytesperline;
+        for(x = 0; x < vec_pixels; x += 16) {
+            __m128i luma;
+            if(STRIDE == 2) {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + 2 * x));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + 2 * x + 16));
+                luma = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+            }
+            else {
+                luma = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x));
+            }
+            _mm_store_si128(reinterpret_cast<__m128i *>(samples), luma);
+            count16(samples, banks);
+        }
+        hist_scalar<STRIDE>(row + STRIDE * vec_pixels, width - vec_pixels, 1, 0, banks);
+    }
+}
+
+__attribute__((target("sse2")))
+static void extract_sse2(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, uint8_t * dst, unsigned dst_stride)
+{
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    const unsigned vec_pixels = width & ~15u;
+    unsigned x, y;
+
+    for(y = 0; y < height; y++) {
+        const uint8_t * row = data + static_cast<size_t>(y) * bytesperline;
+        uint8_t * out = dst + static_cast<size_t>(y) * dst_stride;
+        for(x = 0; x < vec_pixels; x += 16) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + 2 * x));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + 2 * x + 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x),
+                    _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        }
+        extract_scalar(row + 2 * vec_pixels, width - vec_pixels, 1, 0, out + vec_pixels, 0);
+    }
+}
+
+/**
+ * As luma_sse2 with 32 samples per step. _mm256_packus_epi16 works within
+ * each 128 bit half so the samples come out shuffled, which does not
+ * matter for min, max or sum.
+ */
+template<unsigned STRIDE>
+__attribute__((target("avx2")))
+static void luma_avx2(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, LumaStats & stats)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00FF);
+    const __m256i zero = _mm256_setzero_si256();
+    const unsigned vec_pixels = width & ~31u;
+    __m256i vmin = _mm256_set1_epi8(-1);
+    __m256i vmax = zero;
+    __m256i vsum = zero;
+    unsigned x, y;
+
+    stats.min = 255;
+    stats.max = 0;
+    stats.sum = 0;
+    for(y = 0; y < height; y++) {
+        const uint8_t * row = data + static_cast<size_t>(y) * bytesperline;
+        for(x = 0; x < vec_pixels; x += 32) {
+            __m256i luma;
+            if(STRIDE == 2) {
+                const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + 2 * x));
+                const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + 2 * x + 32));
+                luma = _mm256_packus_epi16(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+            }
+            else {
+                luma = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + x));
+            }
+            vmin = _mm256_min_epu8(vmin, luma);
+            vmax = _mm256_max_epu8(vmax, luma);
+            vsum = _mm256_add_epi64(vsum, _mm256_sad_epu8(luma, zero));
+        }
+        scalar_row(row + STRIDE * vec_pixels, width - vec_pixels, STRIDE,
+                stats.min, stats.max, stats.sum);
+    }
+
+    uint8_t mins[32], maxs[32];
+    uint64_t sums[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(mins), vmin);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(maxs), vmax);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(sums), vsum);
+    reduce(mins, maxs, 32, sums, 4, stats);
+    stats.count = static_cast<uint64_t>(width) * height;
+}
+
+#endif
+
+#ifdef LUMA_NEON
+
+/**
+ * 16 luma samples per step, vld2q_u8 splits YUYV into Y and CbCr for free.
+ * Sums are widened pairwise into 32 bit lanes and flushed every row, a row
+ * adds at most 1020 per lane per step.
+ */
+template<unsigned STRIDE>
+static void luma_neon(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, LumaStats & stats)
+{
+    const unsigned vec_pixels = width & ~15u;
+    uint8x16_t vmin = vdupq_n_u8(255);
+    uint8x16_t vmax = vdupq_n_u8(0);
+    unsigned x, y;
+
+    stats.min = 255;
+    stats.max = 0;
+    stats.sum = 0;
+    for(y = 0; y < height; y++) {
+        const uint8_t * row = data + static_cast<size_t>(y) * bytesperline;
+        uint32x4_t vsum = vdupq_n_u32(0);
+        for(x = 0; x < vec_pixels; x += 16) {
+            uint8x16_t luma;
+            if(STRIDE == 2) {
+                luma = vld2q_u8(row + 2 * x).val[0];
+            }
+            else {
+                luma = vld1q_u8(row + x);
+            }
+            vmin = vminq_u8(vmin, luma);
+            vmax = vmaxq_u8(vmax, luma);
+            vsum = vpadalq_u16(vsum, vpaddlq_u8(luma));
+        }
+        const uint64x2_t wide = vpaddlq_u32(vsum);
+        stats.sum += vgetq_lane_u64(wide, 0) + vgetq_lane_u64(wide, 1);
+        scalar_row(row + STRIDE * vec_pixels, width - vec_pixels, STRIDE,
+                stats.min, stats.max, stats.sum);
+    }
+
+    uint8_t mins[16], maxs[16];
+    vst1q_u8(mins, vmin);
+    vst1q_u8(maxs, vmax);
+    /* Sums were already flushed row by row */
+    reduce(mins, maxs, 16, NULL, 0, stats);
+    stats.count = static_cast<uint64_t>(width) * height;
+}
+
+static void extract_neon(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, uint8_t * dst, unsigned dst_stride)
+{
+    const unsigned vec_pixels = width & ~15u;
+    unsigned x, y;
+
+    for(y = 0; y < height; y++) {
+        const uint8_t * row = data + static_cast<size_t>(y) * bytesperline;
+        uint8_t * out = dst + static_cast<size_t>(y) * dst_stride;
+        for(x = 0; x < vec_pixels; x += 16) {
+            vst1q_u8(out + x, vld2q_u8(row + 2 * x).val[0]);
+        }
+        extract_scalar(row + 2 * vec_pixels, width - vec_pixels, 1, 0, out + vec_pixels, 0);
+    }
+}
+
+template<unsigned STRIDE>
+static void hist_neon(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, uint32_t (*banks)[LUMA_LEVELS])
+{
+    const unsigned vec_pixels = width & ~15u;
+    uint8_t samples[16] __attribute__((aligned(16)));
+    unsigned x, y;
+
+    for(y = 0; y < height; y++) {
+        const uint8_t * row = data + static_cast<size_t>(y) * bytesperline;
+        for(x = 0; x < vec_pixels; x += 16) {
+            if(STRIDE == 2) {
+                vst1q_u8(samples, vld2q_u8(row + 2 * x).val[0]);
+            }
+            else {
+                vst1q_u8(samples, vld1q_u8(row + x));
+            }
+            count16(samples, banks);
+        }
+        hist_scalar<STRIDE>(row + STRIDE * vec_pixels, width - vec_pixels, 1, 0, banks);
+    }
+}
+
+#endif
+
+#ifdef LUMA_X86
+static const LumaKernels avx2_kernels = {"avx2", luma_avx2<2>, luma_avx2<1>,
+        hist_sse2<2>, hist_sse2<1>, extract_sse2 };
+static const LumaKernels sse2_kernels = {"sse2", luma_sse2<2>, luma_sse2<1>,
+        hist_sse2<2>, hist_sse2<1>, extract_sse2 };
+#endif
+#ifdef LUMA_NEON
+static const LumaKernels neon_kernels = {"neon", luma_neon<2>, luma_neon<1>,
+        hist_neon<2>, hist_neon<1>, extract_neon };
+#endif
+static const LumaKernels scalar_kernels = {"scalar", luma_scalar<2>, luma_scalar<1>,
+        hist_scalar<2>, hist_scalar<1>, extract_scalar };
+
+/* Set by luma_force_kernel, otherwise the CPU's best is used */
+static const LumaKernels * forced_kernels = NULL;
+
+/**
+ * @return The kernels called name if this CPU can run them, else NULL
+ */
+static const LumaKernels * named_kernels(const char * name)
+{
+#ifdef LUMA_X86
+    __builtin_cpu_init();
+    if(!strcmp(name, avx2_kernels.name)) {
+        return __builtin_cpu_supports("avx2") ? &avx2_kernels : NULL;
+    }
+    if(!strcmp(name, sse2_kernels.name)) {
+        return __builtin_cpu_supports("sse2") ? &sse2_kernels : NULL;
+    }
+#endif
+#ifdef LUMA_NEON
+    if(!strcmp(name, neon_kernels.name)) {
+        return &neon_kernels;
+    }
+#endif
+    if(!strcmp(name, scalar_kernels.name)) {
+        return &scalar_kernels;
+    }
+    return NULL;
+}
+
+/**
+ * Pick the widest kernel this CPU can run
+ */
+static const LumaKernels * cpu_kernels()
+{
+    static const char * const widest_first[] = {"avx2", "sse2", "neon"};
+    unsigned i;
+
+    for(i = 0; i < sizeof(widest_first) / sizeof(widest_first[0]); i++) {
+        const LumaKernels * found = named_kernels(widest_first[i]);
+        if(found) {
+            return found;
+        }
+    }
+    return &scalar_kernels;
+}
+
+static const LumaKernels * select_kernels()
+{
+    const LumaKernels * selected = cpu_kernels();
+    LOG_INFO("Using %s luma kernel", selected->name);
+    return selected;
+}
+
+static const LumaKernels * kernels()
+{
+    static const LumaKernels * const selected = select_kernels();
+    return forced_kernels ? forced_kernels : selected;
+}
+
+/**
+ * Use the named kernels in place of the CPU's best, so each can be checked
+ * against luma_stats_scalar. Not thread safe, call before any capture.
+ *
+ * @param[in] name "scalar", "sse2", "avx2" or "neon", NULL to go back to
+ * the best
+ *
+ * @return false if they are not built in or this CPU cannot run them
+ */
+bool luma_force_kernel(const char * name)
+{
+    if(!name) {
+        forced_kernels = NULL;
+        return true;
+    }
+    const LumaKernels * found = named_kernels(name);
+    if(!found) {
+        return false;
+    }
+    forced_kernels = found;
+    return true;
+}
+
+void luma_stats(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, unsigned pixel_stride, LumaStats & stats)
+{
+    switch(pixel_stride) {
+    case 2:
+        kernels()->packed(data, width, height, bytesperline, stats);
+        break;
+    case 1:
+        kernels()->planar(data, width, height, bytesperline, stats);
+        break;
+    default:
+        luma_stats_scalar(data, width, height, bytesperline, pixel_stride, stats);
+        break;
+    }
+}
+
+void luma_histogram(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, unsigned pixel_stride, uint32_t * hist,
+        LumaStats & stats)
+{
+    uint32_t banks[HIST_BANKS][LUMA_LEVELS];
+    unsigned i, b;
+
+    memset(banks, 0, sizeof(banks));
+    switch(pixel_stride) {
+    case 2:
+        kernels()->packed_hist(data, width, height, bytesperline, banks);
+        break;
+    case 1:
+        kernels()->planar_hist(data, width, height, bytesperline, banks);
+        break;
+    default:
+        for(i = 0; i < height; i++) {
+            const uint8_t * p = data + static_cast<size_t>(i) * bytesperline;
+            for(b = 0; b < width; b++) {
+                banks[0][*p]++;
+                p += pixel_stride;
+            }
+        }
+        break;
+    }
+
+    stats.min = 255;
+    stats.max = 0;
+    stats.sum = 0;
+    stats.count = 0;
+    for(i = 0; i < LUMA_LEVELS; i++) {
+        uint32_t count = 0;
+        for(b = 0; b < HIST_BANKS; b++) {
+            count += banks[b][i];
+        }
+        hist[i] = count;
+        if(count) {
+            if(i < stats.min) {
+                stats.min = i;
+            }
+            stats.max = i;
+            stats.sum += static_cast<uint64_t>(count) * i;
+            stats.count += count;
+        }
+    }
+}
+
+/**
+ * @param[in] hist As filled in by luma_histogram
+ * @param[in] count Total of hist
+ * @param[in] pc Percentile wanted, 0 to 100
+ *
+ * @return Lowest level with at least pc percent of the samples at or below it
+ */
+unsigned luma_percentile(const uint32_t * hist, uint64_t count, double pc)
+{
+    uint64_t wanted = static_cast<uint64_t>((pc / 100.0) * count + 0.5);
+    uint64_t seen = 0;
+    unsigned i;
+
+    if(wanted < 1) {
+        wanted = 1;
+    }
+    for(i = 0; i < LUMA_LEVELS; i++) {
+        seen += hist[i];
+        if(seen >= wanted) {
+            return i;
+        }
+    }
+    return LUMA_LEVELS - 1;
+}
+
+void luma_extract(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, unsigned pixel_stride, uint8_t * dst,
+        unsigned dst_stride)
+{
+    unsigned x, y;
+
+    switch(pixel_stride) {
+    case 2:
+        kernels()->packed_extract(data, width, height, bytesperline, dst, dst_stride);
+        break;
+    case 1:
+        for(y = 0; y < height; y++) {
+            memcpy(dst + static_cast<size_t>(y) * dst_stride,
+                    data + static_cast<size_t>(y) * bytesperline, width);
+        }
+        break;
+    default:
+        for(y = 0; y < height; y++) {
+            const uint8_t * p = data + static_cast<size_t>(y) * bytesperline;
+            uint8_t * q = dst + static_cast<size_t>(y) * dst_stride;
+            for(x = 0; x < width; x++) {
+                q[x] = p[x * pixel_stride];
+            }
+        }
+        break;
+    }
+}
+
+/**
+ * Y' = 0.299R' + 0.587G' + 0.114B' in 8 bit fixed point; the weights sum
+ * to 256 so white stays 255. No branches or tables, which leaves the
+ * compiler free to vectorise it.
+ */
+void rgb24_luma(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, unsigned step_x, unsigned step_y, uint8_t * dst,
+        unsigned dst_stride)
+{
+    const unsigned pixel_stride = 3 * step_x;
+    unsigned x, y;
+
+    for(y = 0; y < height; y += step_y) {
+        const uint8_t * p = data + static_cast<size_t>(y) * bytesperline;
+        uint8_t * q = dst;
+        for(x = 0; x < width; x += step_x) {
+            *q++ = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+            p += pixel_stride;
+        }
+        dst += dst_stride;
+    }
+}
+
+const char * luma_kernel_name()
+{
+    return kernels()->name;
+}
@@ -0,0 +1,73 @@
+#ifndef _LUMA_H_
+#define _LUMA_H_
+
+#include <stdint.h>
+
+#define LUMA_LEVELS (256)
+
+/**
+ * Min, max and sum of the luma samples of an image
+ */
+struct LumaStats
+{
+    uint64_t sum;
+    uint64_t count;
+    unsigned min;
+    unsigned max;
+};
+
+/**
+ * Gather LumaStats over a width x height image whose luma samples are
+ * pixel_stride bytes apart (2 for packed YUYV, 1 for a luma plane or grey)
+ * and whose rows are bytesperline apart. Uses the fastest kernel the CPU
+ * supports, chosen on first use.
+ */
+extern void luma_stats(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, unsigned pixel_stride, LumaStats & stats);
+
+/**
+ * The plain C version, which the SIMD kernels must agree with exactly
+ */
+extern void luma_stats_scalar(const uint8_t * data, unsigned width,
+        unsigned height, unsigned bytesperline, unsigned pixel_stride,
+        LumaStats & stats);
+
+/**
+ * As luma_stats, also counting how many samples there are of each level.
+ * The stats are worked out from the histogram so it is still one pass.
+ *
+ * @param[out] hist LUMA_LEVELS counts
+ */
+extern void luma_histogram(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, unsigned pixel_stride, uint32_t * hist,
+        LumaStats & stats);
+
+extern unsigned luma_percentile(const uint32_t * hist, uint64_t count, double pc);
+
+/**
+ * Copy the luma samples of an image out into a plain grey image
+ *
+ * @param[out] dst width x height bytes, rows dst_stride apart
+ */
+extern void luma_extract(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, unsigned pixel_stride, uint8_t * dst,
+        unsigned dst_stride);
+
+/**
+ * Work out luma from packed RGB24, reading only every step_x'th pixel of
+ * every step_y'th row
+ *
+ * @param[out] dst One byte per sample read, rows dst_stride apart
+ */
+extern void rgb24_luma(const uint8_t * data, unsigned width, unsigned height,
+        unsigned bytesperline, unsigned step_x, unsigned step_y, uint8_t * dst,
+        unsigned dst_stride);
+
+/**
+ * @return Name of the kernel luma_stats is using, for the logs
+ */
+extern const char * luma_kernel_name();
+
+extern bool luma_force_kernel(const char * name);
+
+#endif
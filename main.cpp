@@ -1,166 +1,489 @@
-#include <dirent.h>
+#include <vector>
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-#include <string>
-#include <vector>
-
+#include "archive.h"
 #include "capture.h"
+#include "bufpool.h"
+#include "discovery.h"
 #include "format.h"
 #include "logging.h"
+#include "mjpeg.h"
+#include "multicam.h"
+#include "pnm.h"
+#include "recorder.h"
+#include "replay.h"
+#include "thumbnail.h"
+#include "tiles.h"
+
+/* Half a frame at 30fps */
+#define MULTICAM_TOLERANCE_NS (16000000)
+
+static void usage(const char * prog)
+{
+    fprintf(stderr, "Usage: %s [-o|-a file [-c frames]] [-m num [-c sets]] [-M step] [-j threads] [-p] [-t WxH] [-y] [-r file [-f fourcc] [-s WxH] [-n fps] [-l]]\n", prog);
+    fprintf(stderr, "  -o file   record every frame raw to file instead of one image\n");
+    fprintf(stderr, "  -a file   as -o but to an indexed frame archive\n");
+    fprintf(stderr, "  -c frames number of frames to record (default 300)\n");
+    fprintf(stderr, "  -m num    capture synchronised sets from up to num cameras\n");
+    fprintf(stderr, "  -M step   centre weighted metering of every step'th row and column\n");
+    fprintf(stderr, "  -j threads measure frames in bands across threads, 0 for one per core\n");
+    fprintf(stderr, "  -p        save the image in colour, as image.ppm\n");
+    fprintf(stderr, "  -t WxH    also save a thumbnail, as thumb.pgm or thumb.ppm, H 0 keeps the aspect\n");
+    fprintf(stderr, "  -y        record RGB24 frames as YUYV\n");
+    fprintf(stderr, "  -r file   replay raw frames from file instead of a camera\n");
+    fprintf(stderr, "  -f fourcc pixel format of the recording (default YUYV)\n");
+    fprintf(stderr, "  -s WxH    frame size of the recording (default 640x480)\n");
+    fprintf(stderr, "  -n fps    replay rate, 0 for as fast as possible (default 30)\n");
+    fprintf(stderr, "  -l        loop the recording\n");
+}
+
+/**
+ * Find and set up the camera
+ */
+static Camera * open_camera(BufferPool ** pool)
+{
+    Camera * cam = find_camera_dev();
+    if(!cam) {
+        return NULL;
+    }
+    if(!cam->select_format()) {
+        LOG_ERROR("Camera has no format we can use");
+        cam->close();
+        delete cam;
+        return NULL;
+    }
 
-#define V4L2_MAJOR  (81)
+//  cam->check_standards();
+    cam->check_controls();
+    cam->save_profile();
+
+    *pool = new BufferPool(*cam, 4, VIDEO_MAX_FRAME);
+    (*pool)->start();
+
+    cam->set_capture_params();
+    return cam;
+}
 
 /**
- * Give a devpath, check that it is a devnode for a v4l2 device
- * (should do this before attempting to open a device)
+ * The pieces of a raw frame to record. Planes in their own buffers are
+ * written one after another, each its full size so every frame has the
+ * same layout.
  *
- * @param[in] devpath The devpath
+ * @param[out] pieces At least VIDEO_MAX_PLANES entries
  *
- * @return true if so
+ * @return number of pieces
  */
-static bool check_is_camera_dev(std::string & devpath)
+static unsigned frame_pieces(FrameSource * cam, int n, const FrameMeta & meta,
+        struct iovec * pieces)
 {
-    struct stat buf;
-    const int status = ::stat(devpath.c_str(), &buf);
-    if(status == 0) {
-        if((buf.st_mode & (S_IFBLK | S_IFCHR)) != 0) {
-            /* A dev node */
-            if(major(buf.st_rdev) == V4L2_MAJOR) {
-                return true;
-            }
-        }
+    const BaseFormat & fmt = *cam->fmt();
+    unsigned p;
+
+    if(fmt.num_planes() == 1) {
+        pieces[0].iov_base = cam->buf_start(n);
+        pieces[0].iov_len = meta.bytesused;
+        return 1;
     }
-    return false;
+    for(p = 0; p < fmt.num_planes(); p++) {
+        pieces[p].iov_base = cam->buf_start(n, p);
+        pieces[p].iov_len = fmt.plane_size(p);
+    }
+    return fmt.num_planes();
 }
 
-void check_dir_for_camera_dev(std::vector<std::string> & poss,
-        const char * path, const char * prefix)
+/**
+ * Stream frames to a file as they arrive, any the disk cannot keep up with
+ * are dropped rather than holding up the capture
+ *
+ * @param[in] archive Write an indexed archive rather than raw frames
+ * @param[in] to_yuyv Store RGB24 frames as YUYV, two thirds of the bytes.
+ *            Only the fourcc is recorded, so they are BT.601 limited range
+ *            as any YUYV reader, ReplaySource included, assumes.
+ */
+static void record_frames(FrameSource * cam, BufferPool * pool, const char * path,
+        unsigned num_frames, bool archive, bool to_yuyv)
 {
-    const size_t prefix_len = prefix ? strlen(prefix) : 0;
-    DIR * dir = opendir(path);
-    if(dir) {
-        struct dirent * entry;
-        while(NULL != (entry = readdir(dir))) {
-            if((entry->d_name[0] == '.') 
-                && (((entry->d_name[1] == '.') 
-                  && (entry->d_name[2] == '\0'))
-                  || (entry->d_name[1] == '\0'))) {
-                continue;
-            }
-            if(prefix_len > 0) {
-                if(strncmp(entry->d_name, prefix, prefix_len) != 0) {
-                    continue;
-                }
+    Recorder rec;
+    ArchiveWriter arc;
+    MjpegFrame jpeg;
+    const ColourConverter to_yuv(COLOUR_BT601, false);
+    BaseFormat * yuyv_fmt = NULL;
+    std::vector<uint8_t> yuyv;
+    struct iovec pieces[VIDEO_MAX_PLANES];     /* Also >= MJPEG_MAX_IOV */
+    const BaseFormat & fmt = *cam->fmt();
+    unsigned bad = 0;
+    unsigned i;
+
+    if(to_yuyv && (fmt.pix_fmt() == V4L2_PIX_FMT_RGB24) && !(fmt.width() & 1)) {
+        yuyv_fmt = create_format_obj(V4L2_PIX_FMT_YUYV);
+        yuyv_fmt->init(fmt.width(), fmt.height(), yuyv_fmt->default_bytesperline(fmt.width()));
+        yuyv.resize(yuyv_fmt->image_size());
+        LOG_INFO("Recording as YUYV, %s", to_yuv.name());
+    }
+    else if(to_yuyv) {
+        LOG_WARN("Only RGB24 of even width is stored as YUYV, recording %s as is",
+                fmt.pix_fmt_str().c_str());
+    }
+    if(archive ? !arc.open(path, yuyv_fmt ? *yuyv_fmt : fmt) : !rec.open(path)) {
+        delete yuyv_fmt;
+        return;
+    }
+    for(i = 0; i < num_frames; i++) {
+        FrameMeta meta;
+        unsigned num_pieces = 0;
+        const int n = cam->wait_buffer_ready(meta);
+        if(n < 0) {
+            break;
+        }
+        if(pool) {
+            pool->update(meta);
+        }
+        if(fmt.compressed()) {
+            /* Pass through as is, only putting back the tables UVC omits */
+            if(jpeg.parse(cam->buf_start(n), meta.bytesused)) {
+                num_pieces = jpeg.iov(pieces);
             }
-            std::string devpath(path);
-            devpath += "/";
-            devpath += entry->d_name;
-            if(check_is_camera_dev(devpath)) {
-                LOG_DEBUG("Found file %s", devpath.c_str());
-                poss.push_back(devpath);
+        }
+        else if(yuyv_fmt) {
+            if(meta.bytesused >= fmt.image_size()) {
+                to_yuv.rgb24_to_yuyv(cam->buf_start(n), fmt.width(), fmt.height(),
+                        fmt.bytesperline(), &yuyv[0], yuyv_fmt->bytesperline());
+                pieces[0].iov_base = &yuyv[0];
+                pieces[0].iov_len = yuyv.size();
+                num_pieces = 1;
             }
         }
-        closedir(dir);
+        else {
+            num_pieces = frame_pieces(cam, n, meta, pieces);
+        }
+        if(!num_pieces) {
+            bad++;
+        }
+        else if(archive) {
+            arc.append(pieces, num_pieces, meta);
+        }
+        else {
+            rec.write_frame(pieces, num_pieces);
+        }
+        if(pool) {
+            pool->release(n);
+        }
+        else {
+            cam->queue_buffer(n);
+        }
+    }
+    rec.close();
+    arc.close();
+    delete yuyv_fmt;
+    if(bad) {
+        LOG_WARN("Skipped %u frames that were cut short or not JPEG", bad);
     }
 }
 
-#if 0
-void parse_for_dev_details(string & filepath)
+/**
+ * Save a thumbnail of a frame, in colour with the source's matrix if rgb,
+ * and log its luma statistics
+ */
+static void save_thumbnail(FrameSource * cam, TileScheduler * tiles,
+        const uint8_t * const * planes, unsigned bytes, unsigned width,
+        unsigned height, bool rgb, PnmWriter & writer)
 {
-    filepath += "/dev";
-    FILE * in_fp = fopen(filepa
+    const char * fname = rgb ? "thumb.ppm" : "thumb.pgm";
+    Thumbnailer thumbnailer(width, height, THUMB_BOX, rgb);
+    Thumbnail thumb;
+    ImageQuality qual(true);
+
+    thumbnailer.set_colour(cam->converter());
+    if(tiles ? !tiles->thumbnail(thumbnailer, *cam->fmt(), planes, bytes, thumb, &qual)
+            : !thumbnailer.make(*cam->fmt(), planes, bytes, thumb, &qual)) {
+        LOG_ERROR("Cannot make thumbnails of %s frames", cam->fmt()->pix_fmt_str().c_str());
+        return;
+    }
+    LOG_INFO("Thumbnail %ux%u, min=%i, max=%i, mean=%i, p50=%i, contrast=%.3f",
+            thumb.width, thumb.height, qual.luma_min, qual.luma_max, qual.luma_mean,
+            qual.luma_p50, qual.contrast);
+    if(!writer.write_thumbnail(fname, thumb)) {
+        LOG_ERROR("Could not write %s", fname);
+    }
 }
-#endif
 
 /**
- * Find the a list of devices that are v4l devices
+ * Counts sets until it has enough
  */
-Camera * find_camera_dev()
+class SetCounter : public FrameSetHandler
 {
-    std::vector<std::string> poss;
+private:
+    unsigned m_remaining;
+
+public:
+    SetCounter(unsigned num_sets) : m_remaining(num_sets) {};
 
-    check_dir_for_camera_dev(poss, "/dev/v4l/by-path", NULL);
-    if(poss.empty()) {
-        check_dir_for_camera_dev(poss, "/dev", "video");
+    virtual bool on_frame_set(MultiCamSession & session, const FrameSet & set)
+    {
+        LOG_DEBUG("Set of %u at %llu, skew %llu ns", set.size(),
+                (unsigned long long) set.timestamp_ns,
+                (unsigned long long) set.skew_ns);
+        if(--m_remaining == 0) {
+            session.stop();
+        }
+        return true;
     }
-    std::vector<std::string>::iterator p = poss.begin();
-    while(p != poss.end()) {
-        LOG_INFO("Possible camera %s", p->c_str());
-        Camera * info = new Camera(*p);
-        if(info->init()) {
-            return info;
+};
+
+/**
+ * Stream every camera found together, grouping their frames into sets
+ *
+ * @param[in] max_cams Use at most this many cameras
+ * @param[in] num_sets Stop after this many sets
+ */
+static int multi_capture(unsigned max_cams, unsigned num_sets)
+{
+    std::vector<CameraInfo> found = discover_cameras(PROBE_TIMEOUT_MS);
+    std::vector<CameraInfo>::iterator p;
+    std::vector<Camera *> cams;
+    MultiCamSession session(MULTICAM_TOLERANCE_NS);
+    SetCounter counter(num_sets);
+    int i;
+
+    for(p = found.begin(); p != found.end(); p++) {
+        if(cams.size() >= max_cams) {
+            p->cam->close();
+            delete p->cam;
+            continue;
+        }
+        Camera * cam = p->cam;
+        if(!cam->select_format()) {
+            LOG_WARN("%s has no format we can use", p->devpath.c_str());
+            cam->close();
+            delete cam;
+            continue;
         }
-        delete info;
-        p++;
+        cam->check_controls();
+        cam->save_profile();
+        const int n = cam->request_buffers(6);
+        for(i = 0; i < n; i++) {
+            cam->queue_buffer(i);
+        }
+        cam->set_capture_params();
+        cam->enable_capture();
+        if(session.add_camera(cam)) {
+            LOG_INFO("Session camera %u is %s", session.num_cameras(), p->devpath.c_str());
+        }
+        cams.push_back(cam);
     }
-    return NULL;
-}
+    if(session.num_cameras() == 0) {
+        LOG_ERROR("No camera found");
+        return EXIT_FAILURE;
+    }
+    session.set_handler(&counter);
+    if(num_sets > 0) {
+        session.run();
+    }
+    session.log();
 
+    std::vector<Camera *>::iterator c;
+    for(c = cams.begin(); c != cams.end(); c++) {
+        (*c)->stats().log();
+        (*c)->disable_capture();
+        (*c)->close();
+        delete *c;
+    }
+    return 0;
+}
 
-int main()
+int main(int argc, char * argv[])
 {
+    const char * replay = NULL;
+    const char * record = NULL;
+    bool archive = false;
+    unsigned multi = 0;
+    unsigned meter_step = 0;
+    unsigned threads = 1;
+    bool colour = false;
+    bool to_yuyv = false;
+    unsigned thumb_width = 0;
+    unsigned thumb_height = 0;
+    unsigned num_frames = 300;
+    uint32_t fourcc = V4L2_PIX_FMT_YUYV;
+    unsigned width = 640;
+    unsigned height = 480;
+    unsigned fps = 30;
+    bool loop = false;
+    int opt;
+
+    while((opt = getopt(argc, argv, "o:a:c:m:M:j:pt:yr:f:s:n:l")) != -1) {
+        switch(opt) {
+        case 'o':
+            record = optarg;
+            archive = false;
+            break;
+        case 'a':
+            record = optarg;
+            archive = true;
+            break;
+        case 'c':
+            num_frames = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            multi = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            meter_step = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            colour = true;
+            break;
+        case 't':
+            if(!sscanf(optarg, "%ux%u", &thumb_width, &thumb_height) || !thumb_width) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'y':
+            to_yuyv = true;
+            break;
+        case 'r':
+            replay = optarg;
+            break;
+        case 'f':
+            if(strlen(optarg) != 4) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            fourcc = v4l2_fourcc(optarg[0], optarg[1], optarg[2], optarg[3]);
+            break;
+        case 's':
+            if(sscanf(optarg, "%ux%u", &width, &height) != 2) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            fps = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            loop = true;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
     set_logging_level(10);
     LOG_INFO("Starting");
-    Camera * cam = find_camera_dev();
-    if(!cam) {
-        LOG_ERROR("No camera found");
-        return EXIT_FAILURE;
+    if(multi) {
+        return multi_capture(multi, num_frames);
     }
-    cam->select_format();
-
-//  cam->check_standards();
-    cam->check_controls();
 
+    FrameSource * cam;
+    BufferPool * pool = NULL;
+    TilePool * tile_pool = NULL;
+    TileScheduler * tiles = NULL;
     int i;
-    int n = cam->request_buffers(10);
-    for(i = 0; i < n; i++) {
-        cam->queue_buffer(i);
-    }
 
-    cam->set_capture_params();
+    if(replay) {
+        try {
+            cam = new ReplaySource(replay, fourcc, width, height, fps, loop);
+        }
+        catch(Camera_error &) {
+            return EXIT_FAILURE;
+        }
+        const int n = cam->request_buffers(4);
+        for(i = 0; i < n; i++) {
+            cam->queue_buffer(i);
+        }
+    }
+    else {
+        cam = open_camera(&pool);
+        if(!cam) {
+            LOG_ERROR("No camera found");
+            return EXIT_FAILURE;
+        }
+    }
+    if(meter_step) {
+        cam->fmt()->set_metering(MeteringConfig::center_weighted(meter_step));
+    }
+    if(threads != 1) {
+        tile_pool = new TilePool(threads ? threads - 1 : 0);
+        tiles = new TileScheduler(*tile_pool);
+        cam->set_tiles(tiles);
+    }
     cam->enable_capture();
 
-    for(i = 0; i < 100; i++) {
-        uint32_t bytes_avail;
-        int n = cam->wait_buffer_ready(&bytes_avail);
-        int max_val = 0;
-        char fname[30];
-        uint8_t frame[640*480];
-        FILE * f;
+    if(record) {
+        record_frames(cam, pool, record, num_frames, archive, to_yuyv);
+    }
+    PnmWriter writer;
+    for(i = 0; !record && (i < 100); i++) {
+        FrameMeta meta;
+        int n = cam->wait_buffer_ready(meta);
+        uint32_t bytes_avail = meta.bytesused;
 
-        if(!cam->check_quality(n, 99-i, bytes_avail)) {
-            cam->queue_buffer(n);
+        if(n < 0) {
+            break;
+        }
+        if(pool) {
+            pool->update(meta);
+        }
+        MjpegFrame jpeg;
+        const bool compressed = cam->fmt()->compressed();
+        if(compressed ? !jpeg.parse(cam->buf_start(n), bytes_avail)
+                : !cam->check_quality(n, 99-i, bytes_avail)) {
+            if(pool) {
+                pool->release(n);
+            }
+            else {
+                cam->queue_buffer(n);
+            }
             continue;
         }
-        snprintf(fname, sizeof(fname), "image.pgm");
-        LOG_INFO("%i %u", n, bytes_avail);
-        f = fopen(fname, "wb");
-        if(f) {
-            uint8_t * src = cam->buf_start(n);
-            uint8_t * dst = frame;
-            unsigned j;
-            for(j = 0; j < bytes_avail/2; j++) {
-                uint8_t val = *src++;
-                *dst++ = val;
-                src++;
-                if(val > max_val)
-                    max_val = val;
+        if(compressed) {
+            /* Nothing to measure without decoding, keep the first good one */
+            LOG_INFO("%i %u, %ux%u JPEG%s", n, bytes_avail, jpeg.width(), jpeg.height(),
+                    jpeg.has_dht() ? "" : " without DHT");
+            if(!jpeg.write("image.jpg")) {
+                LOG_ERROR("Could not write image.jpg");
             }
-            fprintf(f, "P5\n%i %i\n%i\n", cam->width(), cam->height(), max_val);
-            fprintf(f, "#FOURCC %s\n", cam->fmt()->pix_fmt_str().c_str());
-            fwrite(frame, bytes_avail/2, 1, f);
-            fclose(f);
+            break;
+        }
+        const char * fname = colour ? "image.ppm" : "image.pgm";
+        const uint8_t * planes[VIDEO_MAX_PLANES];
+        unsigned p;
+        for(p = 0; p < cam->fmt()->num_planes(); p++) {
+            planes[p] = cam->buf_start(n, p);
+        }
+        LOG_INFO("%i %u", n, bytes_avail);
+        if(colour ? !writer.write_ppm(fname, *cam->fmt(), planes, bytes_avail,
+                        cam->converter(), tiles)
+                : !writer.write_pgm(fname, *cam->fmt(), planes, bytes_avail)) {
+            LOG_ERROR("Could not write %s from %s frames", fname,
+                    cam->fmt()->pix_fmt_str().c_str());
+        }
+        if(thumb_width) {
+            save_thumbnail(cam, tiles, planes, bytes_avail, thumb_width, thumb_height,
+                    colour, writer);
         }
         break;
     }
-    cam->check_controls();
+    if(!replay) {
+        static_cast<Camera *>(cam)->check_controls();
+    }
+    cam->stats().log();
     cam->disable_capture();
 
     cam->close();
+    delete tiles;
+    delete tile_pool;
+    delete pool;
+    delete cam;
     return 0;
 }
@@ -0,0 +1,249 @@
+#include "logging.h"
+#include "pnm.h"
+#include "mjpeg.h"
+
+/* Marker codes, the byte after 0xFF */
+#define M_SOF0  0xC0
+#define M_SOF3  0xC3
+#define M_DHT   0xC4
+#define M_RST0  0xD0
+#define M_RST7  0xD7
+#define M_SOI   0xD8
+#define M_EOI   0xD9
+#define M_SOS   0xDA
+#define M_TEM   0x01
+
+/**
+ * The Huffman tables from Annex K.3 of the JPEG standard (ITU T.81) as one
+ * DHT segment: luma DC, luma AC, chroma DC then chroma AC. Each table is
+ * its class and id, the number of codes of each length 1 to 16, then the
+ * symbols.
+ */
+static constexpr uint8_t DEFAULT_DHT[] = {
+    0xFF, M_DHT, 0x01, 0xA2,
+
+    0x00,
+    0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+
+    0x10,
+    0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03,
+    0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7D,
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+    0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08,
+    0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16,
+    0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+    0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+    0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+    0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+    0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6,
+    0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+    0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4,
+    0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA,
+    0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA,
+
+    0x01,
+    0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+
+    0x11,
+    0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04,
+    0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02, 0x77,
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+    0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+    0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34,
+    0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+    0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38,
+    0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+    0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+    0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4,
+    0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+    0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2,
+    0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+    0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9,
+    0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA,
+};
+
+/**
+ * @return number of symbols in the table starting at offset, from its
+ * 16 code counts
+ */
+static constexpr unsigned dht_symbols(unsigned offset)
+{
+    unsigned n = 0;
+    for(unsigned i = 0; i < 16; i++) {
+        n += DEFAULT_DHT[offset + 1 + i];
+    }
+    return n;
+}
+
+/* Each table is 17 bytes then its symbols, the counts must match them */
+static_assert(dht_symbols(4) == 12, "luma DC table");
+static_assert(dht_symbols(4 + 17 + 12) == 162, "luma AC table");
+static_assert(dht_symbols(4 + 17 + 12 + 17 + 162) == 12, "chroma DC table");
+static_assert(dht_symbols(4 + 17 + 12 + 17 + 162 + 17 + 12) == 162, "chroma AC table");
+static_assert(sizeof(DEFAULT_DHT) == 4 + 4 * 17 + 12 + 162 + 12 + 162, "DHT size");
+static_assert(sizeof(DEFAULT_DHT) == 2u + ((DEFAULT_DHT[2] << 8) | DEFAULT_DHT[3]),
+        "DHT length field");
+
+static inline unsigned get_be16(const uint8_t * p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/**
+ * Walk the marker segments of a frame up to the start of scan
+ *
+ * @param[in] data The frame as the driver gave it
+ * @param[in] bytes bytesused from VIDIOC_DQBUF
+ *
+ * @return false if it does not look like a baseline or progressive JPEG
+ * with a frame header before the scan and an end marker after it
+ */
+bool MjpegFrame::parse(const uint8_t * data, unsigned bytes)
+{
+    unsigned pos = 2;
+    bool have_sof = false;
+
+    m_data = data;
+    m_bytes = 0;
+    m_width = m_height = m_components = 0;
+    m_sos = 0;
+    m_has_dht = false;
+
+    if((bytes < 4) || (data[0] != 0xFF) || (data[1] != M_SOI)) {
+        return false;
+    }
+    for(;;) {
+        if((pos >= bytes) || (data[pos] != 0xFF)) {
+            LOG_DEBUG("No marker at %u of %u", pos, bytes);
+            return false;
+        }
+        const unsigned start = pos;
+        while((pos < bytes) && (data[pos] == 0xFF)) {
+            pos++;
+        }
+        if(pos >= bytes) {
+            return false;
+        }
+        const uint8_t marker = data[pos++];
+        if((marker == M_TEM) || ((marker >= M_RST0) && (marker <= M_RST7))) {
+            continue;
+        }
+        if((marker == M_SOI) || (marker == M_EOI)) {
+            return false;
+        }
+        if(pos + 2 > bytes) {
+            return false;
+        }
+        const unsigned len = get_be16(data + pos);
+        if((len < 2) || (pos + len > bytes)) {
+            return false;
+        }
+        if(marker == M_SOS) {
+            m_sos = start;
+            break;
+        }
+        if(marker == M_DHT) {
+            m_has_dht = true;
+        }
+        else if((marker >= M_SOF0) && (marker <= M_SOF3)) {
+            if(len < 8) {
+                return false;
+            }
+            m_height = get_be16(data + pos + 3);
+            m_width = get_be16(data + pos + 5);
+            m_components = data[pos + 7];
+            have_sof = true;
+        }
+        pos += len;
+    }
+    if(!have_sof || !m_width || !m_height) {
+        return false;
+    }
+
+    /* Some drivers pad bytesused past EOI, 0xFF in the scan is always
+     * followed by 0 or a restart marker so the last FF D9 is the end. A
+     * frame without one was cut short. */
+    for(pos = bytes - 1; pos > m_sos + 1; pos--) {
+        if((data[pos] == M_EOI) && (data[pos - 1] == 0xFF)) {
+            m_bytes = pos + 1;
+            return true;
+        }
+    }
+    LOG_DEBUG("No EOI in %u bytes", bytes);
+    return false;
+}
+
+/**
+ * The frame as pieces for writev, with the standard Huffman tables added
+ * before the scan if it has none of its own
+ *
+ * @param[out] iov At least MJPEG_MAX_IOV entries
+ *
+ * @return number of entries filled in, 0 if parse() failed
+ */
+unsigned MjpegFrame::iov(struct iovec * iov) const
+{
+    if(!m_bytes) {
+        return 0;
+    }
+    if(m_has_dht) {
+        iov[0].iov_base = const_cast<uint8_t *>(m_data);
+        iov[0].iov_len = m_bytes;
+        return 1;
+    }
+    iov[0].iov_base = const_cast<uint8_t *>(m_data);
+    iov[0].iov_len = m_sos;
+    iov[1].iov_base = const_cast<uint8_t *>(DEFAULT_DHT);
+    iov[1].iov_len = sizeof(DEFAULT_DHT);
+    iov[2].iov_base = const_cast<uint8_t *>(m_data + m_sos);
+    iov[2].iov_len = m_bytes - m_sos;
+    return 3;
+}
+
+/**
+ * @return bytes iov() describes
+ */
+unsigned MjpegFrame::size() const
+{
+    if(!m_bytes) {
+        return 0;
+    }
+    return m_has_dht ? m_bytes : m_bytes + sizeof(DEFAULT_DHT);
+}
+
+/**
+ * Write the frame as a JPEG file
+ *
+ * @return false if parse() failed or the file could not be written
+ */
+bool MjpegFrame::write(const std::string & path) const
+{
+    struct iovec pieces[MJPEG_MAX_IOV];
+    const unsigned n = iov(pieces);
+
+    if(!n) {
+        return false;
+    }
+    return write_file(path, pieces, n);
+}
@@ -0,0 +1,47 @@
+#ifndef _MJPEG_H_
+#define _MJPEG_H_
+
+#include <string>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+/* Most pieces a frame is written as, see MjpegFrame::iov() */
+#define MJPEG_MAX_IOV 3
+
+/**
+ * One compressed frame from a UVC camera, looked at without decoding it.
+ * Only the marker segments up to the start of scan are walked, for the
+ * size in the frame header and to see if the Huffman tables are there.
+ * UVC MJPEG leaves them out and relies on the standard ones, so iov()
+ * puts the Annex K tables back in before the scan, making a frame any
+ * JPEG reader will take. The frame itself is never copied.
+ */
+class MjpegFrame
+{
+private:
+    const uint8_t * m_data;
+    unsigned m_bytes;           /* Up to and including EOI if found */
+    unsigned m_width;
+    unsigned m_height;
+    unsigned m_components;
+    unsigned m_sos;             /* Offset of the first SOS marker */
+    bool m_has_dht;
+
+public:
+    MjpegFrame() : m_data(0), m_bytes(0), m_width(0), m_height(0),
+        m_components(0), m_sos(0), m_has_dht(false) {};
+
+    bool parse(const uint8_t * data, unsigned bytes);
+    unsigned iov(struct iovec * iov) const;
+    unsigned size() const;
+    bool write(const std::string & path) const;
+
+    unsigned width() const {return m_width;};
+    unsigned height() const {return m_height;};
+    unsigned components() const {return m_components;};
+    bool has_dht() const {return m_has_dht;};
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include "logging.h"
+#include "multicam.h"
+
+#define DEFAULT_MAX_PENDING (2)
+
+/**
+ * @param[in] tolerance_ns Largest spread of timestamps allowed within a set
+ */
+MultiCamSession::MultiCamSession(uint64_t tolerance_ns)
+    : m_handler(0), m_tolerance_ns(tolerance_ns),
+      m_max_pending(DEFAULT_MAX_PENDING), m_sets(0), m_discarded(0)
+{
+}
+
+MultiCamSession::~MultiCamSession()
+{
+}
+
+/**
+ * Add a camera to the session, as for CaptureReactor::add_camera it should
+ * already have its buffers queued and capture enabled. Give it a couple
+ * more buffers than max_pending, that many are held while waiting for the
+ * other cameras.
+ *
+ * @param[in] cam The camera
+ *
+ * @return true on success
+ */
+bool MultiCamSession::add_camera(FrameSource * cam)
+{
+    if(!m_reactor.add_camera(cam, this)) {
+        return false;
+    }
+    Stream stream;
+    stream.cam = cam;
+    m_streams.push_back(stream);
+    return true;
+}
+
+/**
+ * Park a frame until the other cameras have one to go with it
+ */
+bool MultiCamSession::on_frame(FrameSource & cam, const FrameMeta & meta)
+{
+    std::vector<Stream>::iterator p;
+
+    for(p = m_streams.begin(); p != m_streams.end(); p++) {
+        if(p->cam == &cam) {
+            break;
+        }
+    }
+    if(p == m_streams.end()) {
+        return true;
+    }
+    p->pending.push_back(meta);
+    /* A camera that has stopped must not starve the others of buffers */
+    while(p->pending.size() > m_max_pending) {
+        discard(*p);
+    }
+    match();
+    return false;
+}
+
+/**
+ * A camera failed, carry on with the rest. Its waiting frames are simply
+ * forgotten, the device is not asked to take them back.
+ */
+void MultiCamSession::on_camera_dropped(FrameSource & cam)
+{
+    std::vector<Stream>::iterator p;
+
+    for(p = m_streams.begin(); p != m_streams.end(); p++) {
+        if(p->cam == &cam) {
+            m_streams.erase(p);
+            LOG_WARN("Camera dropped from session, %u left", num_cameras());
+            /* Frames that were only waiting for it may now make sets */
+            match();
+            return;
+        }
+    }
+}
+
+/**
+ * Give the oldest waiting frame of a stream back to its camera
+ */
+void MultiCamSession::discard(Stream & stream)
+{
+    stream.cam->queue_buffer(stream.pending.front().index);
+    stream.pending.pop_front();
+    m_discarded++;
+}
+
+/**
+ * Make as many sets as the waiting frames allow
+ */
+void MultiCamSession::match()
+{
+    std::vector<Stream>::iterator p;
+
+    while(!m_streams.empty()) {
+        Stream * earliest = NULL;
+        uint64_t first = 0;
+        uint64_t last = 0;
+
+        for(p = m_streams.begin(); p != m_streams.end(); p++) {
+            if(p->pending.empty()) {
+                return;
+            }
+            const uint64_t ts = p->pending.front().timestamp_ns;
+            if(!earliest || (ts < first)) {
+                earliest = &*p;
+                first = ts;
+            }
+            if(ts > last) {
+                last = ts;
+            }
+        }
+        if(last - first > m_tolerance_ns) {
+            /* Every other head is later still, so this frame has missed */
+            discard(*earliest);
+            continue;
+        }
+
+        FrameSet set;
+        set.timestamp_ns = first;
+        set.skew_ns = last - first;
+        for(p = m_streams.begin(); p != m_streams.end(); p++) {
+            FrameSet::Member member;
+            member.cam = p->cam;
+            member.meta = p->pending.front();
+            set.members.push_back(member);
+            p->pending.pop_front();
+        }
+        m_sets++;
+        m_skew.record(set.skew_ns);
+        if(!m_handler || m_handler->on_frame_set(*this, set)) {
+            release(set);
+        }
+    }
+}
+
+/**
+ * Hand the buffers of a set back to their cameras
+ *
+ * @param[in] set As passed to FrameSetHandler::on_frame_set
+ */
+void MultiCamSession::release(const FrameSet & set)
+{
+    std::vector<FrameSet::Member>::const_iterator p;
+
+    for(p = set.members.begin(); p != set.members.end(); p++) {
+        p->cam->queue_buffer(p->meta.index);
+    }
+}
+
+void MultiCamSession::log() const
+{
+    LOG_INFO("Frame sets %llu from %u cameras, discarded %llu frames",
+            (unsigned long long) m_sets, num_cameras(),
+            (unsigned long long) m_discarded);
+    m_skew.log("Skew");
+}
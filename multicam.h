@@ -0,0 +1,112 @@
+#ifndef _MULTICAM_H_
+#define _MULTICAM_H_
+
+#include <deque>
+#include <vector>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "frame.h"
+#include "reactor.h"
+#include "stats.h"
+#include "framesource.h"
+
+class MultiCamSession;
+
+/**
+ * One frame from each camera of a session, taken at (nearly) the same time.
+ * Members are in the order the cameras were added. Nothing is copied, each
+ * member refers to a buffer still dequeued from its camera until the set is
+ * released.
+ */
+struct FrameSet
+{
+    struct Member
+    {
+        FrameSource * cam;
+        FrameMeta meta;
+    };
+
+    std::vector<Member> members;
+    uint64_t timestamp_ns;      /* of the earliest member */
+    uint64_t skew_ns;           /* latest less earliest */
+
+    unsigned size() const {return members.size();};
+    uint8_t * data(unsigned i, unsigned plane = 0) const
+    {
+        return members[i].cam->buf_start(members[i].meta.index, plane);
+    };
+};
+
+/**
+ * Anything that wants frame sets from a MultiCamSession implements this
+ */
+class FrameSetHandler
+{
+public:
+    virtual ~FrameSetHandler() {};
+
+    /**
+     * Called for each complete set.
+     *
+     * @return true if the session should release the set straight away,
+     * false if the handler has kept a copy of it and will pass that to
+     * MultiCamSession::release itself
+     */
+    virtual bool on_frame_set(MultiCamSession & session, const FrameSet & set) = 0;
+};
+
+/**
+ * Streams several cameras at once from a CaptureReactor and groups their
+ * frames into sets by driver timestamp. A set is made when the oldest
+ * waiting frame of every camera is within the tolerance of each other;
+ * otherwise the oldest of them cannot belong to any later set and is
+ * requeued. Cameras should all use monotonic timestamps so they share a
+ * clock. A camera that fails is taken out and sets carry on from the rest.
+ */
+class MultiCamSession : private FrameHandler
+{
+private:
+    struct Stream
+    {
+        FrameSource * cam;
+        std::deque<FrameMeta> pending;
+    };
+
+    CaptureReactor m_reactor;
+    std::vector<Stream> m_streams;
+    FrameSetHandler * m_handler;
+    uint64_t m_tolerance_ns;
+    unsigned m_max_pending;
+
+    uint64_t m_sets;
+    uint64_t m_discarded;
+    Histogram m_skew;
+
+    virtual bool on_frame(FrameSource & cam, const FrameMeta & meta);
+    virtual void on_camera_dropped(FrameSource & cam);
+    void discard(Stream & stream);
+    void match();
+
+public:
+    MultiCamSession(uint64_t tolerance_ns);
+    virtual ~MultiCamSession();
+
+    bool add_camera(FrameSource * cam);
+    void set_handler(FrameSetHandler * handler) {m_handler = handler;};
+    void set_max_pending(unsigned max_pending) {m_max_pending = max_pending;};
+    void release(const FrameSet & set);
+
+    int run_once(int timeout_ms) {return m_reactor.run_once(timeout_ms);};
+    void run() {m_reactor.run();};
+    void stop() {m_reactor.stop();};
+
+    unsigned num_cameras() const {return m_streams.size();};
+    uint64_t sets() const {return m_sets;};
+    uint64_t discarded() const {return m_discarded;};
+    const Histogram & skew() const {return m_skew;};
+    void log() const;
+};
+
+#endif
@@ -0,0 +1,239 @@
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "logging.h"
+#include "debug.h"
+#include "format.h"
+#include "negotiate.h"
+
+#define MAX_FORMATS (100)
+#define MAX_SIZES (100)
+#define MAX_INTERVALS (100)
+
+/* Score weights */
+#define FPS_WEIGHT (4000)
+#define SIZE_WEIGHT (1000)
+#define BANDWIDTH_PENALTY (3000)
+#define COMPRESSED_BONUS (500)
+
+/**
+ * Rough bytes per frame, for judging whether the bus can keep up
+ */
+static uint64_t frame_bytes(const FormatCandidate & c)
+{
+    const uint64_t pixels = static_cast<uint64_t>(c.width) * c.height;
+    if(c.flags & V4L2_FMT_FLAG_COMPRESSED) {
+        return pixels / 4;      /* MJPEG is typically ~2 bits per pixel */
+    }
+    switch(c.pixelformat) {
+    case V4L2_PIX_FMT_GREY:
+        return pixels;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV12M:
+    case V4L2_PIX_FMT_YUV420:
+        return pixels * 3 / 2;
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+        return pixels * 3;
+    }
+    return pixels * 2;
+}
+
+/**
+ * Enumerate all the formats for a buffer type, adding a candidate for
+ * every size and interval of each
+ *
+ * @return Number of candidates now known
+ */
+unsigned FormatNegotiator::enumerate(int buf_type)
+{
+    unsigned i;
+
+    for(i = 0; i < MAX_FORMATS; i++) {
+        struct v4l2_fmtdesc desc;
+
+        memset(&desc, 0, sizeof(desc));
+        desc.index = i;
+        desc.type = buf_type;
+        if(ioctl(m_fd, VIDIOC_ENUM_FMT, &desc) == -1) {
+            break;
+        }
+        if(!format_supported(desc.pixelformat)) {
+            LOG_DEBUG("Skipping format %s", pixelfmt2str(desc.pixelformat));
+            continue;
+        }
+        FormatCandidate fmt;
+        memset(&fmt, 0, sizeof(fmt));
+        fmt.buf_type = buf_type;
+        fmt.pixelformat = desc.pixelformat;
+        fmt.flags = desc.flags;
+        add_sizes(fmt);
+    }
+    return m_candidates.size();
+}
+
+void FormatNegotiator::add_sizes(const FormatCandidate & fmt)
+{
+    unsigned i;
+    FormatCandidate size = fmt;
+
+    for(i = 0; i < MAX_SIZES; i++) {
+        struct v4l2_frmsizeenum frmsize;
+
+        memset(&frmsize, 0, sizeof(frmsize));
+        frmsize.index = i;
+        frmsize.pixel_format = fmt.pixelformat;
+        if(ioctl(m_fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) == -1) {
+            if(i == 0) {
+                /* Driver can't say, take whatever it defaults to */
+                add_intervals(size);
+            }
+            return;
+        }
+        if(frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+            size.width = frmsize.discrete.width;
+            size.height = frmsize.discrete.height;
+            add_intervals(size);
+        }
+        else {
+            /* Stepwise or continuous, offer the two extremes */
+            size.width = frmsize.stepwise.min_width;
+            size.height = frmsize.stepwise.min_height;
+            add_intervals(size);
+            size.width = frmsize.stepwise.max_width;
+            size.height = frmsize.stepwise.max_height;
+            add_intervals(size);
+            return;
+        }
+    }
+}
+
+void FormatNegotiator::add_intervals(const FormatCandidate & size)
+{
+    unsigned i;
+    FormatCandidate c = size;
+
+    for(i = 0; i < MAX_INTERVALS; i++) {
+        struct v4l2_frmivalenum frmival;
+
+        memset(&frmival, 0, sizeof(frmival));
+        frmival.index = i;
+        frmival.pixel_format = size.pixelformat;
+        frmival.width = size.width;
+        frmival.height = size.height;
+        if(ioctl(m_fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == -1) {
+            if(i == 0) {
+                c.interval_num = 0;
+                c.interval_den = 0;
+                m_candidates.push_back(c);
+            }
+            return;
+        }
+        if(frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+            c.interval_num = frmival.discrete.numerator;
+            c.interval_den = frmival.discrete.denominator;
+            m_candidates.push_back(c);
+        }
+        else {
+            /* Stepwise or continuous, offer the fastest and slowest */
+            c.interval_num = frmival.stepwise.min.numerator;
+            c.interval_den = frmival.stepwise.min.denominator;
+            m_candidates.push_back(c);
+            c.interval_num = frmival.stepwise.max.numerator;
+            c.interval_den = frmival.stepwise.max.denominator;
+            m_candidates.push_back(c);
+            return;
+        }
+    }
+}
+
+/**
+ * Score a candidate, higher is better. Soft shortfalls such as going over
+ * the bandwidth lower the score, and may take it below zero, but leave the
+ * candidate usable so the least bad one still wins.
+ *
+ * @param[in,out] c The candidate, score and usable are set
+ *
+ * @return false if the candidate cannot be used at all
+ */
+bool FormatNegotiator::score(FormatCandidate & c, const CaptureTarget & target,
+        uint64_t max_area) const
+{
+    const uint64_t area = static_cast<uint64_t>(c.width) * c.height;
+    double fps = c.fps();
+    double score = 0;
+
+    c.score = 0;
+    c.usable = (c.width >= target.min_width) && (c.height >= target.min_height);
+    if(!c.usable) {
+        return false;
+    }
+
+    /* Unknown interval, assume it can do what we want */
+    if(fps <= 0.0) {
+        fps = target.target_fps;
+    }
+    if(target.target_fps) {
+        const double achieved = fps < target.target_fps ? fps : target.target_fps;
+        score += FPS_WEIGHT * achieved / target.target_fps;
+        /* Slightly prefer an exact match over running faster than needed */
+        if(fps > target.target_fps) {
+            score -= fps - target.target_fps;
+        }
+        if(target.max_bandwidth
+                && (frame_bytes(c) * achieved > target.max_bandwidth)) {
+            score -= BANDWIDTH_PENALTY;
+        }
+    }
+
+    /* Smallest size that meets the minimum, or the largest if no minimum */
+    if(area) {
+        if(target.min_width || target.min_height) {
+            const uint64_t min_area = static_cast<uint64_t>(
+                    target.min_width ? target.min_width : 1)
+                    * (target.min_height ? target.min_height : 1);
+            score += SIZE_WEIGHT * static_cast<double>(min_area) / area;
+        }
+        else if(max_area) {
+            score += SIZE_WEIGHT * static_cast<double>(area) / max_area;
+        }
+    }
+
+    if(target.prefer_compressed && (c.flags & V4L2_FMT_FLAG_COMPRESSED)) {
+        score += COMPRESSED_BONUS;
+    }
+    c.score = static_cast<int>(score);
+    return true;
+}
+
+/**
+ * @return The best candidate for the target, NULL if none will do
+ */
+const FormatCandidate * FormatNegotiator::best(const CaptureTarget & target)
+{
+    std::vector<FormatCandidate>::iterator p;
+    const FormatCandidate * found = NULL;
+    uint64_t max_area = 0;
+
+    for(p = m_candidates.begin(); p != m_candidates.end(); p++) {
+        const uint64_t area = static_cast<uint64_t>(p->width) * p->height;
+        if(area > max_area) {
+            max_area = area;
+        }
+    }
+    for(p = m_candidates.begin(); p != m_candidates.end(); p++) {
+        const bool usable = score(*p, target, max_area);
+        LOG_DEBUG("%s %ux%u @ %u/%u score %i%s", pixelfmt2str(p->pixelformat),
+                p->width, p->height, p->interval_num, p->interval_den, p->score,
+                usable ? "" : " (unusable)");
+        if(usable && (!found || (p->score > found->score))) {
+            found = &(*p);
+        }
+    }
+    if(found) {
+        LOG_INFO("Negotiated %s %ux%u @ %u/%u", pixelfmt2str(found->pixelformat),
+                found->width, found->height, found->interval_num, found->interval_den);
+    }
+    return found;
+}
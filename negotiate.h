@@ -0,0 +1,68 @@
+#ifndef _NEGOTIATE_H_
+#define _NEGOTIATE_H_
+
+#include <vector>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * What we would like from the camera
+ */
+struct CaptureTarget
+{
+    unsigned min_width;         /* 0 means as large as possible */
+    unsigned min_height;
+    unsigned target_fps;
+    uint64_t max_bandwidth;     /* Bytes/s the bus can carry, 0 if no limit */
+    bool prefer_compressed;
+
+    CaptureTarget() : min_width(0), min_height(0), target_fps(30),
+        max_bandwidth(0), prefer_compressed(false) {};
+};
+
+/**
+ * One combination of format, frame size and frame interval the device says
+ * it can do
+ */
+struct FormatCandidate
+{
+    int buf_type;
+    uint32_t pixelformat;
+    uint32_t flags;             /* V4L2_FMT_FLAG_xxx */
+    unsigned width;
+    unsigned height;
+    uint32_t interval_num;      /* Time per frame in seconds, 0/0 unknown */
+    uint32_t interval_den;
+    int score;                  /* Higher is better, only compared if usable */
+    bool usable;                /* False if it fails a hard requirement */
+
+    double fps() const {return interval_num ? (double) interval_den / interval_num : 0.0;};
+};
+
+/**
+ * Enumerates everything a device offers (VIDIOC_ENUM_FMT,
+ * VIDIOC_ENUM_FRAMESIZES, VIDIOC_ENUM_FRAMEINTERVALS) and scores it against
+ * a CaptureTarget. Only formats with a BaseFormat implementation are
+ * considered.
+ */
+class FormatNegotiator
+{
+private:
+    int m_fd;
+    std::vector<FormatCandidate> m_candidates;
+
+    void add_sizes(const FormatCandidate & fmt);
+    void add_intervals(const FormatCandidate & size);
+    bool score(FormatCandidate & c, const CaptureTarget & target,
+            uint64_t max_area) const;
+
+public:
+    FormatNegotiator(int fd) : m_fd(fd) {};
+
+    unsigned enumerate(int buf_type);
+    const FormatCandidate * best(const CaptureTarget & target);
+    const std::vector<FormatCandidate> & candidates() const {return m_candidates;};
+};
+
+#endif
@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "logging.h"
+#include "capture.h"
+#include "bufpool.h"
+#include "pipeline.h"
+
+/* How often the capture thread checks for stop() if nothing else happens */
+#define POLL_TIMEOUT_MS (100)
+
+/**
+ * Construct the pipeline, the camera should have its buffers requested
+ * and queued but the threads don't run until start(). To have the buffer
+ * pool sized to the load, set_pool() before starting.
+ *
+ * @param[in] cam The camera to capture from
+ * @param[in] proc What to do with each frame
+ * @param[in] num_workers Size of the worker pool
+ */
+CapturePipeline::CapturePipeline(FrameSource & cam, FrameProcessor & proc,
+        unsigned num_workers)
+    : m_cam(cam), m_proc(proc), m_num_workers(num_workers), m_pool(0),
+      m_frames(VIDEO_MAX_FRAME), m_done(VIDEO_MAX_FRAME), m_wake_fd(-1),
+      m_running(false), m_processed(0)
+{
+    if(m_num_workers == 0) {
+        m_num_workers = 1;
+    }
+    sem_init(&m_work_sem, 0, 0);
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_wake_fd < 0) {
+        LOG_ERRNO_AS_ERROR("eventfd");
+        throw Camera_error();
+    }
+}
+
+CapturePipeline::~CapturePipeline()
+{
+    stop();
+    ::close(m_wake_fd);
+    sem_destroy(&m_work_sem);
+}
+
+/**
+ * Start the capture thread and the workers
+ *
+ * @return true on success
+ */
+bool CapturePipeline::start()
+{
+    unsigned i;
+
+    if(m_running) {
+        return true;
+    }
+    if(!m_cam.is_nonblocking() && !m_cam.set_nonblocking(true)) {
+        return false;
+    }
+    m_running = true;
+    for(i = 0; i < m_num_workers; i++) {
+        m_workers.push_back(std::thread(&CapturePipeline::worker_loop, this));
+    }
+    m_capture = std::thread(&CapturePipeline::capture_loop, this);
+    LOG_INFO("Pipeline started with %u workers", m_num_workers);
+    return true;
+}
+
+/**
+ * Stop all the threads, frames still in the ring are requeued
+ */
+void CapturePipeline::stop()
+{
+    unsigned i;
+
+    if(!m_capture.joinable()) {
+        return;
+    }
+    m_running = false;
+    m_capture.join();
+    for(i = 0; i < m_workers.size(); i++) {
+        sem_post(&m_work_sem);
+    }
+    for(i = 0; i < m_workers.size(); i++) {
+        m_workers[i].join();
+    }
+    m_workers.clear();
+
+    FrameMeta meta;
+    while(m_frames.pop(meta)) {
+        m_cam.queue_buffer(meta.index);
+    }
+    requeue_done();
+}
+
+/**
+ * Give the driver (or the pool, if one is set) back any buffers the
+ * workers have finished with
+ */
+void CapturePipeline::requeue_done()
+{
+    int n;
+    while(m_done.pop(n)) {
+        if(m_pool) {
+            m_pool->release(n);
+        }
+        else {
+            m_cam.queue_buffer(n);
+        }
+    }
+}
+
+void CapturePipeline::capture_loop()
+{
+    struct pollfd fds[2];
+
+    fds[0].fd = m_cam.fd();
+    fds[0].events = POLLIN;
+    fds[1].fd = m_wake_fd;
+    fds[1].events = POLLIN;
+
+    try {
+        while(m_running) {
+            const int status = poll(fds, 2, POLL_TIMEOUT_MS);
+            if(status < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                LOG_ERRNO_AS_ERROR("poll");
+                break;
+            }
+            if(fds[1].revents & POLLIN) {
+                uint64_t count;
+                if(read(m_wake_fd, &count, sizeof(count)) < 0) {
+                    /* Nothing to clear */
+                }
+            }
+            requeue_done();
+
+            /* POLLERR also just means no buffers queued, DQBUF decides */
+            if(fds[0].revents) {
+                FrameMeta meta;
+                while(m_cam.wait_buffer_ready(meta) >= 0) {
+                    if(m_pool) {
+                        m_pool->update(meta);
+                    }
+                    if(m_frames.push(meta)) {
+                        sem_post(&m_work_sem);
+                    }
+                    else {
+                        m_cam.queue_buffer(meta.index);
+                    }
+                }
+            }
+        }
+    }
+    catch(Camera_error &) {
+        LOG_ERROR("Capture failed, stopping pipeline");
+    }
+    m_running = false;
+}
+
+void CapturePipeline::worker_loop()
+{
+    for(;;) {
+        FrameMeta meta;
+
+        while(sem_wait(&m_work_sem) == -1 && errno == EINTR) {
+        }
+        if(!m_frames.pop(meta)) {
+            if(!m_running) {
+                break;
+            }
+            continue;
+        }
+        m_proc.process(m_cam, meta);
+        m_processed++;
+        while(!m_done.push(meta.index)) {
+            /* Can't be full, at most VIDEO_MAX_FRAME buffers exist */
+            std::this_thread::yield();
+        }
+        const uint64_t one = 1;
+        if(write(m_wake_fd, &one, sizeof(one)) < 0) {
+            /* Counter saturated, capture thread is being woken anyway */
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "frame.h"
+#include "ring.h"
+
+class FrameSource;
+class BufferPool;
+
+/**
+ * Does the work on a frame. process is called from several worker threads
+ * at once so must be thread safe; the buffer is requeued when it returns.
+ */
+class FrameProcessor
+{
+public:
+    virtual ~FrameProcessor() {};
+    virtual void process(FrameSource & cam, const FrameMeta & meta) = 0;
+};
+
+/**
+ * Splits capture from processing. A capture thread dequeues frames and
+ * publishes them on a lock-free ring, a pool of workers takes them off,
+ * processes them and hands the buffer index back on a completion ring. The
+ * capture thread requeues completed buffers, so the source itself is only
+ * ever touched from one thread and the driver queue stays full while the
+ * processing scales across cores.
+ */
+class CapturePipeline
+{
+private:
+    FrameSource & m_cam;
+    FrameProcessor & m_proc;
+    unsigned m_num_workers;
+    BufferPool * m_pool;
+
+    Ring<FrameMeta> m_frames;
+    Ring<int> m_done;
+    sem_t m_work_sem;       /* Counts frames waiting in m_frames */
+    int m_wake_fd;          /* eventfd, kicks capture thread on completion */
+
+    std::atomic<bool> m_running;
+    std::atomic<uint64_t> m_processed;
+    std::thread m_capture;
+    std::vector<std::thread> m_workers;
+
+    void capture_loop();
+    void worker_loop();
+    void requeue_done();
+
+public:
+    CapturePipeline(FrameSource & cam, FrameProcessor & proc, unsigned num_workers);
+    ~CapturePipeline();
+
+    void set_pool(BufferPool * pool) {m_pool = pool;};
+    bool start();
+    void stop();
+    bool running() const {return m_running;};
+    uint64_t processed() const {return m_processed;};
+};
+
+#endif
@@ -0,0 +1,804 @@
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "logging.h"
+#include "format.h"
+#include "pixkernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXEL_X86
+#endif
+
+/*
+ * Each kernel is instantiated for one source format, matrix (standard and
+ * range) and output layout, so the coefficients are immediates and the
+ * inner loops have no branches on any of them. find_pixel_kernel() picks
+ * the instance once, when the format is set.
+ */
+
+#define FRAC_BITS (ColourConverter::FRAC_BITS)
+#define ROUND (1 << (FRAC_BITS - 1))
+
+static inline uint8_t clamp8(int val)
+{
+    return val < 0 ? 0 : (val > 255 ? 255 : val);
+}
+
+/**
+ * Rows converted with plain C, exactly as yuv_row_scalar does
+ */
+struct ScalarRows
+{
+    template<class M, class L>
+    static void row(const uint8_t * y, const uint8_t * u, const uint8_t * v,
+            unsigned width, uint8_t * out)
+    {
+        unsigned x;
+
+        for(x = 0; x < width; x++) {
+            const int yy = M::CY * (y[x] - M::Y_OFFSET) + ROUND;
+            const int uu = u[x >> 1] - 128;
+            const int vv = v[x >> 1] - 128;
+            out[L::R] = clamp8((yy + M::CRV * vv) >> FRAC_BITS);
+            out[L::G] = clamp8((yy - M::CGU * uu - M::CGV * vv) >> FRAC_BITS);
+            out[L::B] = clamp8((yy + M::CBU * uu) >> FRAC_BITS);
+            out += 3;
+        }
+    }
+};
+
+/**
+ * RGB24 rows to Y'CbCr with plain C, exactly as rgb_yuyv_row_scalar and
+ * the others in colour.cpp do. x0 is where to start, so the vector
+ * kernels can finish a row with these.
+ */
+struct ScalarRgb
+{
+    template<class M>
+    static uint8_t y(const uint8_t * p)
+    {
+        return clamp8(M::Y_OFFSET
+                + ((M::YR * p[0] + M::YG * p[1] + M::YB * p[2] + ROUND) >> FRAC_BITS));
+    }
+
+    /* Chroma of the sum of 1 << LOG2_N pixels */
+    template<class M, unsigned LOG2_N>
+    static void uv(int r, int g, int b, uint8_t & u, uint8_t & v)
+    {
+        const unsigned shift = FRAC_BITS + LOG2_N;
+        const int round = 1 << (shift - 1);
+        u = clamp8(128 + ((M::UR * r + M::UG * g + M::UB * b + round) >> shift));
+        v = clamp8(128 + ((M::VR * r + M::VG * g + M::VB * b + round) >> shift));
+    }
+
+    template<class M>
+    static void yuyv(const uint8_t * rgb, unsigned x0, unsigned width, uint8_t * out)
+    {
+        unsigned x;
+
+        for(x = x0; x < width; x += 2) {
+            const uint8_t * p = rgb + 3 * x;
+            const uint8_t * p1 = (x + 1 < width) ? p + 3 : p;
+            out[2 * x] = y<M>(p);
+            out[2 * x + 2] = y<M>(p1);
+            uv<M, 1>(p[0] + p1[0], p[1] + p1[1], p[2] + p1[2], out[2 * x + 1],
+                    out[2 * x + 3]);
+        }
+    }
+
+    template<class M>
+    static void luma(const uint8_t * rgb, unsigned x0, unsigned width, uint8_t * out)
+    {
+        unsigned x;
+
+        for(x = x0; x < width; x++) {
+            out[x] = y<M>(rgb + 3 * x);
+        }
+    }
+
+    template<class M>
+    static void chroma420(const uint8_t * rgb0, const uint8_t * rgb1, unsigned x0,
+            unsigned width, uint8_t * u, uint8_t * v)
+    {
+        unsigned x;
+
+        for(x = x0; x < width; x += 2) {
+            const unsigned a = 3 * x;
+            const unsigned b = (x + 1 < width) ? a + 3 : a;
+            uv<M, 2>(rgb0[a] + rgb0[b] + rgb1[a] + rgb1[b],
+                    rgb0[a + 1] + rgb0[b + 1] + rgb1[a + 1] + rgb1[b + 1],
+                    rgb0[a + 2] + rgb0[b + 2] + rgb1[a + 2] + rgb1[b + 2],
+                    u[x / 2], v[x / 2]);
+        }
+    }
+
+    template<class M>
+    static void yuyv_row(const uint8_t * rgb, unsigned width, uint8_t * out)
+    {
+        yuyv<M>(rgb, 0, width, out);
+    }
+
+    template<class M>
+    static void luma_row(const uint8_t * rgb, unsigned width, uint8_t * out)
+    {
+        luma<M>(rgb, 0, width, out);
+    }
+
+    template<class M>
+    static void chroma420_row(const uint8_t * rgb0, const uint8_t * rgb1,
+            unsigned width, uint8_t * u, uint8_t * v)
+    {
+        chroma420<M>(rgb0, rgb1, 0, width, u, v);
+    }
+};
+
+#ifdef PIXEL_X86
+
+/**
+ * Two 16 bit coefficients for _mm_madd_epi16, k0 multiplies the first of
+ * each interleaved pair
+ */
+static inline __m128i pair(int k0, int k1)
+{
+    return _mm_set1_epi32((k1 << 16) | (k0 & 0xFFFF));
+}
+
+/**
+ * a0 * k0 + b0 * k1 (+ extra) for eight int16 pairs, rounded, shifted
+ * back down and saturated to int16
+ */
+static inline __m128i dot2(__m128i a, __m128i b, __m128i k, __m128i extra_lo,
+        __m128i extra_hi)
+{
+    const __m128i round = _mm_set1_epi32(ROUND);
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), k);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k);
+    lo = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(lo, extra_lo), round), FRAC_BITS);
+    hi = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(hi, extra_hi), round), FRAC_BITS);
+    return _mm_packs_epi32(lo, hi);
+}
+
+/**
+ * Eight pixels, as int16 Y' less its offset and Cb, Cr less 128, to
+ * saturated int16 R', G', B'. All 32 bit maths, so it agrees exactly with
+ * the scalar rows.
+ */
+template<class M>
+static inline void yuv8(__m128i yd, __m128i ud, __m128i vd, __m128i & r,
+        __m128i & g, __m128i & b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i kg2 = pair(-M::CGV, 0);
+    const __m128i g2_lo = _mm_madd_epi16(_mm_unpacklo_epi16(vd, zero), kg2);
+    const __m128i g2_hi = _mm_madd_epi16(_mm_unpackhi_epi16(vd, zero), kg2);
+
+    r = dot2(yd, vd, pair(M::CY, M::CRV), zero, zero);
+    g = dot2(yd, ud, pair(M::CY, -M::CGU), g2_lo, g2_hi);
+    b = dot2(yd, ud, pair(M::CY, M::CBU), zero, zero);
+}
+
+/**
+ * Sixteen pixels of R', G', B' as bytes
+ */
+template<class M>
+static inline void yuv16(const uint8_t * y, const uint8_t * u, const uint8_t * v,
+        __m128i & r, __m128i & g, __m128i & b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i yoff = _mm_set1_epi16(M::Y_OFFSET);
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i yv = _mm_loadu_si128(reinterpret_cast<const __m128i *>(y));
+    const __m128i u8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(u));
+    const __m128i v8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(v));
+    /* Each chroma sample covers two pixels */
+    const __m128i uu = _mm_unpacklo_epi8(u8, u8);
+    const __m128i vv = _mm_unpacklo_epi8(v8, v8);
+    __m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+
+    yuv8<M>(_mm_sub_epi16(_mm_unpacklo_epi8(yv, zero), yoff),
+            _mm_sub_epi16(_mm_unpacklo_epi8(uu, zero), c128),
+            _mm_sub_epi16(_mm_unpacklo_epi8(vv, zero), c128), r_lo, g_lo, b_lo);
+    yuv8<M>(_mm_sub_epi16(_mm_unpackhi_epi8(yv, zero), yoff),
+            _mm_sub_epi16(_mm_unpackhi_epi8(uu, zero), c128),
+            _mm_sub_epi16(_mm_unpackhi_epi8(vv, zero), c128), r_hi, g_hi, b_hi);
+    r = _mm_packus_epi16(r_lo, r_hi);
+    g = _mm_packus_epi16(g_lo, g_hi);
+    b = _mm_packus_epi16(b_lo, b_hi);
+}
+
+/**
+ * pshufb masks that take byte n of output block k (of three 16 byte
+ * blocks of packed pixels) from the plane at offset p of each pixel, or
+ * zero it
+ */
+struct PackShuffle
+{
+    uint8_t mask[3][3][16];
+
+    PackShuffle()
+    {
+        unsigned k, n, p;
+        for(k = 0; k < 3; k++) {
+            for(n = 0; n < 16; n++) {
+                const unsigned out = 16 * k + n;
+                for(p = 0; p < 3; p++) {
+                    mask[k][p][n] = (out % 3 == p) ? out / 3 : 0x80;
+                }
+            }
+        }
+    }
+};
+
+static const PackShuffle pack_shuffle;
+
+/**
+ * Sixteen pixels per step, the planes interleaved in registers with
+ * pshufb. The layout only decides which register goes to which offset.
+ */
+struct Ssse3Rows
+{
+    template<class M, class L>
+    __attribute__((target("ssse3")))
+    static void row(const uint8_t * y, const uint8_t * u, const uint8_t * v,
+            unsigned width, uint8_t * out)
+    {
+        const unsigned vec_pixels = width & ~15u;
+        __m128i masks[3][3];
+        unsigned x, k, p;
+
+        for(k = 0; k < 3; k++) {
+            for(p = 0; p < 3; p++) {
+                masks[k][p] = _mm_loadu_si128(
+                        reinterpret_cast<const __m128i *>(pack_shuffle.mask[k][p]));
+            }
+        }
+        for(x = 0; x < vec_pixels; x += 16) {
+            __m128i at[3];
+            yuv16<M>(y + x, u + x / 2, v + x / 2, at[L::R], at[L::G], at[L::B]);
+            for(k = 0; k < 3; k++) {
+                const __m128i packed = _mm_or_si128(_mm_or_si128(
+                            _mm_shuffle_epi8(at[0], masks[k][0]),
+                            _mm_shuffle_epi8(at[1], masks[k][1])),
+                            _mm_shuffle_epi8(at[2], masks[k][2]));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16 * k), packed);
+            }
+            out += 48;
+        }
+        ScalarRows::row<M, L>(y + vec_pixels, u + vec_pixels / 2, v + vec_pixels / 2,
+                width - vec_pixels, out);
+    }
+};
+
+/**
+ * pshufb masks that take pixel n of plane p from byte n of the three
+ * 16 byte blocks k of packed pixels, the inverse of PackShuffle
+ */
+struct UnpackShuffle
+{
+    uint8_t mask[3][3][16];
+
+    UnpackShuffle()
+    {
+        unsigned k, n, p;
+        for(k = 0; k < 3; k++) {
+            for(p = 0; p < 3; p++) {
+                for(n = 0; n < 16; n++) {
+                    const unsigned in = 3 * n + p;
+                    mask[k][p][n] = (in / 16 == k) ? in % 16 : 0x80;
+                }
+            }
+        }
+    }
+};
+
+static const UnpackShuffle unpack_shuffle;
+
+/**
+ * (kr * r + kg * g + kb * b) >> SHIFT, rounded, for eight int16 each
+ */
+template<int SHIFT>
+static inline __m128i dot3(__m128i r, __m128i g, __m128i b, __m128i krg, __m128i kb)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (SHIFT - 1));
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), krg),
+            _mm_madd_epi16(_mm_unpacklo_epi16(b, zero), kb));
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), krg),
+            _mm_madd_epi16(_mm_unpackhi_epi16(b, zero), kb));
+    lo = _mm_srai_epi32(_mm_add_epi32(lo, round), SHIFT);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi, round), SHIFT);
+    return _mm_packs_epi32(lo, hi);
+}
+
+/**
+ * Sixteen packed RGB24 pixels to Y', and to the Cb, Cr of each pair of
+ * them (two rows of pairs when there is a second row). Again 32 bit maths,
+ * so it agrees exactly with ScalarRgb.
+ */
+struct Ssse3Rgb
+{
+    __attribute__((target("ssse3")))
+    static inline void planes(const uint8_t * rgb, __m128i & r, __m128i & g, __m128i & b)
+    {
+        __m128i at[3];
+        unsigned k, p;
+
+        for(p = 0; p < 3; p++) {
+            at[p] = _mm_setzero_si128();
+        }
+        for(k = 0; k < 3; k++) {
+            const __m128i block = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(rgb + 16 * k));
+            for(p = 0; p < 3; p++) {
+                at[p] = _mm_or_si128(at[p], _mm_shuffle_epi8(block, _mm_loadu_si128(
+                        reinterpret_cast<const __m128i *>(unpack_shuffle.mask[k][p]))));
+            }
+        }
+        r = at[0];
+        g = at[1];
+        b = at[2];
+    }
+
+    template<class M>
+    __attribute__((target("ssse3")))
+    static inline __m128i y16(__m128i r, __m128i g, __m128i b)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i krg = pair(M::YR, M::YG);
+        const __m128i kb = pair(M::YB, 0);
+        const __m128i yoff = _mm_set1_epi16(M::Y_OFFSET);
+        const __m128i lo = dot3<FRAC_BITS>(_mm_unpacklo_epi8(r, zero),
+                _mm_unpacklo_epi8(g, zero), _mm_unpacklo_epi8(b, zero), krg, kb);
+        const __m128i hi = dot3<FRAC_BITS>(_mm_unpackhi_epi8(r, zero),
+                _mm_unpackhi_epi8(g, zero), _mm_unpackhi_epi8(b, zero), krg, kb);
+        return _mm_packus_epi16(_mm_add_epi16(lo, yoff), _mm_add_epi16(hi, yoff));
+    }
+
+    /* Eight Cb then eight Cr in the low halves, from int16 sums of 1 << LOG2_N */
+    template<class M, unsigned LOG2_N>
+    __attribute__((target("ssse3")))
+    static inline void uv8(__m128i rs, __m128i gs, __m128i bs, __m128i & u, __m128i & v)
+    {
+        const __m128i c128 = _mm_set1_epi16(128);
+        u = _mm_packus_epi16(_mm_add_epi16(dot3<FRAC_BITS + LOG2_N>(rs, gs, bs,
+                pair(M::UR, M::UG), pair(M::UB, 0)), c128), c128);
+        v = _mm_packus_epi16(_mm_add_epi16(dot3<FRAC_BITS + LOG2_N>(rs, gs, bs,
+                pair(M::VR, M::VG), pair(M::VB, 0)), c128), c128);
+    }
+
+    template<class M>
+    __attribute__((target("ssse3")))
+    static void yuyv_row(const uint8_t * rgb, unsigned width, uint8_t * out)
+    {
+        const __m128i ones = _mm_set1_epi8(1);
+        const unsigned vec_pixels = width & ~15u;
+        unsigned x;
+
+        for(x = 0; x < vec_pixels; x += 16) {
+            __m128i r, g, b, u, v;
+            planes(rgb + 3 * x, r, g, b);
+            const __m128i y = y16<M>(r, g, b);
+            uv8<M, 1>(_mm_maddubs_epi16(r, ones), _mm_maddubs_epi16(g, ones),
+                    _mm_maddubs_epi16(b, ones), u, v);
+            const __m128i uv = _mm_unpacklo_epi8(u, v);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * x),
+                    _mm_unpacklo_epi8(y, uv));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * x + 16),
+                    _mm_unpackhi_epi8(y, uv));
+        }
+        ScalarRgb::yuyv<M>(rgb, vec_pixels, width, out);
+    }
+
+    template<class M>
+    __attribute__((target("ssse3")))
+    static void luma_row(const uint8_t * rgb, unsigned width, uint8_t * out)
+    {
+        const unsigned vec_pixels = width & ~15u;
+        unsigned x;
+
+        for(x = 0; x < vec_pixels; x += 16) {
+            __m128i r, g, b;
+            planes(rgb + 3 * x, r, g, b);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), y16<M>(r, g, b));
+        }
+        ScalarRgb::luma<M>(rgb, vec_pixels, width, out);
+    }
+
+    template<class M>
+    __attribute__((target("ssse3")))
+    static void chroma420_row(const uint8_t * rgb0, const uint8_t * rgb1,
+            unsigned width, uint8_t * u, uint8_t * v)
+    {
+        const __m128i ones = _mm_set1_epi8(1);
+        const unsigned vec_pixels = width & ~15u;
+        unsigned x;
+
+        for(x = 0; x < vec_pixels; x += 16) {
+            __m128i r0, g0, b0, r1, g1, b1, uu, vv;
+            planes(rgb0 + 3 * x, r0, g0, b0);
+            planes(rgb1 + 3 * x, r1, g1, b1);
+            uv8<M, 2>(_mm_add_epi16(_mm_maddubs_epi16(r0, ones), _mm_maddubs_epi16(r1, ones)),
+                    _mm_add_epi16(_mm_maddubs_epi16(g0, ones), _mm_maddubs_epi16(g1, ones)),
+                    _mm_add_epi16(_mm_maddubs_epi16(b0, ones), _mm_maddubs_epi16(b1, ones)),
+                    uu, vv);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(u + x / 2), uu);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(v + x / 2), vv);
+        }
+        ScalarRgb::chroma420<M>(rgb0, rgb1, vec_pixels, width, u, v);
+    }
+};
+
+#endif
+
+/**
+ * Where the planes of a frame are
+ */
+struct PlaneView
+{
+    const uint8_t * base[3];
+    unsigned bpl[3];
+};
+
+/**
+ * Packed YUYV, split a row at a time into the scratch
+ */
+struct YuyvSource
+{
+    static void view(const BaseFormat & fmt, const uint8_t * const * planes,
+            PlaneView & view)
+    {
+        view.base[0] = planes[0];
+        view.bpl[0] = fmt.bytesperline();
+    }
+
+    static void row(const PlaneView & view, unsigned width, unsigned r, bool,
+            uint8_t * scratch, const uint8_t * & y, const uint8_t * & u,
+            const uint8_t * & v)
+    {
+        const uint8_t * src = view.base[0] + r * view.bpl[0];
+        uint8_t * ys = scratch;
+        uint8_t * us = ys + width;
+        uint8_t * vs = us + (width + 1) / 2;
+        unsigned x;
+
+        for(x = 0; x + 1 < width; x += 2) {
+            ys[x] = src[0];
+            us[x / 2] = src[1];
+            ys[x + 1] = src[2];
+            vs[x / 2] = src[3];
+            src += 4;
+        }
+        if(x < width) {
+            ys[x] = src[0];
+            us[x / 2] = src[1];
+            vs[x / 2] = src[3];
+        }
+        y = ys;
+        u = us;
+        v = vs;
+    }
+};
+
+/**
+ * NV12, a luma plane then interleaved Cb,Cr, either after the luma
+ * (SEPARATE false) or in a second buffer (NV12M)
+ */
+template<bool SEPARATE> struct Nv12Source
+{
+    static void view(const BaseFormat & fmt, const uint8_t * const * planes,
+            PlaneView & view)
+    {
+        view.base[0] = planes[0];
+        view.bpl[0] = fmt.bytesperline();
+        view.base[1] = SEPARATE ? planes[1] : planes[0] + fmt.bytesperline() * fmt.height();
+        view.bpl[1] = SEPARATE ? fmt.plane_bytesperline(1) : fmt.bytesperline();
+    }
+
+    static void row(const PlaneView & view, unsigned width, unsigned r, bool first,
+            uint8_t * scratch, const uint8_t * & y, const uint8_t * & u,
+            const uint8_t * & v)
+    {
+        const unsigned half = (width + 1) / 2;
+        uint8_t * us = scratch;
+        uint8_t * vs = us + half;
+        unsigned x;
+
+        /* Chroma rows cover two luma rows, split each once */
+        if(first || !(r & 1)) {
+            const uint8_t * src = view.base[1] + (r / 2) * view.bpl[1];
+            for(x = 0; x < half; x++) {
+                us[x] = src[2 * x];
+                vs[x] = src[2 * x + 1];
+            }
+        }
+        y = view.base[0] + r * view.bpl[0];
+        u = us;
+        v = vs;
+    }
+};
+
+/**
+ * I420, three planes so nothing to split
+ */
+struct Yuv420Source
+{
+    static void view(const BaseFormat & fmt, const uint8_t * const * planes,
+            PlaneView & view)
+    {
+        const unsigned bpl = fmt.bytesperline();
+        view.base[0] = planes[0];
+        view.bpl[0] = bpl;
+        view.base[1] = planes[0] + bpl * fmt.height();
+        view.bpl[1] = bpl / 2;
+        view.base[2] = view.base[1] + view.bpl[1] * ((fmt.height() + 1) / 2);
+        view.bpl[2] = bpl / 2;
+    }
+
+    static void row(const PlaneView & view, unsigned, unsigned r, bool, uint8_t *,
+            const uint8_t * & y, const uint8_t * & u, const uint8_t * & v)
+    {
+        y = view.base[0] + r * view.bpl[0];
+        u = view.base[1] + (r / 2) * view.bpl[1];
+        v = view.base[2] + (r / 2) * view.bpl[2];
+    }
+};
+
+template<class Src, class M, class L, class Rows>
+static void yuv_frame(const BaseFormat & fmt, const uint8_t * const * planes,
+        unsigned first_row, unsigned num_rows, uint8_t * scratch, uint8_t * dst,
+        unsigned dst_stride)
+{
+    const unsigned width = fmt.width();
+    PlaneView view;
+    unsigned r;
+
+    Src::view(fmt, planes, view);
+    for(r = first_row; r < first_row + num_rows; r++) {
+        const uint8_t * y;
+        const uint8_t * u;
+        const uint8_t * v;
+        Src::row(view, width, r, r == first_row, scratch, y, u, v);
+        Rows::template row<M, L>(y, u, v, width, dst + r * dst_stride);
+    }
+}
+
+/**
+ * Grey has no chroma, so no matrix either
+ */
+template<class L>
+static void grey_frame(const BaseFormat & fmt, const uint8_t * const * planes,
+        unsigned first_row, unsigned num_rows, uint8_t *, uint8_t * dst,
+        unsigned dst_stride)
+{
+    unsigned r, x;
+
+    for(r = first_row; r < first_row + num_rows; r++) {
+        const uint8_t * p = planes[0] + r * fmt.bytesperline();
+        uint8_t * q = dst + r * dst_stride;
+        for(x = 0; x < fmt.width(); x++) {
+            q[0] = q[1] = q[2] = p[x];
+            q += 3;
+        }
+    }
+}
+
+template<class L>
+static void rgb_frame(const BaseFormat & fmt, const uint8_t * const * planes,
+        unsigned first_row, unsigned num_rows, uint8_t *, uint8_t * dst,
+        unsigned dst_stride)
+{
+    unsigned r, x;
+
+    for(r = first_row; r < first_row + num_rows; r++) {
+        const uint8_t * p = planes[0] + r * fmt.bytesperline();
+        uint8_t * q = dst + r * dst_stride;
+        if(L::R == 0) {
+            memcpy(q, p, fmt.width() * 3);
+            continue;
+        }
+        for(x = 0; x < fmt.width(); x++) {
+            q[L::R] = p[0];
+            q[L::G] = p[1];
+            q[L::B] = p[2];
+            p += 3;
+            q += 3;
+        }
+    }
+}
+
+static bool use_ssse3()
+{
+#ifdef PIXEL_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#else
+    return false;
+#endif
+}
+
+static bool select_ssse3()
+{
+    const bool ssse3 = use_ssse3();
+    LOG_INFO("Using %s pixel kernels", ssse3 ? "ssse3" : "scalar");
+    return ssse3;
+}
+
+/* Set by pixel_force_isa, otherwise whatever the CPU has is used */
+static int forced_ssse3 = -1;
+
+static bool have_ssse3()
+{
+    static const bool selected = select_ssse3();
+    return forced_ssse3 < 0 ? selected : forced_ssse3;
+}
+
+const char * pixel_kernel_isa()
+{
+    return have_ssse3() ? "ssse3" : "scalar";
+}
+
+/**
+ * Build kernels picked from now on for the named instruction set, so
+ * each can be checked against the scalar references. Not thread safe.
+ *
+ * @param[in] isa "scalar" or "ssse3", NULL for the best the CPU has
+ *
+ * @return false if it is not built in or this CPU cannot run it
+ */
+bool pixel_force_isa(const char * isa)
+{
+    if(!isa) {
+        forced_ssse3 = -1;
+        return true;
+    }
+    if(!strcmp(isa, "scalar")) {
+        forced_ssse3 = 0;
+        return true;
+    }
+    if(!strcmp(isa, "ssse3") && use_ssse3()) {
+        forced_ssse3 = 1;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * The pick_ functions turn the runtime choices into template arguments,
+ * one level each, and return the one instance they lead to
+ */
+
+template<class Src, class M, class L>
+static PixelKernel pick_rows()
+{
+#ifdef PIXEL_X86
+    if(have_ssse3()) {
+        return yuv_frame<Src, M, L, Ssse3Rows>;
+    }
+#endif
+    return yuv_frame<Src, M, L, ScalarRows>;
+}
+
+template<class Src, class M>
+static PixelKernel pick_layout(PixelLayout layout)
+{
+    if(layout == PIXEL_BGR24) {
+        return pick_rows<Src, M, Bgr24Layout>();
+    }
+    return pick_rows<Src, M, Rgb24Layout>();
+}
+
+template<class Src, class Std>
+static PixelKernel pick_range(bool full_range, PixelLayout layout)
+{
+    if(full_range) {
+        return pick_layout<Src, YuvMatrix<Std, true> >(layout);
+    }
+    return pick_layout<Src, YuvMatrix<Std, false> >(layout);
+}
+
+template<class Src>
+static PixelKernel pick_matrix(ColourMatrix matrix, bool full_range, PixelLayout layout)
+{
+    return with_standard(matrix, [=](auto traits) {
+        return pick_range<Src, decltype(traits)>(full_range, layout);
+    });
+}
+
+PixelKernel find_pixel_kernel(uint32_t pixelformat, ColourMatrix matrix,
+        bool full_range, PixelLayout layout)
+{
+    const bool bgr = (layout == PIXEL_BGR24);
+
+    switch(pixelformat) {
+    case V4L2_PIX_FMT_YUYV:
+        return pick_matrix<YuyvSource>(matrix, full_range, layout);
+    case V4L2_PIX_FMT_NV12:
+        return pick_matrix<Nv12Source<false> >(matrix, full_range, layout);
+    case V4L2_PIX_FMT_NV12M:
+        return pick_matrix<Nv12Source<true> >(matrix, full_range, layout);
+    case V4L2_PIX_FMT_YUV420:
+        return pick_matrix<Yuv420Source>(matrix, full_range, layout);
+    case V4L2_PIX_FMT_GREY:
+        return bgr ? grey_frame<Bgr24Layout> : grey_frame<Rgb24Layout>;
+    case V4L2_PIX_FMT_RGB24:
+        return bgr ? rgb_frame<Bgr24Layout> : rgb_frame<Rgb24Layout>;
+    default:
+        break;
+    }
+    return NULL;
+}
+
+/**
+ * As the pick_ functions, for a single row
+ */
+template<class M>
+static PixelRowKernel pick_row(PixelLayout layout)
+{
+    const bool bgr = (layout == PIXEL_BGR24);
+#ifdef PIXEL_X86
+    if(have_ssse3()) {
+        return bgr ? Ssse3Rows::row<M, Bgr24Layout> : Ssse3Rows::row<M, Rgb24Layout>;
+    }
+#endif
+    return bgr ? ScalarRows::row<M, Bgr24Layout> : ScalarRows::row<M, Rgb24Layout>;
+}
+
+template<class Std>
+static PixelRowKernel pick_row_range(bool full_range, PixelLayout layout)
+{
+    if(full_range) {
+        return pick_row<YuvMatrix<Std, true> >(layout);
+    }
+    return pick_row<YuvMatrix<Std, false> >(layout);
+}
+
+PixelRowKernel find_row_kernel(ColourMatrix matrix, bool full_range, PixelLayout layout)
+{
+    return with_standard(matrix, [=](auto traits) {
+        return pick_row_range<decltype(traits)>(full_range, layout);
+    });
+}
+
+template<class Std>
+static YuvCoeffs range_coeffs(bool full_range)
+{
+    return full_range ? YuvMatrix<Std, true>::coeffs() : YuvMatrix<Std, false>::coeffs();
+}
+
+/**
+ * @return The coefficients the kernels for matrix and range are built
+ * with, for code that has to work them out at runtime
+ */
+YuvCoeffs matrix_coeffs(ColourMatrix matrix, bool full_range)
+{
+    return with_standard(matrix, [=](auto traits) {
+        return range_coeffs<decltype(traits)>(full_range);
+    });
+}
+
+template<class M>
+static RgbToYuvKernels pick_rgb()
+{
+#ifdef PIXEL_X86
+    if(have_ssse3()) {
+        return RgbToYuvKernels {Ssse3Rgb::yuyv_row<M>, Ssse3Rgb::luma_row<M>,
+                Ssse3Rgb::chroma420_row<M>};
+    }
+#endif
+    return RgbToYuvKernels {ScalarRgb::yuyv_row<M>, ScalarRgb::luma_row<M>,
+            ScalarRgb::chroma420_row<M>};
+}
+
+template<class Std>
+static RgbToYuvKernels pick_rgb_range(bool full_range)
+{
+    return full_range ? pick_rgb<YuvMatrix<Std, true> >() : pick_rgb<YuvMatrix<Std, false> >();
+}
+
+RgbToYuvKernels find_rgb_kernels(ColourMatrix matrix, bool full_range)
+{
+    return with_standard(matrix, [=](auto traits) {
+        return pick_rgb_range<decltype(traits)>(full_range);
+    });
+}
@@ -0,0 +1,131 @@
+#ifndef _PIXKERNEL_H_
+#define _PIXKERNEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "colour.h"
+
+/**
+ * The traits of one of COLOUR_STANDARDS. Everything else is derived from
+ * its Kr and Kb at compile time.
+ */
+template<ColourMatrix MATRIX> struct Standard;
+
+#define COLOUR_TRAITS(id, kr, kb, name, full_name, enc, other_enc) \
+    template<> struct Standard<COLOUR_##id> \
+    { \
+        static constexpr ColourMatrix ID = COLOUR_##id; \
+        static constexpr double KR = kr; \
+        static constexpr double KB = kb; \
+        static constexpr const char * NAME = name; \
+        static constexpr const char * FULL_NAME = full_name; \
+    };
+COLOUR_STANDARDS(COLOUR_TRAITS)
+#undef COLOUR_TRAITS
+
+/**
+ * Turn a runtime matrix into a compile time one
+ *
+ * @return f(Standard<matrix>()), the first standard if matrix is not one
+ * we know
+ */
+template<class F> auto with_standard(ColourMatrix matrix, F f)
+{
+#define COLOUR_CASE(id, ...) case COLOUR_##id: return f(Standard<COLOUR_##id>());
+    switch(matrix) {
+    COLOUR_STANDARDS(COLOUR_CASE)
+    }
+#undef COLOUR_CASE
+    return f(Standard<static_cast<ColourMatrix>(0)>());
+}
+
+constexpr int fixed_coeff(double val)
+{
+    return static_cast<int>(val * (1 << ColourConverter::FRAC_BITS)
+            + (val < 0 ? -0.5 : 0.5));
+}
+
+/**
+ * Fixed point coefficients for one standard at full (JPEG) or limited
+ * range, as compile time constants
+ */
+template<class Std, bool FULL> struct YuvMatrix
+{
+    static constexpr double KR = Std::KR;
+    static constexpr double KB = Std::KB;
+    static constexpr double KG = 1.0 - KR - KB;
+    static constexpr double Y_SCALE = FULL ? 1.0 : 219.0 / 255.0;
+    static constexpr double C_SCALE = FULL ? 1.0 : 224.0 / 255.0;
+
+    static constexpr int Y_OFFSET = FULL ? 0 : 16;
+    static constexpr int CY = fixed_coeff(1.0 / Y_SCALE);
+    static constexpr int CRV = fixed_coeff(2.0 * (1.0 - KR) / C_SCALE);
+    static constexpr int CGU = fixed_coeff(2.0 * (1.0 - KB) * KB / KG / C_SCALE);
+    static constexpr int CGV = fixed_coeff(2.0 * (1.0 - KR) * KR / KG / C_SCALE);
+    static constexpr int CBU = fixed_coeff(2.0 * (1.0 - KB) / C_SCALE);
+
+    static constexpr int YR = fixed_coeff(KR * Y_SCALE);
+    static constexpr int YG = fixed_coeff(KG * Y_SCALE);
+    static constexpr int YB = fixed_coeff(KB * Y_SCALE);
+    static constexpr int UR = fixed_coeff(-0.5 * KR / (1.0 - KB) * C_SCALE);
+    static constexpr int UG = fixed_coeff(-0.5 * KG / (1.0 - KB) * C_SCALE);
+    static constexpr int UB = fixed_coeff(0.5 * C_SCALE);
+    static constexpr int VR = fixed_coeff(0.5 * C_SCALE);
+    static constexpr int VG = fixed_coeff(-0.5 * KG / (1.0 - KR) * C_SCALE);
+    static constexpr int VB = fixed_coeff(-0.5 * KB / (1.0 - KR) * C_SCALE);
+
+    static constexpr YuvCoeffs coeffs()
+    {
+        return YuvCoeffs {
+            Y_OFFSET, CY, CRV, CGU, CGV, CBU,
+            YR, YG, YB, UR, UG, UB, VR, VG, VB
+        };
+    }
+};
+
+/**
+ * Where each component goes in a packed output pixel
+ */
+struct Rgb24Layout
+{
+    static const unsigned R = 0;
+    static const unsigned G = 1;
+    static const unsigned B = 2;
+};
+
+struct Bgr24Layout
+{
+    static const unsigned R = 2;
+    static const unsigned G = 1;
+    static const unsigned B = 0;
+};
+
+/**
+ * @return The frame kernel for pixelformat, matrix, range and layout, or
+ * NULL if pixelformat cannot be converted
+ */
+extern PixelKernel find_pixel_kernel(uint32_t pixelformat, ColourMatrix matrix,
+        bool full_range, PixelLayout layout);
+
+/**
+ * @return The kernel that converts one row of planar 4:2:x samples
+ */
+extern PixelRowKernel find_row_kernel(ColourMatrix matrix, bool full_range,
+        PixelLayout layout);
+
+extern YuvCoeffs matrix_coeffs(ColourMatrix matrix, bool full_range);
+
+/**
+ * @return The kernels that convert rows of RGB24 to Y'CbCr
+ */
+extern RgbToYuvKernels find_rgb_kernels(ColourMatrix matrix, bool full_range);
+
+/**
+ * @return Name of the instruction set the kernels use, for the logs
+ */
+extern const char * pixel_kernel_isa();
+
+extern bool pixel_force_isa(const char * isa);
+
+#endif
@@ -0,0 +1,190 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "format.h"
+#include "pnm.h"
+#include "thumbnail.h"
+#include "tiles.h"
+
+/**
+ * Write all of iov, carrying on after short writes
+ *
+ * @return true on success
+ */
+static bool writev_all(int fd, struct iovec * iov, unsigned iovcnt)
+{
+    while(iovcnt) {
+        const int batch = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t done = writev(fd, iov, batch);
+        if(done < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            LOG_ERRNO_AS_ERROR("writev");
+            return false;
+        }
+        while(iovcnt && (static_cast<size_t>(done) >= iov->iov_len)) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(done) {
+            iov->iov_base = static_cast<uint8_t *>(iov->iov_base) + done;
+            iov->iov_len -= done;
+        }
+    }
+    return true;
+}
+
+/**
+ * Create path and write iov to it in one go, the entries may be changed
+ *
+ * @return true on success
+ */
+bool write_file(const std::string & path, struct iovec * iov, unsigned iovcnt)
+{
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        LOG_ERRNO_AS_ERROR("open");
+        return false;
+    }
+    const bool ok = writev_all(fd, iov, iovcnt);
+    if(::close(fd) < 0) {
+        LOG_ERRNO_AS_ERROR("close");
+        return false;
+    }
+    return ok;
+}
+
+/**
+ * Write header then height rows of row_bytes each, stride apart
+ */
+bool PnmWriter::write_rows(const std::string & path, const std::string & header,
+        const uint8_t * rows, unsigned row_bytes, unsigned stride, unsigned height)
+{
+    unsigned r;
+
+    m_iov.resize(height + 1);
+    m_iov[0].iov_base = const_cast<char *>(header.data());
+    m_iov[0].iov_len = header.size();
+    if(stride == row_bytes) {
+        /* No padding, so the whole image is one piece */
+        m_iov[1].iov_base = const_cast<uint8_t *>(rows);
+        m_iov[1].iov_len = static_cast<size_t>(row_bytes) * height;
+        m_iov.resize(2);
+    }
+    else {
+        for(r = 0; r < height; r++) {
+            m_iov[r + 1].iov_base = const_cast<uint8_t *>(rows + static_cast<size_t>(r) * stride);
+            m_iov[r + 1].iov_len = row_bytes;
+        }
+    }
+
+    return write_file(path, &m_iov[0], m_iov.size());
+}
+
+/**
+ * The header, with the source pixel format as a comment
+ */
+static std::string pnm_header(char type, const BaseFormat & fmt)
+{
+    char buf[80];
+
+    snprintf(buf, sizeof(buf), "P%c\n#FOURCC %s\n%u %u\n255\n", type,
+            fmt.pix_fmt_str().c_str(), fmt.width(), fmt.height());
+    return buf;
+}
+
+/**
+ * Write the luma of a frame as a PGM
+ *
+ * @param[in] path File to write
+ * @param[in] fmt The frame's format
+ * @param[in] planes Start of each plane, only the first is used
+ * @param[in] bytes Bytes in the first plane
+ *
+ * @return false if there is no luma without decoding, the frame is short
+ * or the file could not be written
+ */
+bool PnmWriter::write_pgm(const std::string & path, const BaseFormat & fmt,
+        const uint8_t * const * planes, unsigned bytes)
+{
+    const unsigned width = fmt.width();
+    const unsigned height = fmt.height();
+
+    if(!width || !height) {
+        return false;
+    }
+    if(fmt.planar_luma()) {
+        if(static_cast<uint64_t>(fmt.bytesperline()) * (height - 1) + width > bytes) {
+            return false;
+        }
+        return write_rows(path, pnm_header('5', fmt), planes[0], width,
+                fmt.bytesperline(), height);
+    }
+    m_scratch.resize(static_cast<size_t>(width) * height);
+    if(m_scratch.empty() || !fmt.extract_luma(planes[0], bytes, &m_scratch[0], width)) {
+        return false;
+    }
+    return write_rows(path, pnm_header('5', fmt), &m_scratch[0], width, width, height);
+}
+
+/**
+ * Write a frame as a PPM
+ *
+ * @param[in] conv Converts it to RGB, normally the source's converter()
+ * @param[in] tiles Convert bands of it across this pool, NULL for one thread
+ *
+ * @return false if the format cannot be converted, the frame is short or
+ * the file could not be written
+ */
+bool PnmWriter::write_ppm(const std::string & path, const BaseFormat & fmt,
+        const uint8_t * const * planes, unsigned bytes, const ColourConverter & conv,
+        TileScheduler * tiles)
+{
+    const unsigned row_bytes = fmt.width() * 3;
+    const unsigned height = fmt.height();
+
+    if(!row_bytes || !height) {
+        return false;
+    }
+    if(fmt.pix_fmt() == V4L2_PIX_FMT_RGB24) {
+        if(bytes < fmt.plane_size(0)) {
+            return false;
+        }
+        return write_rows(path, pnm_header('6', fmt), planes[0], row_bytes,
+                fmt.bytesperline(), height);
+    }
+    m_scratch.resize(static_cast<size_t>(row_bytes) * height);
+    if(m_scratch.empty()) {
+        return false;
+    }
+    if(tiles ? !tiles->convert(conv, fmt, planes, bytes, &m_scratch[0], row_bytes)
+            : !conv.convert(fmt, planes, bytes, &m_scratch[0], row_bytes)) {
+        return false;
+    }
+    return write_rows(path, pnm_header('6', fmt), &m_scratch[0], row_bytes, row_bytes,
+            height);
+}
+
+/**
+ * Write a thumbnail as a PGM or a PPM, whichever it was made as
+ *
+ * @return false if it is empty or the file could not be written
+ */
+bool PnmWriter::write_thumbnail(const std::string & path, const Thumbnail & thumb)
+{
+    char header[80];
+
+    if(thumb.data.empty()) {
+        return false;
+    }
+    snprintf(header, sizeof(header), "P%c\n%u %u\n255\n", thumb.rgb ? '6' : '5',
+            thumb.width, thumb.height);
+    return write_rows(path, header, &thumb.data[0], thumb.width * (thumb.rgb ? 3 : 1),
+            thumb.stride, thumb.height);
+}
@@ -0,0 +1,44 @@
+#ifndef _PNM_H_
+#define _PNM_H_
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "colour.h"
+
+class BaseFormat;
+class TileScheduler;
+struct Thumbnail;
+
+bool write_file(const std::string & path, struct iovec * iov, unsigned iovcnt);
+
+/**
+ * Writes frames as binary PGM (grey) or PPM (RGB) files. The header and
+ * the rows go out in one writev, straight from the capture buffer when
+ * the frame already has rows of plain luma or RGB24. Other layouts are
+ * unpacked once into a scratch buffer kept between frames, so there is
+ * at most one copy and one pass over the frame.
+ */
+class PnmWriter
+{
+private:
+    std::vector<uint8_t> m_scratch;
+    std::vector<struct iovec> m_iov;
+
+    bool write_rows(const std::string & path, const std::string & header,
+            const uint8_t * rows, unsigned row_bytes, unsigned stride, unsigned height);
+
+public:
+    bool write_pgm(const std::string & path, const BaseFormat & fmt,
+            const uint8_t * const * planes, unsigned bytes);
+    bool write_ppm(const std::string & path, const BaseFormat & fmt,
+            const uint8_t * const * planes, unsigned bytes,
+            const ColourConverter & conv, TileScheduler * tiles = NULL);
+    bool write_thumbnail(const std::string & path, const Thumbnail & thumb);
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "logging.h"
+#include "profile.h"
+
+#define PROFILE_MAGIC "# snappy camera profile 1"
+
+/**
+ * Where the profile lives, $XDG_CACHE_HOME/snappy or ~/.cache/snappy
+ *
+ * @return the path, empty if there is nowhere to cache
+ */
+std::string CameraProfile::path() const
+{
+    std::string dir;
+    const char * xdg = getenv("XDG_CACHE_HOME");
+    const char * home = getenv("HOME");
+    char ver[16];
+    size_t i;
+
+    if(xdg && xdg[0]) {
+        dir = xdg;
+    }
+    else if(home && home[0]) {
+        dir = home;
+        dir += "/.cache";
+    }
+    else {
+        return dir;
+    }
+
+    std::string key = driver + "-" + bus_info;
+    for(i = 0; i < key.size(); i++) {
+        const char c = key[i];
+        if(!(((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z'))
+                || ((c >= '0') && (c <= '9')) || (c == '-') || (c == '.'))) {
+            key[i] = '_';
+        }
+    }
+    snprintf(ver, sizeof(ver), "-%x", version);
+    return dir + "/snappy/" + key + ver + ".profile";
+}
+
+/**
+ * Load the profile matching driver, bus_info and version
+ *
+ * @return true if there was one
+ */
+bool CameraProfile::load()
+{
+    const std::string fname = path();
+    char line[256];
+
+    if(fname.empty()) {
+        return false;
+    }
+    FILE * f = fopen(fname.c_str(), "r");
+    if(!f) {
+        return false;
+    }
+    if(!fgets(line, sizeof(line), f) || strncmp(line, PROFILE_MAGIC, strlen(PROFILE_MAGIC)) != 0) {
+        LOG_WARN("Ignoring unrecognised profile %s", fname.c_str());
+        fclose(f);
+        return false;
+    }
+    controls.clear();
+    while(fgets(line, sizeof(line), f)) {
+        char * val = strchr(line, '=');
+        if(!val) {
+            continue;
+        }
+        *val++ = '\0';
+        if(strcmp(line, "target") == 0) {
+            target = val;
+            target.erase(target.find_last_not_of("\n") + 1);
+        }
+        else if(strcmp(line, "input") == 0) {
+            input = strtol(val, NULL, 10);
+        }
+        else if(strcmp(line, "buf_type") == 0) {
+            buf_type = strtol(val, NULL, 10);
+        }
+        else if(strcmp(line, "pixelformat") == 0) {
+            pixelformat = strtoul(val, NULL, 16);
+        }
+        else if(strcmp(line, "size") == 0) {
+            sscanf(val, "%ux%u", &width, &height);
+        }
+        else if(strcmp(line, "bytesperline") == 0) {
+            bytesperline = strtoul(val, NULL, 10);
+        }
+        else if(strcmp(line, "interval") == 0) {
+            sscanf(val, "%u/%u", &interval_num, &interval_den);
+        }
+        else if(strcmp(line, "control") == 0) {
+            ControlDesc ctrl;
+            if(sscanf(val, "%x %u %i %i %i %i", &ctrl.id, &ctrl.type, &ctrl.minimum,
+                        &ctrl.maximum, &ctrl.step, &ctrl.default_value) == 6) {
+                controls.push_back(ctrl);
+            }
+        }
+    }
+    fclose(f);
+    LOG_INFO("Loaded profile %s", fname.c_str());
+    return (input >= 0) && pixelformat && buf_type;
+}
+
+/**
+ * Write the profile, via a temporary file so a reader never sees half of it
+ *
+ * @return true on success
+ */
+bool CameraProfile::save() const
+{
+    const std::string fname = path();
+    std::vector<ControlDesc>::const_iterator p;
+
+    if(fname.empty()) {
+        return false;
+    }
+    /* Make the directories, ok if they exist */
+    const size_t dir_end = fname.rfind('/');
+    const std::string dir = fname.substr(0, dir_end);
+    mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+
+    const std::string tmp = fname + ".tmp";
+    FILE * f = fopen(tmp.c_str(), "w");
+    if(!f) {
+        LOG_ERRNO_AS_ERROR("Can't write %s", tmp.c_str());
+        return false;
+    }
+    fprintf(f, "%s\n", PROFILE_MAGIC);
+    fprintf(f, "target=%s\n", target.c_str());
+    fprintf(f, "input=%i\n", input);
+    fprintf(f, "buf_type=%i\n", buf_type);
+    fprintf(f, "pixelformat=%x\n", pixelformat);
+    fprintf(f, "size=%ux%u\n", width, height);
+    fprintf(f, "bytesperline=%u\n", bytesperline);
+    fprintf(f, "interval=%u/%u\n", interval_num, interval_den);
+    for(p = controls.begin(); p != controls.end(); p++) {
+        fprintf(f, "control=%x %u %i %i %i %i\n", p->id, p->type,
+                p->minimum, p->maximum, p->step, p->default_value);
+    }
+    if(fclose(f) != 0 || rename(tmp.c_str(), fname.c_str()) != 0) {
+        LOG_ERRNO_AS_ERROR("Can't save %s", fname.c_str());
+        return false;
+    }
+    LOG_INFO("Saved profile %s", fname.c_str());
+    return true;
+}
+
+const ControlDesc * CameraProfile::find_control(uint32_t id) const
+{
+    std::vector<ControlDesc>::const_iterator p;
+    for(p = controls.begin(); p != controls.end(); p++) {
+        if(p->id == id) {
+            return &(*p);
+        }
+    }
+    return NULL;
+}
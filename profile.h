@@ -0,0 +1,54 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * What VIDIOC_QUERYCTRL told us about a control
+ */
+struct ControlDesc
+{
+    uint32_t id;
+    uint32_t type;
+    int32_t minimum;
+    int32_t maximum;
+    int32_t step;
+    int32_t default_value;
+};
+
+/**
+ * Everything we learnt about a camera by enumerating it, saved so that the
+ * next start can skip the enumeration. Keyed by driver, bus_info and
+ * driver version so a different device, port or kernel gets a fresh one.
+ */
+struct CameraProfile
+{
+    std::string driver;
+    std::string bus_info;
+    uint32_t version;
+
+    std::string target;         /* What the format was chosen for */
+    int input;
+    int buf_type;
+    uint32_t pixelformat;
+    unsigned width;
+    unsigned height;
+    unsigned bytesperline;
+    uint32_t interval_num;
+    uint32_t interval_den;
+    std::vector<ControlDesc> controls;
+
+    CameraProfile() : version(0), input(-1), buf_type(0), pixelformat(0),
+        width(0), height(0), bytesperline(0), interval_num(0), interval_den(0) {};
+
+    std::string path() const;
+    bool load();
+    bool save() const;
+    const ControlDesc * find_control(uint32_t id) const;
+};
+
+#endif
@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#include "logging.h"
+#include "capture.h"
+#include "reactor.h"
+
+#define MAX_EVENTS (16)
+
+/**
+ * Construct the reactor, creating the epoll set
+ */
+CaptureReactor::CaptureReactor()
+    : m_epfd(-1), m_running(false)
+{
+    const int fd = epoll_create1(EPOLL_CLOEXEC);
+    if(fd < 0) {
+        LOG_ERRNO_AS_ERROR("epoll_create1");
+        throw Camera_error();
+    }
+    m_epfd = fd;
+}
+
+CaptureReactor::~CaptureReactor()
+{
+    std::vector<Entry *>::iterator p;
+    for(p = m_entries.begin(); p != m_entries.end(); p++) {
+        delete *p;
+    }
+    ::close(m_epfd);
+}
+
+/**
+ * Add a camera to the reactor, the camera should already have its buffers
+ * queued and capture enabled.
+ *
+ * @param[in] cam The camera
+ * @param[in] handler Who to give the frames to
+ *
+ * @return true on success
+ */
+bool CaptureReactor::add_camera(FrameSource * cam, FrameHandler * handler)
+{
+    if(!cam->is_nonblocking() && !cam->set_nonblocking(true)) {
+        return false;
+    }
+    Entry * entry = new Entry;
+    entry->cam = cam;
+    entry->handler = handler;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = entry;
+    if(epoll_ctl(m_epfd, EPOLL_CTL_ADD, cam->fd(), &ev) == -1) {
+        LOG_ERRNO_AS_ERROR("EPOLL_CTL_ADD");
+        delete entry;
+        return false;
+    }
+    m_entries.push_back(entry);
+    return true;
+}
+
+/**
+ * Stop serving a camera. Safe to call from within a FrameHandler.
+ *
+ * @param[in] cam The camera
+ */
+void CaptureReactor::remove_camera(FrameSource * cam)
+{
+    std::vector<Entry *>::iterator p;
+    for(p = m_entries.begin(); p != m_entries.end(); p++) {
+        if((*p)->cam == cam) {
+            drop(*p);
+        }
+    }
+}
+
+/**
+ * Take an entry out of the epoll set, the entry itself is freed at the end
+ * of run_once as other events for it may still be pending.
+ */
+void CaptureReactor::drop(Entry * entry)
+{
+    if(entry->cam) {
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL, entry->cam->fd(), NULL);
+        entry->cam = NULL;
+    }
+}
+
+/**
+ * Dequeue every ready buffer from a camera and pass each to its handler
+ *
+ * @return false if the camera failed and was dropped
+ */
+bool CaptureReactor::service(Entry * entry)
+{
+    FrameSource * cam = entry->cam;
+    try {
+        while(entry->cam) {
+            FrameMeta meta;
+            const int n = cam->wait_buffer_ready(meta);
+            if(n < 0) {
+                break;
+            }
+            if(entry->handler->on_frame(*cam, meta)) {
+                cam->queue_buffer(n);
+            }
+        }
+    }
+    catch(Camera_error &) {
+        LOG_ERROR("Camera on fd %i failed, dropping it", cam->fd());
+        drop(entry);
+        entry->handler->on_camera_dropped(*cam);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Wait for at most timeout_ms for any camera to be ready and service all
+ * that are.
+ *
+ * @param[in] timeout_ms As for epoll_wait, -1 is forever
+ *
+ * @return Number of cameras serviced, or -1 on error
+ */
+int CaptureReactor::run_once(int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int i;
+
+    const int num = epoll_wait(m_epfd, events, MAX_EVENTS, timeout_ms);
+    if(num < 0) {
+        if(errno == EINTR) {
+            return 0;
+        }
+        LOG_ERRNO_AS_ERROR("epoll_wait");
+        return -1;
+    }
+    for(i = 0; i < num; i++) {
+        Entry * entry = reinterpret_cast<Entry *>(events[i].data.ptr);
+        if(!entry->cam) {
+            continue;
+        }
+        /* EPOLLERR is also how V4L2 says nothing is queued or streaming is
+         * off, let the DQBUF decide if the camera has really failed */
+        service(entry);
+    }
+
+    /* Now safe to free anything dropped */
+    std::vector<Entry *>::iterator p = m_entries.begin();
+    while(p != m_entries.end()) {
+        if(!(*p)->cam) {
+            delete *p;
+            p = m_entries.erase(p);
+        }
+        else {
+            p++;
+        }
+    }
+    return num;
+}
+
+/**
+ * Run until stop() is called (typically from a FrameHandler) or there are
+ * no cameras left
+ */
+void CaptureReactor::run()
+{
+    m_running = true;
+    while(m_running && !m_entries.empty()) {
+        if(run_once(-1) < 0) {
+            break;
+        }
+    }
+    m_running = false;
+}
@@ -0,0 +1,72 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <vector>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "frame.h"
+
+class FrameSource;
+
+/**
+ * Anything that wants frames from the CaptureReactor implements this
+ */
+class FrameHandler
+{
+public:
+    virtual ~FrameHandler() {};
+
+    /**
+     * Called for each dequeued buffer.
+     *
+     * @return true if the reactor should requeue the buffer, false if the
+     * handler has kept it and will call FrameSource::queue_buffer itself. A
+     * handler must not keep every buffer, the device would then have
+     * nothing to fill.
+     */
+    virtual bool on_frame(FrameSource & cam, const FrameMeta & meta) = 0;
+
+    /**
+     * Called when a camera fails and the reactor stops serving it. Buffers
+     * the handler kept from it should be forgotten, not requeued.
+     */
+    virtual void on_camera_dropped(FrameSource &) {};
+};
+
+/**
+ * Serve several cameras from one thread. Each camera is put in non-blocking
+ * mode and its fd added to an epoll set, whichever device becomes ready is
+ * drained of buffers which are passed to that camera's handler.
+ */
+class CaptureReactor
+{
+private:
+    struct Entry
+    {
+        FrameSource * cam;
+        FrameHandler * handler;
+    };
+
+    int m_epfd;
+    std::vector<Entry *> m_entries;
+    bool m_running;
+
+    bool service(Entry * entry);
+    void drop(Entry * entry);
+
+public:
+    CaptureReactor();
+    ~CaptureReactor();
+
+    bool add_camera(FrameSource * cam, FrameHandler * handler);
+    void remove_camera(FrameSource * cam);
+    unsigned num_cameras() const {return m_entries.size();};
+
+    int run_once(int timeout_ms);
+    void run();
+    void stop() {m_running = false;};
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "recorder.h"
+
+static size_t round_up(size_t val, size_t align)
+{
+    return ((val + align - 1) / align) * align;
+}
+
+Recorder::Recorder()
+    : m_fd(-1), m_direct(false), m_use_ring(false), m_chunks(0),
+      m_chunk_size(0), m_num_chunks(0), m_busy(0), m_cur(0), m_fill(0),
+      m_in_flight(0), m_file_offset(0), m_length(0), m_failed(false),
+      m_frames(0), m_dropped(0), m_errors(0)
+{
+}
+
+Recorder::~Recorder()
+{
+    close();
+}
+
+/**
+ * Create the recording
+ *
+ * @param[in] path File to write, truncated if it exists
+ * @param[in] chunk_size Bytes per disk write, rounded up to a page
+ * @param[in] num_chunks Number of staging chunks, which bounds both the
+ *            memory used and the writes in flight
+ *
+ * @return true on success
+ */
+bool Recorder::open(const std::string & path, size_t chunk_size, unsigned num_chunks)
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    void * mem;
+    unsigned i;
+
+    close();
+    if(num_chunks < 2) {
+        num_chunks = 2;
+    }
+    m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+    m_direct = true;
+    if((m_fd < 0) && (errno == EINVAL)) {
+        /* tmpfs and some FUSE filesystems refuse O_DIRECT */
+        LOG_WARN("%s does not support O_DIRECT, using the page cache", path.c_str());
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        m_direct = false;
+    }
+    if(m_fd < 0) {
+        LOG_ERRNO_AS_ERROR("Open %s failed", path.c_str());
+        return false;
+    }
+
+    m_chunk_size = round_up(chunk_size, page_size);
+    m_num_chunks = num_chunks;
+    if(posix_memalign(&mem, page_size, m_chunk_size * m_num_chunks) != 0) {
+        LOG_ERROR("Failed to allocate %u x %zu recording chunks", m_num_chunks,
+                m_chunk_size);
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    m_chunks = reinterpret_cast<uint8_t *>(mem);
+    m_busy = new bool[m_num_chunks];
+    for(i = 0; i < m_num_chunks; i++) {
+        m_busy[i] = false;
+    }
+    m_cur = 0;
+    m_fill = 0;
+    m_in_flight = 0;
+    m_file_offset = 0;
+    m_length = 0;
+    m_failed = false;
+    m_frames = 0;
+    m_dropped = 0;
+    m_errors = 0;
+
+    m_use_ring = m_ring.setup(m_num_chunks);
+    if(!m_use_ring) {
+        LOG_WARN("No io_uring, recording with blocking writes");
+    }
+    LOG_INFO("Recording to %s, %u x %zu byte chunks%s", path.c_str(),
+            m_num_chunks, m_chunk_size, m_direct ? ", O_DIRECT" : "");
+    return true;
+}
+
+/**
+ * How much of a frame of needed bytes could be staged now, stops counting
+ * once there is enough or at the first chunk still being written
+ */
+size_t Recorder::space(size_t needed) const
+{
+    size_t avail = m_chunk_size - m_fill;
+    unsigned n = m_cur;
+
+    if(m_busy[m_cur]) {
+        /* Last frame ended on a chunk boundary and we have wrapped round */
+        return 0;
+    }
+    while(avail < needed) {
+        n = (n + 1) % m_num_chunks;
+        if((n == m_cur) || m_busy[n]) {
+            break;
+        }
+        avail += m_chunk_size;
+    }
+    return avail;
+}
+
+/**
+ * Start writing chunk n to the next offset in the file. The offset only
+ * moves on once the write is under way, if the ring will not take it the
+ * same offset is written directly instead, so a failure never leaves a
+ * hole that later chunks land after. The ring's entry is taken back
+ * first so the chunk is only ever written one way.
+ *
+ * @param[in] n The chunk
+ * @param[in] len Bytes to write, a multiple of the page size for O_DIRECT
+ *
+ * @return false on failure, the recording then takes no more frames
+ */
+bool Recorder::write_chunk(unsigned n, size_t len)
+{
+    const uint64_t offset = m_file_offset;
+    const uint8_t * buf = chunk(n);
+
+    if(m_failed) {
+        return false;
+    }
+    if(m_use_ring) {
+        const uint64_t user_data = (static_cast<uint64_t>(len) << 32) | n;
+        if(m_ring.prep_write(m_fd, buf, len, offset, user_data)) {
+            if(m_ring.submit() > 0) {
+                m_busy[n] = true;
+                m_in_flight++;
+                m_file_offset += len;
+                return true;
+            }
+            /* Never both ways, or a later submit writes the reused chunk */
+            m_ring.unprep();
+        }
+        LOG_WARN("io_uring submit failed, writing chunk %u directly", n);
+        m_errors++;
+    }
+
+    size_t done = 0;
+    while(done < len) {
+        const ssize_t ret = pwrite(m_fd, buf + done, len - done, offset + done);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            LOG_ERRNO_AS_ERROR("Recording write failed");
+            m_errors++;
+            m_failed = true;
+            return false;
+        }
+        done += ret;
+    }
+    m_file_offset += len;
+    return true;
+}
+
+/**
+ * A write through the ring finished
+ */
+void Recorder::completed(unsigned n, int res, size_t len)
+{
+    m_busy[n] = false;
+    m_in_flight--;
+    if(res < 0) {
+        errno = -res;
+        LOG_ERRNO_AS_ERROR("Recording write failed");
+        m_errors++;
+        m_failed = true;
+    }
+    else if(static_cast<size_t>(res) < len) {
+        LOG_ERROR("Short recording write, %i of %zu bytes", res, len);
+        m_errors++;
+        m_failed = true;
+    }
+}
+
+/**
+ * Collect finished writes
+ *
+ * @param[in] wait Block until none are in flight
+ */
+void Recorder::reap(bool wait)
+{
+    uint64_t user_data;
+    int res;
+
+    while(m_in_flight) {
+        while(m_ring.peek(user_data, res)) {
+            completed(user_data & 0xFFFFFFFF, res, user_data >> 32);
+        }
+        if(!wait || !m_in_flight) {
+            break;
+        }
+        if(m_ring.submit(1) < 0) {
+            break;
+        }
+    }
+}
+
+/**
+ * Append a frame to the recording. Never waits for the disk when io_uring
+ * is available.
+ *
+ * @param[in] data The frame
+ * @param[in] len Its length in bytes
+ *
+ * @return true if the frame was taken, false if it was dropped because too
+ * many writes are still in flight
+ */
+bool Recorder::write_frame(const uint8_t * data, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = const_cast<uint8_t *>(data);
+    iov.iov_len = len;
+    return write_frame(&iov, 1);
+}
+
+/**
+ * As above for a frame gathered from several pieces, which are all taken
+ * or all dropped together
+ *
+ * @param[in] iov The pieces, a NULL iov_base stands for iov_len zero bytes
+ * @param[in] iovcnt Number of pieces
+ */
+bool Recorder::write_frame(const struct iovec * iov, unsigned iovcnt)
+{
+    size_t total = 0;
+    unsigned i;
+
+    if(m_fd < 0) {
+        return false;
+    }
+    for(i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    reap(false);
+    if(m_failed || (space(total) < total)) {
+        m_dropped++;
+        return false;
+    }
+    for(i = 0; i < iovcnt; i++) {
+        const uint8_t * data = reinterpret_cast<const uint8_t *>(iov[i].iov_base);
+        size_t len = iov[i].iov_len;
+
+        while(len > 0) {
+            size_t copy = m_chunk_size - m_fill;
+            if(copy > len) {
+                copy = len;
+            }
+            if(data) {
+                memcpy(chunk(m_cur) + m_fill, data, copy);
+                data += copy;
+            }
+            else {
+                memset(chunk(m_cur) + m_fill, 0, copy);
+            }
+            m_fill += copy;
+            m_length += copy;
+            len -= copy;
+            if(m_fill == m_chunk_size) {
+                write_chunk(m_cur, m_chunk_size);
+                m_cur = (m_cur + 1) % m_num_chunks;
+                m_fill = 0;
+            }
+        }
+    }
+    m_frames++;
+    return true;
+}
+
+/**
+ * Flush the partial chunk, wait for everything in flight and trim the
+ * padding O_DIRECT forced onto the last write
+ *
+ * @return true if every write succeeded
+ */
+bool Recorder::close()
+{
+    if(m_fd < 0) {
+        return true;
+    }
+    reap(true);
+    if(m_fill > 0) {
+        const size_t len = round_up(m_fill, sysconf(_SC_PAGESIZE));
+        memset(chunk(m_cur) + m_fill, 0, len - m_fill);
+        write_chunk(m_cur, len);
+        reap(true);
+        m_fill = 0;
+    }
+    /* After a failed write only what came before it is in the file */
+    if(ftruncate(m_fd, m_file_offset < m_length ? m_file_offset : m_length) == -1) {
+        LOG_ERRNO_AS_ERROR("Failed to trim recording");
+        m_errors++;
+    }
+    ::close(m_fd);
+    m_fd = -1;
+    m_ring.release();
+    free(m_chunks);
+    m_chunks = 0;
+    delete [] m_busy;
+    m_busy = 0;
+    log();
+    return m_errors == 0;
+}
+
+void Recorder::log() const
+{
+    LOG_INFO("Recorded %llu frames, %llu bytes, dropped %llu, write errors %llu",
+            (unsigned long long) m_frames, (unsigned long long) m_length,
+            (unsigned long long) m_dropped, (unsigned long long) m_errors);
+}
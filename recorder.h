@@ -0,0 +1,72 @@
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+/**
+ * Streams raw frames to a file, back to back so ReplaySource can play it.
+ * Frames are copied into a small ring of page aligned chunks; each full
+ * chunk is written asynchronously through io_uring to a file opened with
+ * O_DIRECT, so the capture thread never waits on the page cache or
+ * writeback. At most num_chunks writes are in flight, a frame that does
+ * not fit into the free chunks is dropped and counted rather than waiting
+ * for the disk. Without io_uring it falls back to pwrite, which blocks.
+ */
+class Recorder
+{
+private:
+    int m_fd;
+    bool m_direct;
+    IoUring m_ring;
+    bool m_use_ring;
+
+    uint8_t * m_chunks;
+    size_t m_chunk_size;
+    unsigned m_num_chunks;
+    bool * m_busy;
+    unsigned m_cur;
+    size_t m_fill;
+    unsigned m_in_flight;
+    uint64_t m_file_offset;
+    uint64_t m_length;
+    bool m_failed;              /* A write failed, nothing more is taken */
+
+    uint64_t m_frames;
+    uint64_t m_dropped;
+    uint64_t m_errors;
+
+    uint8_t * chunk(unsigned n) const {return m_chunks + n * m_chunk_size;};
+    size_t space(size_t needed) const;
+    bool write_chunk(unsigned n, size_t len);
+    void completed(unsigned n, int res, size_t len);
+    void reap(bool wait);
+
+public:
+    static const size_t CHUNK_SIZE = 1024 * 1024;
+    static const unsigned NUM_CHUNKS = 16;
+
+    Recorder();
+    ~Recorder();
+
+    bool open(const std::string & path, size_t chunk_size = CHUNK_SIZE,
+            unsigned num_chunks = NUM_CHUNKS);
+    bool write_frame(const uint8_t * data, size_t len);
+    bool write_frame(const struct iovec * iov, unsigned iovcnt);
+    bool close();
+
+    uint64_t frames() const {return m_frames;};
+    uint64_t dropped() const {return m_dropped;};
+    uint64_t errors() const {return m_errors;};
+    uint64_t length() const {return m_length;};
+    unsigned in_flight() const {return m_in_flight;};
+    void log() const;
+};
+
+#endif
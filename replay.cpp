@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "logging.h"
+#include "debug.h"
+#include "capture.h"
+#include "replay.h"
+
+/**
+ * Open the recording
+ *
+ * @param[in] path File of raw frames
+ * @param[in] pixelformat Their V4L2_PIX_FMT_xxx
+ * @param[in] width Frame width
+ * @param[in] height Frame height
+ * @param[in] fps Playback rate, 0 for as fast as possible
+ * @param[in] loop Go back to the start at the end of the file
+ */
+ReplaySource::ReplaySource(const std::string & path, uint32_t pixelformat,
+        unsigned width, unsigned height, unsigned fps, bool loop)
+    : m_file_fd(-1), m_timer_fd(-1), m_map(0), m_map_size(0), m_frame_size(0),
+      m_num_frames(0), m_fps(fps), m_loop(loop), m_nonblocking(false),
+      m_streaming(false), m_eof(false), m_formatObj(0), m_num_bufs(0),
+      m_sequence(0), m_next_frame(0), m_brightness(0)
+{
+    struct stat st;
+
+    m_formatObj = create_format_obj(pixelformat);
+    if(!m_formatObj) {
+        LOG_ERROR("No support for replaying %s", pixelfmt2str(pixelformat));
+        throw Camera_error();
+    }
+    m_formatObj->init(width, height, m_formatObj->default_bytesperline(width));
+    m_converter.set_for_format(*m_formatObj);
+    m_frame_size = m_formatObj->image_size();
+    if(m_formatObj->compressed() || !m_frame_size) {
+        LOG_ERROR("Cannot replay %s, frames are not a fixed size",
+                m_formatObj->pix_fmt_str().c_str());
+        delete m_formatObj;
+        m_formatObj = 0;
+        throw Camera_error();
+    }
+
+    m_file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(m_file_fd < 0) {
+        LOG_ERRNO_AS_ERROR("Open %s failed", path.c_str());
+        throw Camera_error();
+    }
+    if((fstat(m_file_fd, &st) == -1) || (st.st_size < static_cast<off_t>(m_frame_size))) {
+        LOG_ERROR("%s is smaller than one frame", path.c_str());
+        close();
+        throw Camera_error();
+    }
+    m_num_frames = st.st_size / m_frame_size;
+    m_map_size = st.st_size;
+    /* Private and writable so a consumer scribbling on a frame is harmless */
+    void * map = mmap(NULL, m_map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+            m_file_fd, 0);
+    if(map == MAP_FAILED) {
+        LOG_ERRNO_AS_ERROR("Failed to map %s", path.c_str());
+        close();
+        throw Camera_error();
+    }
+    m_map = reinterpret_cast<uint8_t *>(map);
+    madvise(m_map, m_map_size, MADV_SEQUENTIAL);
+
+    m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if(m_timer_fd < 0) {
+        LOG_ERRNO_AS_ERROR("timerfd_create");
+        close();
+        throw Camera_error();
+    }
+    LOG_INFO("Replaying %u frames of %s %ux%u from %s", m_num_frames,
+            m_formatObj->pix_fmt_str().c_str(), width, height, path.c_str());
+}
+
+ReplaySource::~ReplaySource()
+{
+    close();
+    delete m_formatObj;
+}
+
+void ReplaySource::close()
+{
+    if(m_map) {
+        munmap(m_map, m_map_size);
+        m_map = 0;
+    }
+    if(m_timer_fd >= 0) {
+        ::close(m_timer_fd);
+        m_timer_fd = -1;
+    }
+    if(m_file_fd >= 0) {
+        ::close(m_file_fd);
+        m_file_fd = -1;
+    }
+}
+
+/**
+ * There is no real brightness to change, just remember it so the
+ * auto-brightness loop behaves as it would with a camera
+ */
+bool ReplaySource::set_control_value(int id, int32_t value)
+{
+    if(id != V4L2_CID_BRIGHTNESS) {
+        return false;
+    }
+    m_brightness = value;
+    return true;
+}
+
+int32_t ReplaySource::get_control_value(int id)
+{
+    return id == V4L2_CID_BRIGHTNESS ? m_brightness : -1;
+}
+
+bool ReplaySource::set_nonblocking(bool enable)
+{
+    int flags = fcntl(m_timer_fd, F_GETFL);
+    if(flags == -1) {
+        return false;
+    }
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if(fcntl(m_timer_fd, F_SETFL, flags) == -1) {
+        return false;
+    }
+    m_nonblocking = enable;
+    return true;
+}
+
+int ReplaySource::request_buffers(int max_num)
+{
+    if(max_num > VIDEO_MAX_FRAME) {
+        max_num = VIDEO_MAX_FRAME;
+    }
+    m_num_bufs = max_num;
+    memset(m_bufs, 0, sizeof(m_bufs));
+    m_queue.clear();
+    return m_num_bufs;
+}
+
+void ReplaySource::queue_buffer(int i)
+{
+    if((i < 0) || (i >= m_num_bufs)) {
+        LOG_ERROR("Bad buffer %i", i);
+        throw Camera_error();
+    }
+    m_queue.push_back(i);
+}
+
+void ReplaySource::enable_capture()
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if(m_fps) {
+        its.it_interval.tv_nsec = 1000000000L / m_fps;
+        if(m_fps == 1) {
+            its.it_interval.tv_sec = 1;
+            its.it_interval.tv_nsec = 0;
+        }
+    }
+    else {
+        /* As fast as possible, fire (almost) continuously */
+        its.it_interval.tv_nsec = 1;
+    }
+    its.it_value = its.it_interval;
+    if(timerfd_settime(m_timer_fd, 0, &its, NULL) == -1) {
+        LOG_ERRNO_AS_ERROR("timerfd_settime");
+        throw Camera_error();
+    }
+    m_stats.reset();
+    m_sequence = 0;
+    m_next_frame = 0;
+    m_eof = false;
+    m_streaming = true;
+}
+
+void ReplaySource::disable_capture()
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(m_timer_fd, 0, &its, NULL);
+    m_queue.clear();
+    m_streaming = false;
+}
+
+/**
+ * Wait for the timer, honouring non-blocking mode
+ *
+ * @return Frames that have become due, 0 if none yet
+ */
+uint64_t ReplaySource::frames_due()
+{
+    uint64_t expirations = 0;
+    const ssize_t len = read(m_timer_fd, &expirations, sizeof(expirations));
+    if(len != sizeof(expirations)) {
+        if((errno == EAGAIN) || (errno == EINTR)) {
+            return 0;
+        }
+        LOG_ERRNO_AS_ERROR("timerfd read");
+        throw Camera_error();
+    }
+    return expirations;
+}
+
+/**
+ * Dequeue the next frame, same semantics as Camera::wait_buffer_ready
+ *
+ * @return the buffer index, or -1 if in non-blocking mode and no frame is
+ * due yet, or the recording has ended
+ */
+int ReplaySource::wait_buffer_ready(FrameMeta & meta)
+{
+    if(!m_streaming || m_eof) {
+        return -1;
+    }
+    uint64_t due;
+    do {
+        due = frames_due();
+    } while(!due && !m_nonblocking);
+    if(!due) {
+        return -1;
+    }
+
+    /* Frames due beyond the first, or with nothing queued, are dropped */
+    if(m_fps) {
+        m_sequence += due - 1;
+        m_next_frame += due - 1;
+    }
+    if(m_queue.empty()) {
+        m_sequence++;
+        m_next_frame++;
+        return -1;
+    }
+    if(m_next_frame >= m_num_frames) {
+        if(!m_loop) {
+            LOG_INFO("End of recording");
+            m_eof = true;
+            disable_capture();
+            return -1;
+        }
+        m_next_frame %= m_num_frames;
+    }
+
+    const int n = m_queue.front();
+    m_queue.pop_front();
+    m_bufs[n] = m_map + static_cast<size_t>(m_next_frame) * m_frame_size;
+
+    meta.index = n;
+    meta.sequence = m_sequence++;
+    meta.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | V4L2_BUF_FLAG_DONE;
+    meta.field = V4L2_FIELD_NONE;
+    meta.bytesused = m_frame_size;
+    meta.dequeued_ns = monotonic_ns();
+    meta.timestamp_ns = meta.dequeued_ns;
+    meta.monotonic = true;
+    m_next_frame++;
+    m_stats.record(meta);
+    return n;
+}
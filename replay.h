@@ -0,0 +1,73 @@
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <deque>
+#include <string>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/videodev2.h>
+
+#include "framesource.h"
+
+/**
+ * Plays back a file of raw frames, back to back in one format, as if it
+ * were a camera. The file is mmap'ed and dequeued buffers point straight
+ * into it. Frames are released at the requested rate from a timerfd (or
+ * as fast as they are asked for with fps of 0); if no buffer is queued
+ * when a frame is due it is dropped, as a driver would.
+ */
+class ReplaySource : public FrameSource
+{
+private:
+    int m_file_fd;
+    int m_timer_fd;
+    uint8_t * m_map;
+    size_t m_map_size;
+    size_t m_frame_size;
+    unsigned m_num_frames;
+    unsigned m_fps;
+    bool m_loop;
+    bool m_nonblocking;
+    bool m_streaming;
+    bool m_eof;
+
+    BaseFormat * m_formatObj;
+    uint8_t * m_bufs[VIDEO_MAX_FRAME];
+    int m_num_bufs;
+    std::deque<int> m_queue;
+    uint32_t m_sequence;
+    unsigned m_next_frame;
+    int32_t m_brightness;
+    FrameStats m_stats;
+
+    uint64_t frames_due();
+
+public:
+    ReplaySource(const std::string & path, uint32_t pixelformat, unsigned width,
+            unsigned height, unsigned fps, bool loop = false);
+    virtual ~ReplaySource();
+
+    virtual bool set_control_value(int id, int32_t value);
+    virtual int32_t get_control_value(int id);
+
+    virtual int fd() const {return m_timer_fd;};
+    virtual bool set_nonblocking(bool enable);
+    virtual bool is_nonblocking() const {return m_nonblocking;};
+    virtual BaseFormat * fmt() const {return m_formatObj;};
+
+    virtual int request_buffers(int max_num);
+    virtual void queue_buffer(int i);
+    virtual int wait_buffer_ready(FrameMeta & meta);
+    virtual uint8_t * buf_start(int n, unsigned plane = 0) const {(void) plane; return m_bufs[n];};
+    virtual void enable_capture();
+    virtual void disable_capture();
+    virtual void close();
+    virtual const FrameStats & stats() const {return m_stats;};
+    virtual uint32_t brightness_control() const {return V4L2_CID_BRIGHTNESS;};
+
+    unsigned num_frames() const {return m_num_frames;};
+    bool eof() const {return m_eof;};
+};
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <atomic>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CACHE_LINE (64)
+
+/**
+ * Bounded lock-free ring, safe for any number of producers and consumers
+ * (D. Vyukov's MPMC queue). Each cell carries a sequence number which says
+ * whose turn it is, so a push or pop is one CAS on the position plus a
+ * release store on the cell. push/pop never block, they fail when the ring
+ * is full/empty and leave waiting to the caller.
+ */
+template <typename T>
+class Ring
+{
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    Cell * m_cells;
+    size_t m_mask;
+    alignas(CACHE_LINE) std::atomic<size_t> m_head;
+    alignas(CACHE_LINE) std::atomic<size_t> m_tail;
+
+    Ring(const Ring &);
+    Ring & operator=(const Ring &);
+
+public:
+    /**
+     * @param[in] capacity Rounded up to a power of two
+     */
+    Ring(size_t capacity) : m_head(0), m_tail(0)
+    {
+        size_t size = 2;
+        size_t i;
+        while(size < capacity) {
+            size <<= 1;
+        }
+        m_cells = new Cell[size];
+        m_mask = size - 1;
+        for(i = 0; i < size; i++) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~Ring() {delete [] m_cells;};
+
+    size_t capacity() const {return m_mask + 1;};
+
+    bool push(const T & item)
+    {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        for(;;) {
+            Cell & cell = m_cells[pos & m_mask];
+            const size_t seq = cell.seq.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if(diff == 0) {
+                if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = item;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0) {
+                return false;   /* Full */
+            }
+            else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T & item)
+    {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        for(;;) {
+            Cell & cell = m_cells[pos & m_mask];
+            const size_t seq = cell.seq.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if(diff == 0) {
+                if(m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    item = cell.data;
+                    cell.seq.store(pos + m_mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0) {
+                return false;   /* Empty */
+            }
+            else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include <string.h>
+#include <time.h>
+
+#include "logging.h"
+#include "stats.h"
+
+/**
+ * @return CLOCK_MONOTONIC in ns, the clock V4L2 timestamps are normally on
+ */
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Values below SUB_COUNT get a bucket each, above that each power of two
+ * is split into HALF_COUNT linear buckets.
+ */
+unsigned Histogram::bucket_of(uint64_t value)
+{
+    if(value < SUB_COUNT) {
+        return static_cast<unsigned>(value);
+    }
+    const unsigned shift = (63 - __builtin_clzll(value)) - (SUB_BITS - 1);
+    const unsigned top = static_cast<unsigned>(value >> shift);
+    return SUB_COUNT + (shift - 1) * HALF_COUNT + (top - HALF_COUNT);
+}
+
+/**
+ * @return The largest value that lands in bucket idx
+ */
+uint64_t Histogram::bucket_upper(unsigned idx)
+{
+    if(idx < SUB_COUNT) {
+        return idx;
+    }
+    const unsigned shift = (idx - SUB_COUNT) / HALF_COUNT + 1;
+    const uint64_t top = (idx - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+    return ((top + 1) << shift) - 1;
+}
+
+void Histogram::reset()
+{
+    memset(m_counts, 0, sizeof(m_counts));
+    m_total = 0;
+    m_sum = 0;
+    m_min = UINT64_MAX;
+    m_max = 0;
+}
+
+void Histogram::record(uint64_t value)
+{
+    m_counts[bucket_of(value)]++;
+    m_total++;
+    m_sum += value;
+    if(value < m_min) {
+        m_min = value;
+    }
+    if(value > m_max) {
+        m_max = value;
+    }
+}
+
+void Histogram::merge(const Histogram & other)
+{
+    unsigned i;
+    for(i = 0; i < NUM_BUCKETS; i++) {
+        m_counts[i] += other.m_counts[i];
+    }
+    m_total += other.m_total;
+    m_sum += other.m_sum;
+    if(other.m_min < m_min) {
+        m_min = other.m_min;
+    }
+    if(other.m_max > m_max) {
+        m_max = other.m_max;
+    }
+}
+
+/**
+ * @param[in] pc Percentile wanted, 0 to 100
+ *
+ * @return The value at that percentile (to within the bucket resolution)
+ */
+uint64_t Histogram::percentile(double pc) const
+{
+    unsigned i;
+    uint64_t seen = 0;
+
+    if(m_total == 0) {
+        return 0;
+    }
+    uint64_t wanted = static_cast<uint64_t>((pc / 100.0) * m_total + 0.5);
+    if(wanted < 1) {
+        wanted = 1;
+    }
+    for(i = 0; i < NUM_BUCKETS; i++) {
+        seen += m_counts[i];
+        if(seen >= wanted) {
+            const uint64_t upper = bucket_upper(i);
+            return upper < m_max ? upper : m_max;
+        }
+    }
+    return m_max;
+}
+
+/**
+ * Log a summary, values are taken to be ns and shown in us
+ */
+void Histogram::log(const char * name) const
+{
+    LOG_INFO("%s (us): n=%llu, min=%llu, p50=%llu, p99=%llu, max=%llu, mean=%llu",
+            name, (unsigned long long) m_total,
+            (unsigned long long) min() / 1000,
+            (unsigned long long) percentile(50.0) / 1000,
+            (unsigned long long) percentile(99.0) / 1000,
+            (unsigned long long) max() / 1000,
+            (unsigned long long) mean() / 1000);
+}
+
+void FrameStats::reset()
+{
+    m_frames = 0;
+    m_dropped = 0;
+    m_last_sequence = 0;
+    m_last_timestamp = 0;
+    m_last_interval = 0;
+    m_interval.reset();
+    m_jitter.reset();
+    m_latency.reset();
+}
+
+/**
+ * Account for a dequeued frame
+ */
+void FrameStats::record(const FrameMeta & meta)
+{
+    if(m_frames > 0) {
+        /* Unsigned arithmetic copes with the counter wrapping, a big jump
+         * means it went backwards (driver restarted) rather than a drop */
+        const uint32_t gap = meta.sequence - m_last_sequence;
+        if((gap > 1) && (gap < 0x80000000U)) {
+            m_dropped += gap - 1;
+        }
+        if(meta.timestamp_ns > m_last_timestamp) {
+            const uint64_t interval = meta.timestamp_ns - m_last_timestamp;
+            m_interval.record(interval);
+            if(m_last_interval) {
+                m_jitter.record(interval > m_last_interval
+                        ? interval - m_last_interval : m_last_interval - interval);
+            }
+            m_last_interval = interval;
+        }
+    }
+    if(meta.monotonic && (meta.dequeued_ns >= meta.timestamp_ns)) {
+        m_latency.record(meta.dequeued_ns - meta.timestamp_ns);
+    }
+    m_last_sequence = meta.sequence;
+    m_last_timestamp = meta.timestamp_ns;
+    m_frames++;
+}
+
+void FrameStats::log() const
+{
+    LOG_INFO("Frames %llu, dropped %llu", (unsigned long long) m_frames,
+            (unsigned long long) m_dropped);
+    m_interval.log("Interval");
+    m_jitter.log("Jitter");
+    m_latency.log("Latency");
+}
@@ -0,0 +1,83 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "frame.h"
+
+extern uint64_t monotonic_ns();
+
+/**
+ * A histogram in the style of HdrHistogram, buckets are linear within each
+ * power of two so the relative error is bounded (~3%) over the whole 64 bit
+ * range without having to pick a range up front.
+ */
+class Histogram
+{
+public:
+    static const unsigned SUB_BITS = 5;
+    static const unsigned SUB_COUNT = 1 << SUB_BITS;
+    static const unsigned HALF_COUNT = SUB_COUNT / 2;
+    static const unsigned NUM_BUCKETS = SUB_COUNT + (64 - SUB_BITS) * HALF_COUNT;
+
+private:
+    uint32_t m_counts[NUM_BUCKETS];
+    uint64_t m_total;
+    uint64_t m_sum;
+    uint64_t m_min;
+    uint64_t m_max;
+
+    static unsigned bucket_of(uint64_t value);
+    static uint64_t bucket_upper(unsigned idx);
+
+public:
+    Histogram() {reset();};
+
+    void reset();
+    void record(uint64_t value);
+    void merge(const Histogram & other);
+
+    uint64_t count() const {return m_total;};
+    uint64_t min() const {return m_total ? m_min : 0;};
+    uint64_t max() const {return m_max;};
+    uint64_t mean() const {return m_total ? m_sum / m_total : 0;};
+    uint64_t percentile(double pc) const;
+    void log(const char * name) const;
+};
+
+/**
+ * Running statistics over the frames dequeued from a camera
+ *
+ * interval: time between consecutive driver timestamps
+ * jitter: change in interval from one frame to the next
+ * latency: driver timestamp to userspace dequeue (monotonic timestamps only)
+ */
+class FrameStats
+{
+private:
+    uint64_t m_frames;
+    uint64_t m_dropped;
+    uint32_t m_last_sequence;
+    uint64_t m_last_timestamp;
+    uint64_t m_last_interval;
+
+    Histogram m_interval;
+    Histogram m_jitter;
+    Histogram m_latency;
+
+public:
+    FrameStats() {reset();};
+
+    void reset();
+    void record(const FrameMeta & meta);
+    void log() const;
+
+    uint64_t frames() const {return m_frames;};
+    uint64_t dropped() const {return m_dropped;};
+    const Histogram & interval() const {return m_interval;};
+    const Histogram & jitter() const {return m_jitter;};
+    const Histogram & latency() const {return m_latency;};
+};
+
+#endif
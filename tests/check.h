@@ -0,0 +1,91 @@
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Just enough to write the equivalence checks run by "make check". Each
+ * test program counts its failures and exits non-zero if there were any.
+ */
+static unsigned check_failures = 0;
+
+#define CHECK(cond, ...) \
+    do { \
+        if(!(cond)) { \
+            if(check_failures++ < 20) { \
+                fprintf(stderr, "%s:%i: %s: ", __FILE__, __LINE__, #cond); \
+                fprintf(stderr, __VA_ARGS__); \
+                fputc('\n', stderr); \
+            } \
+        } \
+    } while(0)
+
+static inline int check_done(const char * name)
+{
+    if(check_failures) {
+        fprintf(stderr, "%s: %u failures\n", name, check_failures);
+        return EXIT_FAILURE;
+    }
+    printf("%s: ok\n", name);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Repeatable pseudo random bytes, with runs of 0 and 255 so the min and
+ * max are hit
+ */
+static inline void check_fill(uint8_t * p, size_t len, uint32_t seed)
+{
+    uint32_t x = seed * 2654435761u + 1;
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        p[i] = ((x >> 8) & 0x3F) == 0 ? 0 : ((x >> 8) & 0x3F) == 1 ? 255 : x >> 24;
+    }
+}
+
+/**
+ * A buffer of len bytes that ends right against an unmapped page, so a
+ * kernel that reads past the end of a short frame faults
+ */
+class GuardedBuffer
+{
+private:
+    uint8_t * m_map;
+    size_t m_map_size;
+    uint8_t * m_data;
+
+    GuardedBuffer(const GuardedBuffer &);
+    GuardedBuffer & operator=(const GuardedBuffer &);
+
+public:
+    GuardedBuffer(size_t len)
+    {
+        const size_t page = sysconf(_SC_PAGESIZE);
+        const size_t data_pages = (len + page - 1) / page;
+
+        m_map_size = (data_pages + 1) * page;
+        m_map = static_cast<uint8_t *>(mmap(NULL, m_map_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if(m_map == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        mprotect(m_map + data_pages * page, page, PROT_NONE);
+        m_data = m_map + data_pages * page - len;
+    };
+    ~GuardedBuffer() {munmap(m_map, m_map_size);};
+
+    uint8_t * data() const {return m_data;};
+};
+
+#endif
@@ -0,0 +1,126 @@
+#include <string>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include "archive.h"
+#include "format.h"
+#include "check.h"
+
+static const unsigned WIDTH = 64, HEIGHT = 48, FRAMES = 3;
+
+/**
+ * Write FRAMES grey frames, frame n filled with n + 1
+ */
+static bool write_archive(const std::string & path)
+{
+    BaseFormat * fmt = create_format_obj(V4L2_PIX_FMT_GREY);
+    ArchiveWriter writer;
+    FrameMeta meta;
+    unsigned n;
+    bool ok;
+
+    fmt->init(WIDTH, HEIGHT, WIDTH);
+    std::string frame(fmt->image_size(), 0);
+    ok = writer.open(path, *fmt);
+    memset(&meta, 0, sizeof(meta));
+    for(n = 0; ok && (n < FRAMES); n++) {
+        memset(&frame[0], n + 1, frame.size());
+        meta.sequence = n;
+        meta.timestamp_ns = 1000 * (n + 1);
+        ok = writer.append(reinterpret_cast<const uint8_t *>(frame.data()), frame.size(), meta);
+    }
+    ok = writer.close() && ok;
+    delete fmt;
+    return ok;
+}
+
+/**
+ * Every frame the reader gives must lie inside the file and hold what was
+ * written
+ */
+static void check_frames(const std::string & path, unsigned want, const char * what)
+{
+    ArchiveReader reader;
+    unsigned n, i;
+    bool same = true;
+
+    CHECK(reader.open(path) && (reader.num_frames() == want), "%s: %llu frames", what,
+            (unsigned long long) reader.num_frames());
+    for(n = 0; n < reader.num_frames(); n++) {
+        const uint8_t * frame = reader.frame(n);
+        const uint8_t * plane = reader.frame_plane(n, 0);
+        same = same && frame && (frame == plane) && (reader.entry(n).size == WIDTH * HEIGHT);
+        for(i = 0; same && (i < WIDTH * HEIGHT); i++) {
+            same = frame[i] == n + 1;
+        }
+    }
+    CHECK(same, "%s: frame contents", what);
+}
+
+/**
+ * Overwrite part of the file, or cut it short
+ */
+static void damage(const std::string & path, off_t offset, const void * data, size_t len)
+{
+    const int fd = open(path.c_str(), O_WRONLY);
+
+    CHECK((fd >= 0) && (pwrite(fd, data, len, offset) == (ssize_t) len), "damage %s",
+            path.c_str());
+    if(fd >= 0) {
+        close(fd);
+    }
+}
+
+static void check_archive(const std::string & dir)
+{
+    const std::string path = dir + "/t.arc";
+    ArchiveHeader header;
+    ArchiveIndex entry;
+    uint64_t index_offset;
+
+    CHECK(write_archive(path), "write");
+    check_frames(path, FRAMES, "closed");
+    {
+        ArchiveReader reader;
+        if(!reader.open(path)) {
+            return;
+        }
+        header = reader.header();
+        entry = reader.entry(FRAMES - 1);
+    }
+    index_offset = header.index_offset;
+
+    /* An index entry past the end of the file, the records are still good */
+    ArchiveIndex bad = entry;
+    bad.offset = index_offset + FRAMES * sizeof(ArchiveIndex) - 16;
+    damage(path, index_offset + (FRAMES - 1) * sizeof(ArchiveIndex), &bad, sizeof(bad));
+    check_frames(path, FRAMES, "entry past the end");
+
+    bad = entry;
+    bad.offset = 0;
+    damage(path, index_offset + (FRAMES - 1) * sizeof(ArchiveIndex), &bad, sizeof(bad));
+    check_frames(path, FRAMES, "entry over the header");
+
+    /* The last frame cut short, with the index after it gone */
+    CHECK(truncate(path.c_str(), entry.offset + entry.size - 1) == 0, "truncate");
+    check_frames(path, FRAMES - 1, "truncated");
+    unlink(path.c_str());
+}
+
+int main()
+{
+    char dir[] = "/tmp/test_archive.XXXXXX";
+
+    if(!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    check_archive(dir);
+    rmdir(dir);
+    return check_done("test_archive");
+}
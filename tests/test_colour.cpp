@@ -0,0 +1,274 @@
+#include <vector>
+
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "colour.h"
+#include "format.h"
+#include "pixkernel.h"
+#include "check.h"
+
+static const char * const ISAS[] = {"scalar", "ssse3"};
+static const ColourMatrix MATRICES[] = {COLOUR_BT601, COLOUR_BT709, COLOUR_BT2020};
+static const unsigned WIDTHS[] = {1, 2, 3, 15, 16, 17, 31, 32, 33, 47, 48, 49, 100, 641};
+static const uint32_t FRAME_FORMATS[] = {
+    V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_NV12M, V4L2_PIX_FMT_YUV420
+};
+static const unsigned FRAME_WIDTHS[] = {2, 16, 18, 32, 34, 48, 50, 100, 640};
+static const unsigned BAND_ROWS = 3;
+
+/**
+ * yuv_row must give exactly what yuv_row_scalar does, with R and B the
+ * other way round for BGR24
+ */
+static void check_yuv_rows(const char * isa, ColourMatrix matrix, bool full,
+        PixelLayout layout)
+{
+    const ColourConverter conv(matrix, full, layout);
+    unsigned w, x;
+
+    for(w = 0; w < sizeof(WIDTHS) / sizeof(WIDTHS[0]); w++) {
+        const unsigned width = WIDTHS[w];
+        const unsigned half = (width + 1) / 2;
+        GuardedBuffer y(width), u(half), v(half), out(3 * width);
+        std::vector<uint8_t> want(3 * width);
+
+        check_fill(y.data(), width, width);
+        check_fill(u.data(), half, width + 1);
+        check_fill(v.data(), half, width + 2);
+        yuv_row_scalar(conv.coeffs(), y.data(), u.data(), v.data(), width, &want[0]);
+        if(layout == PIXEL_BGR24) {
+            for(x = 0; x < width; x++) {
+                const uint8_t r = want[3 * x];
+                want[3 * x] = want[3 * x + 2];
+                want[3 * x + 2] = r;
+            }
+        }
+        conv.yuv_row(y.data(), u.data(), v.data(), width, out.data());
+        CHECK(!memcmp(out.data(), &want[0], 3 * width), "%s %s %s width %u", isa,
+                conv.name(), layout == PIXEL_BGR24 ? "BGR24" : "RGB24", width);
+    }
+}
+
+/**
+ * Pack planes of Y', Cb and Cr into a frame of fmt, the chroma having a
+ * row per frame row for YUYV and per two for the rest
+ */
+static void pack_frame(const BaseFormat & fmt, const uint8_t * y, const uint8_t * u,
+        const uint8_t * v, uint8_t * const * planes)
+{
+    const unsigned width = fmt.width();
+    const unsigned half = width / 2;
+    const unsigned bpl = fmt.bytesperline();
+    unsigned r, x;
+
+    for(r = 0; r < fmt.height(); r++) {
+        const uint8_t * ys = y + r * width;
+        const uint8_t * us = u + r * half;
+        const uint8_t * vs = v + r * half;
+        uint8_t * row = planes[0] + r * bpl;
+        uint8_t * c;
+
+        switch(fmt.pix_fmt()) {
+        case V4L2_PIX_FMT_YUYV:
+            for(x = 0; x < half; x++) {
+                row[4 * x] = ys[2 * x];
+                row[4 * x + 1] = us[x];
+                row[4 * x + 2] = ys[2 * x + 1];
+                row[4 * x + 3] = vs[x];
+            }
+            continue;
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV12M:
+            memcpy(row, ys, width);
+            if(r & 1) {
+                continue;
+            }
+            c = (fmt.num_planes() > 1) ? planes[1] + (r / 2) * fmt.plane_bytesperline(1)
+                    : planes[0] + bpl * fmt.height() + (r / 2) * bpl;
+            for(x = 0; x < half; x++) {
+                c[2 * x] = us[x];
+                c[2 * x + 1] = vs[x];
+            }
+            continue;
+        case V4L2_PIX_FMT_YUV420:
+            memcpy(row, ys, width);
+            if(r & 1) {
+                continue;
+            }
+            c = planes[0] + bpl * fmt.height() + (r / 2) * (bpl / 2);
+            memcpy(c, us, half);
+            memcpy(c + (bpl / 2) * ((fmt.height() + 1) / 2), vs, half);
+            continue;
+        }
+    }
+}
+
+/**
+ * convert() and convert_rows() in bands must give what yuv_row_scalar does
+ * for each row, with the frame ending at an unmapped page
+ */
+static void check_frames(const char * isa, ColourMatrix matrix, bool full)
+{
+    const ColourConverter conv(matrix, full);
+    unsigned f, w, height, r;
+
+    for(f = 0; f < sizeof(FRAME_FORMATS) / sizeof(FRAME_FORMATS[0]); f++) {
+        for(w = 0; w < sizeof(FRAME_WIDTHS) / sizeof(FRAME_WIDTHS[0]); w++) {
+            for(height = 1; height <= 8; height++) {
+                const uint32_t fourcc = FRAME_FORMATS[f];
+                const unsigned width = FRAME_WIDTHS[w];
+                const unsigned half = width / 2;
+                const bool yuyv = (fourcc == V4L2_PIX_FMT_YUYV);
+                const unsigned bpl = (yuyv ? 2 * width : width) + 6;
+                const unsigned c_bpl = width + 10;
+                const unsigned out_stride = 3 * width + 7;
+                BaseFormat * fmt = create_format_obj(fourcc);
+                std::vector<uint8_t> y(width * height), u(half * height), v(half * height);
+                std::vector<uint8_t> want(out_stride * height), got(want.size());
+                std::vector<uint8_t> bands(want.size());
+
+                if(fourcc == V4L2_PIX_FMT_NV12M) {
+                    const unsigned bpls[2] = {bpl, c_bpl};
+                    const unsigned sizes[2] = {bpl * height, c_bpl * ((height + 1) / 2)};
+                    fmt->init_planes(width, height, 2, bpls, sizes);
+                }
+                else {
+                    fmt->init(width, height, bpl);
+                }
+                GuardedBuffer luma(fmt->plane_size(0));
+                GuardedBuffer chroma(fmt->num_planes() > 1 ? fmt->plane_size(1) : 1);
+                uint8_t * const planes[2] = {luma.data(), chroma.data()};
+
+                check_fill(&y[0], y.size(), width + height);
+                check_fill(&u[0], u.size(), width + height + 1);
+                check_fill(&v[0], v.size(), width + height + 2);
+                for(r = 0; r < height; r++) {
+                    const unsigned c = yuyv ? r : r & ~1u;
+                    memcpy(&u[r * half], &u[c * half], half);
+                    memcpy(&v[r * half], &v[c * half], half);
+                    yuv_row_scalar(conv.coeffs(), &y[r * width], &u[r * half],
+                            &v[r * half], width, &want[r * out_stride]);
+                }
+                pack_frame(*fmt, &y[0], &u[0], &v[0], planes);
+
+                CHECK(conv.convert(*fmt, planes, fmt->plane_size(0), &got[0], out_stride),
+                        "%s %s convert failed", isa, fmt->pix_fmt_str().c_str());
+                /* Last band first, so none can lean on what the one before left */
+                for(r = (height - 1) / BAND_ROWS * BAND_ROWS; ; r -= BAND_ROWS) {
+                    conv.convert_rows(*fmt, planes, fmt->plane_size(0), r, BAND_ROWS,
+                            &bands[0], out_stride);
+                    if(!r) {
+                        break;
+                    }
+                }
+                for(r = 0; r < height; r++) {
+                    CHECK(!memcmp(&got[r * out_stride], &want[r * out_stride], 3 * width)
+                            && !memcmp(&bands[r * out_stride], &want[r * out_stride],
+                            3 * width), "%s %s %s %ux%u row %u", isa, conv.name(),
+                            fmt->pix_fmt_str().c_str(), width, height, r);
+                }
+                delete fmt;
+            }
+        }
+    }
+}
+
+/**
+ * rgb24_to_yuyv and rgb24_to_yuv420 must give exactly what the scalar
+ * references do, with the source rows padded and the frame ending at an
+ * unmapped page
+ */
+static void check_rgb_frames(const char * isa, ColourMatrix matrix, bool full)
+{
+    const ColourConverter conv(matrix, full);
+    const YuvCoeffs & c = conv.coeffs();
+    unsigned w, height, row;
+
+    for(w = 0; w < sizeof(WIDTHS) / sizeof(WIDTHS[0]); w++) {
+        for(height = 1; height <= 4; height++) {
+            const unsigned width = WIDTHS[w];
+            const unsigned stride = 3 * width + 5;
+            const size_t bytes = static_cast<size_t>(stride) * (height - 1) + 3 * width;
+            const unsigned yuyv_stride = 2 * ((width + 1) & ~1u);
+            const unsigned c_width = (width + 1) / 2;
+            const unsigned c_height = (height + 1) / 2;
+            const size_t i420_bytes = static_cast<size_t>(width) * height
+                    + 2 * c_width * c_height;
+            GuardedBuffer src(bytes);
+            std::vector<uint8_t> yuyv(yuyv_stride * height), want_yuyv(yuyv.size());
+            std::vector<uint8_t> i420(i420_bytes), want_i420(i420_bytes);
+
+            check_fill(src.data(), bytes, width * height);
+            for(row = 0; row < height; row++) {
+                rgb_yuyv_row_scalar(c, src.data() + row * stride, width,
+                        &want_yuyv[row * yuyv_stride]);
+                rgb_luma_row_scalar(c, src.data() + row * stride, width,
+                        &want_i420[row * width]);
+            }
+            for(row = 0; row < c_height; row++) {
+                const uint8_t * p0 = src.data() + 2 * row * stride;
+                const uint8_t * p1 = (2 * row + 1 < height) ? p0 + stride : p0;
+                rgb_chroma420_row_scalar(c, p0, p1, width,
+                        &want_i420[width * height + row * c_width],
+                        &want_i420[width * height + (c_height + row) * c_width]);
+            }
+
+            conv.rgb24_to_yuyv(src.data(), width, height, stride, &yuyv[0], yuyv_stride);
+            conv.rgb24_to_yuv420(src.data(), width, height, stride, &i420[0]);
+            CHECK(yuyv == want_yuyv, "%s %s YUYV %ux%u", isa, conv.name(), width, height);
+            CHECK(i420 == want_i420, "%s %s YUV420 %ux%u", isa, conv.name(), width, height);
+        }
+    }
+}
+
+/**
+ * Grey levels go through RGB to Y'CbCr and back within a step or two
+ */
+static void check_round_trip(ColourMatrix matrix, bool full)
+{
+    const ColourConverter conv(matrix, full);
+    uint8_t rgb[256 * 3], yuyv[256 * 2], back[256 * 3];
+    uint8_t y[256], u[128], v[128];
+    unsigned x;
+
+    for(x = 0; x < 256; x++) {
+        rgb[3 * x] = rgb[3 * x + 1] = rgb[3 * x + 2] = x;
+    }
+    conv.rgb24_to_yuyv(rgb, 256, 1, sizeof(rgb), yuyv, sizeof(yuyv));
+    for(x = 0; x < 256; x += 2) {
+        y[x] = yuyv[2 * x];
+        u[x / 2] = yuyv[2 * x + 1];
+        y[x + 1] = yuyv[2 * x + 2];
+        v[x / 2] = yuyv[2 * x + 3];
+    }
+    conv.yuv_row(y, u, v, 256, back);
+    for(x = 0; x < sizeof(rgb); x++) {
+        const int diff = back[x] - rgb[x];
+        CHECK((diff >= -2) && (diff <= 2), "%s level %u came back as %u", conv.name(),
+                rgb[x], back[x]);
+    }
+}
+
+int main()
+{
+    unsigned i, m, full;
+
+    for(i = 0; i < sizeof(ISAS) / sizeof(ISAS[0]); i++) {
+        if(!pixel_force_isa(ISAS[i])) {
+            printf("%s pixel kernels not available, skipped\n", ISAS[i]);
+            continue;
+        }
+        for(m = 0; m < sizeof(MATRICES) / sizeof(MATRICES[0]); m++) {
+            for(full = 0; full < 2; full++) {
+                check_yuv_rows(ISAS[i], MATRICES[m], full, PIXEL_RGB24);
+                check_yuv_rows(ISAS[i], MATRICES[m], full, PIXEL_BGR24);
+                check_frames(ISAS[i], MATRICES[m], full);
+                check_rgb_frames(ISAS[i], MATRICES[m], full);
+                check_round_trip(MATRICES[m], full);
+            }
+        }
+    }
+    pixel_force_isa(NULL);
+    return check_done("test_colour");
+}
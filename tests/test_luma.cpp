@@ -0,0 +1,158 @@
+#include <vector>
+
+#include <string.h>
+
+#include "luma.h"
+#include "check.h"
+
+static const char * const KERNELS[] = {"scalar", "sse2", "avx2", "neon"};
+static const unsigned WIDTHS[] = {1, 2, 3, 7, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 641};
+static const unsigned HEIGHTS[] = {1, 2, 5};
+static const unsigned PADS[] = {0, 1, 13, 64};
+static const unsigned ALIGNS[] = {0, 1, 3, 15, 31};
+
+/**
+ * Bytes of a frame with nothing after the last sample of the last row
+ */
+static size_t frame_bytes(unsigned width, unsigned height, unsigned bpl, unsigned stride)
+{
+    return static_cast<size_t>(bpl) * (height - 1) + width * stride;
+}
+
+/**
+ * luma_stats must give exactly what luma_stats_scalar does
+ */
+static void check_stats(const char * kernel, const uint8_t * data, unsigned width,
+        unsigned height, unsigned bpl, unsigned stride)
+{
+    LumaStats want, got;
+
+    luma_stats_scalar(data, width, height, bpl, stride, want);
+    luma_stats(data, width, height, bpl, stride, got);
+    CHECK((got.sum == want.sum) && (got.count == want.count)
+            && (got.min == want.min) && (got.max == want.max),
+            "%s %ux%u bpl %u stride %u: sum %llu/%llu min %u/%u max %u/%u",
+            kernel, width, height, bpl, stride,
+            (unsigned long long) got.sum, (unsigned long long) want.sum,
+            got.min, want.min, got.max, want.max);
+}
+
+/**
+ * luma_extract must copy out every sample and nothing else
+ */
+static void check_extract(const char * kernel, const uint8_t * data, unsigned width,
+        unsigned height, unsigned bpl, unsigned stride)
+{
+    const unsigned dst_stride = width + 3;
+    std::vector<uint8_t> dst(static_cast<size_t>(dst_stride) * height, 0xA5);
+    unsigned x, y;
+    bool same = true;
+
+    luma_extract(data, width, height, bpl, stride, &dst[0], dst_stride);
+    for(y = 0; y < height; y++) {
+        for(x = 0; x < dst_stride; x++) {
+            const uint8_t want = x < width ? data[y * bpl + x * stride] : 0xA5;
+            same = same && (dst[y * dst_stride + x] == want);
+        }
+    }
+    CHECK(same, "%s %ux%u bpl %u stride %u", kernel, width, height, bpl, stride);
+}
+
+/**
+ * luma_histogram must count every sample once, at its level, and give the
+ * same stats as luma_stats_scalar
+ */
+static void check_histogram(const char * kernel, const uint8_t * data, unsigned width,
+        unsigned height, unsigned bpl, unsigned stride)
+{
+    uint32_t want[LUMA_LEVELS], got[LUMA_LEVELS];
+    LumaStats want_stats, got_stats;
+    unsigned x, y;
+
+    memset(want, 0, sizeof(want));
+    for(y = 0; y < height; y++) {
+        for(x = 0; x < width; x++) {
+            want[data[y * bpl + x * stride]]++;
+        }
+    }
+    luma_stats_scalar(data, width, height, bpl, stride, want_stats);
+    luma_histogram(data, width, height, bpl, stride, got, got_stats);
+    CHECK(!memcmp(got, want, sizeof(want)), "%s %ux%u bpl %u stride %u histogram",
+            kernel, width, height, bpl, stride);
+    CHECK((got_stats.sum == want_stats.sum) && (got_stats.count == want_stats.count)
+            && (got_stats.min == want_stats.min) && (got_stats.max == want_stats.max),
+            "%s %ux%u bpl %u stride %u histogram stats", kernel, width, height, bpl,
+            stride);
+}
+
+/**
+ * Percentiles of a known histogram
+ */
+static void check_percentile()
+{
+    uint32_t hist[LUMA_LEVELS];
+
+    memset(hist, 0, sizeof(hist));
+    hist[10] = 1;
+    hist[20] = 98;
+    hist[250] = 1;
+    CHECK(luma_percentile(hist, 100, 0) == 10, "p0");
+    CHECK(luma_percentile(hist, 100, 1) == 10, "p1");
+    CHECK(luma_percentile(hist, 100, 2) == 20, "p2");
+    CHECK(luma_percentile(hist, 100, 50) == 20, "p50");
+    CHECK(luma_percentile(hist, 100, 99) == 20, "p99");
+    CHECK(luma_percentile(hist, 100, 100) == 250, "p100");
+}
+
+static void check_kernel(const char * kernel)
+{
+    unsigned w, h, p, a, stride;
+    uint32_t seed = 1;
+
+    for(stride = 1; stride <= 2; stride++) {
+        for(w = 0; w < sizeof(WIDTHS) / sizeof(WIDTHS[0]); w++) {
+            for(h = 0; h < sizeof(HEIGHTS) / sizeof(HEIGHTS[0]); h++) {
+                for(p = 0; p < sizeof(PADS) / sizeof(PADS[0]); p++) {
+                    const unsigned width = WIDTHS[w];
+                    const unsigned height = HEIGHTS[h];
+                    const unsigned bpl = width * stride + PADS[p];
+                    const size_t bytes = frame_bytes(width, height, bpl, stride);
+
+                    /* Starting at odd alignments */
+                    for(a = 0; a < sizeof(ALIGNS) / sizeof(ALIGNS[0]); a++) {
+                        std::vector<uint8_t> buf(bytes + ALIGNS[a] + 64);
+                        uint8_t * data = &buf[0] + ((64 - (reinterpret_cast<uintptr_t>(
+                                &buf[0]) & 63)) & 63) + ALIGNS[a];
+                        check_fill(data, bytes, seed++);
+                        check_stats(kernel, data, width, height, bpl, stride);
+                        check_extract(kernel, data, width, height, bpl, stride);
+                        check_histogram(kernel, data, width, height, bpl, stride);
+                    }
+
+                    /* Ending right at an unmapped page */
+                    GuardedBuffer guarded(bytes);
+                    check_fill(guarded.data(), bytes, seed++);
+                    check_stats(kernel, guarded.data(), width, height, bpl, stride);
+                    check_extract(kernel, guarded.data(), width, height, bpl, stride);
+                    check_histogram(kernel, guarded.data(), width, height, bpl, stride);
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    unsigned k;
+
+    for(k = 0; k < sizeof(KERNELS) / sizeof(KERNELS[0]); k++) {
+        if(!luma_force_kernel(KERNELS[k])) {
+            printf("%s luma kernel not available, skipped\n", KERNELS[k]);
+            continue;
+        }
+        check_kernel(KERNELS[k]);
+    }
+    luma_force_kernel(NULL);
+    check_percentile();
+    return check_done("test_luma");
+}
@@ -0,0 +1,162 @@
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mjpeg.h"
+#include "check.h"
+
+/* Up to the scan, as a UVC camera sends it: no DHT */
+static const uint8_t HEADERS[] = {
+    0xFF, 0xD8,
+    0xFF, 0xE0, 0x00, 0x06, 'A', 'V', 'I', '1',
+    0xFF, 0xDB, 0x00, 0x05, 0x00, 0x10, 0x0B,
+    0xFF, 0xC0, 0x00, 0x11, 0x08, 0x01, 0xE0, 0x02, 0x80, 0x03,
+    0x01, 0x21, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01,
+};
+
+/* A table of its own, one code of length 1 */
+static const uint8_t OWN_DHT[] = {
+    0xFF, 0xC4, 0x00, 0x14, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00,
+};
+
+/* Start of scan, then entropy coded data with a stuffed 0xFF and a restart */
+static const uint8_t SCAN[] = {
+    0xFF, 0xDA, 0x00, 0x0C, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3F, 0x00,
+    0x12, 0xFF, 0x00, 0x34, 0xFF, 0xD0, 0x56, 0x78,
+    0xFF, 0xD9,
+};
+
+static std::vector<uint8_t> frame(bool dht, unsigned padding)
+{
+    std::vector<uint8_t> f(HEADERS, HEADERS + sizeof(HEADERS));
+
+    if(dht) {
+        f.insert(f.end(), OWN_DHT, OWN_DHT + sizeof(OWN_DHT));
+    }
+    f.insert(f.end(), SCAN, SCAN + sizeof(SCAN));
+    f.insert(f.end(), padding, 0);
+    return f;
+}
+
+static std::string joined(const struct iovec * iov, unsigned n)
+{
+    std::string s;
+    unsigned i;
+
+    for(i = 0; i < n; i++) {
+        s.append(reinterpret_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+    }
+    return s;
+}
+
+/**
+ * A frame without tables gets the standard ones before the scan, with the
+ * padding after EOI dropped and nothing else changed
+ */
+static void check_no_dht(const std::string & dir)
+{
+    const std::vector<uint8_t> f = frame(false, 37);
+    const std::string path = dir + "/t.jpg";
+    struct iovec iov[MJPEG_MAX_IOV];
+    MjpegFrame jpeg;
+    unsigned n, len;
+
+    CHECK(jpeg.parse(&f[0], f.size()), "parse");
+    CHECK((jpeg.width() == 640) && (jpeg.height() == 480) && (jpeg.components() == 3)
+            && !jpeg.has_dht(), "%ux%u %u components", jpeg.width(), jpeg.height(),
+            jpeg.components());
+    n = jpeg.iov(iov);
+    CHECK(n == 3, "%u pieces", n);
+    if(n != 3) {
+        return;
+    }
+    const uint8_t * dht = static_cast<const uint8_t *>(iov[1].iov_base);
+    len = (dht[2] << 8) | dht[3];
+    CHECK((dht[0] == 0xFF) && (dht[1] == 0xC4) && (iov[1].iov_len == len + 2),
+            "DHT segment of %u bytes", static_cast<unsigned>(iov[1].iov_len));
+    CHECK(joined(iov, 1) == std::string(HEADERS, HEADERS + sizeof(HEADERS)), "headers");
+    CHECK(joined(iov + 2, 1) == std::string(SCAN, SCAN + sizeof(SCAN)), "scan");
+    CHECK(jpeg.size() == sizeof(HEADERS) + iov[1].iov_len + sizeof(SCAN), "size %u",
+            jpeg.size());
+
+    std::string written;
+    char buf[4096];
+    size_t got;
+    CHECK(jpeg.write(path), "write");
+    FILE * fp = fopen(path.c_str(), "rb");
+    if(fp) {
+        while((got = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            written.append(buf, got);
+        }
+        fclose(fp);
+    }
+    CHECK(written == joined(iov, n), "file contents");
+    unlink(path.c_str());
+}
+
+/**
+ * A frame with its own tables goes out as it is, up to EOI
+ */
+static void check_own_dht()
+{
+    const std::vector<uint8_t> f = frame(true, 5);
+    struct iovec iov[MJPEG_MAX_IOV];
+    MjpegFrame jpeg;
+    unsigned n;
+
+    CHECK(jpeg.parse(&f[0], f.size()) && jpeg.has_dht(), "parse with DHT");
+    n = jpeg.iov(iov);
+    CHECK((n == 1) && (iov[0].iov_base == &f[0]) && (iov[0].iov_len == f.size() - 5)
+            && (jpeg.size() == f.size() - 5), "%u pieces", n);
+}
+
+/**
+ * Anything that is not a whole frame is refused, and iov() then gives
+ * nothing
+ */
+static void check_rejects()
+{
+    std::vector<uint8_t> f = frame(false, 0);
+    struct iovec iov[MJPEG_MAX_IOV];
+    MjpegFrame jpeg;
+    unsigned bytes;
+
+    /* Cut short anywhere, so no EOI or a segment past the end */
+    for(bytes = 0; bytes < f.size() - 1; bytes++) {
+        CHECK(!jpeg.parse(&f[0], bytes) && !jpeg.iov(iov) && !jpeg.size(),
+                "%u of %u bytes", bytes, static_cast<unsigned>(f.size()));
+    }
+
+    f[1] = 0xD9;
+    CHECK(!jpeg.parse(&f[0], f.size()), "no SOI");
+
+    f = frame(false, 0);
+    f[sizeof(HEADERS) - 19 + 1] = 0xE1;     /* SOF0 becomes APP1 */
+    CHECK(!jpeg.parse(&f[0], f.size()), "no SOF");
+
+    f = frame(false, 0);
+    f[2 + 3] = 0xFF;                        /* APP0 longer than the frame */
+    CHECK(!jpeg.parse(&f[0], f.size()), "segment past the end");
+}
+
+int main()
+{
+    char dir[] = "/tmp/test_mjpeg.XXXXXX";
+
+    if(!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    check_no_dht(dir);
+    check_own_dht();
+    check_rejects();
+    rmdir(dir);
+    return check_done("test_mjpeg");
+}
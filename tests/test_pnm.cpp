@@ -0,0 +1,127 @@
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include "colour.h"
+#include "format.h"
+#include "pnm.h"
+#include "check.h"
+
+static const uint32_t FORMATS[] = {
+    V4L2_PIX_FMT_GREY, V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420,
+    V4L2_PIX_FMT_RGB24
+};
+static const unsigned WIDTHS[] = {2, 66, 640};
+/* Past IOV_MAX rows, so the writes go out in more than one batch */
+static const unsigned HEIGHTS[] = {2, 14, 1500};
+static const unsigned PADS[] = {0, 4};
+
+static std::string read_file(const std::string & path)
+{
+    std::string data;
+    char buf[65536];
+    size_t n;
+    FILE * fp = fopen(path.c_str(), "rb");
+
+    if(!fp) {
+        return data;
+    }
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.append(buf, n);
+    }
+    fclose(fp);
+    return data;
+}
+
+static std::string header(char type, const BaseFormat & fmt)
+{
+    char buf[80];
+
+    snprintf(buf, sizeof(buf), "P%c\n#FOURCC %s\n%u %u\n255\n", type,
+            fmt.pix_fmt_str().c_str(), fmt.width(), fmt.height());
+    return buf;
+}
+
+/**
+ * The PGM must be the header then exactly the luma samples, the PPM the
+ * header then what convert() gives, whatever the row padding
+ */
+static void check_format(const std::string & dir, uint32_t fourcc)
+{
+    const std::string pgm = dir + "/t.pgm";
+    const std::string ppm = dir + "/t.ppm";
+    unsigned w, h, p, x, y;
+
+    for(w = 0; w < sizeof(WIDTHS) / sizeof(WIDTHS[0]); w++) {
+        for(h = 0; h < sizeof(HEIGHTS) / sizeof(HEIGHTS[0]); h++) {
+            for(p = 0; p < sizeof(PADS) / sizeof(PADS[0]); p++) {
+                const unsigned width = WIDTHS[w];
+                const unsigned height = HEIGHTS[h];
+                BaseFormat * fmt = create_format_obj(fourcc);
+                fmt->init(width, height, fmt->default_bytesperline(width) + PADS[p]);
+                const unsigned bytes = fmt->plane_size(0);
+                GuardedBuffer frame(bytes);
+                const uint8_t * const planes[1] = {frame.data()};
+                const ColourConverter conv;
+                std::string luma, rgb(static_cast<size_t>(3) * width * height, 0);
+                PnmWriter writer;
+
+                check_fill(frame.data(), bytes, width + height + p);
+                luma.resize(static_cast<size_t>(width) * height);
+                CHECK(fmt->extract_luma(frame.data(), bytes,
+                        reinterpret_cast<uint8_t *>(&luma[0]), width),
+                        "%s extract_luma failed", fmt->pix_fmt_str().c_str());
+                if(fourcc == V4L2_PIX_FMT_RGB24) {
+                    for(y = 0; y < height; y++) {
+                        for(x = 0; x < 3 * width; x++) {
+                            rgb[y * 3 * width + x] = frame.data()[y * fmt->bytesperline() + x];
+                        }
+                    }
+                }
+                else {
+                    CHECK(conv.convert(*fmt, planes, bytes,
+                            reinterpret_cast<uint8_t *>(&rgb[0]), 3 * width),
+                            "%s convert failed", fmt->pix_fmt_str().c_str());
+                }
+
+                CHECK(writer.write_pgm(pgm, *fmt, planes, bytes)
+                        && (read_file(pgm) == header('5', *fmt) + luma),
+                        "%s %ux%u bpl %u PGM", fmt->pix_fmt_str().c_str(), width, height,
+                        fmt->bytesperline());
+                CHECK(writer.write_ppm(ppm, *fmt, planes, bytes, conv)
+                        && (read_file(ppm) == header('6', *fmt) + rgb),
+                        "%s %ux%u bpl %u PPM", fmt->pix_fmt_str().c_str(), width, height,
+                        fmt->bytesperline());
+                /* The last row missing, or for colour anything at all */
+                CHECK(!writer.write_pgm(pgm, *fmt, planes, fmt->bytesperline() * (height - 1))
+                        && !writer.write_ppm(ppm, *fmt, planes, bytes - 1, conv),
+                        "%s %ux%u short frame written", fmt->pix_fmt_str().c_str(), width,
+                        height);
+                delete fmt;
+            }
+        }
+    }
+    unlink(pgm.c_str());
+    unlink(ppm.c_str());
+}
+
+int main()
+{
+    char dir[] = "/tmp/test_pnm.XXXXXX";
+    unsigned f;
+
+    if(!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    for(f = 0; f < sizeof(FORMATS) / sizeof(FORMATS[0]); f++) {
+        check_format(dir, FORMATS[f]);
+    }
+    rmdir(dir);
+    return check_done("test_pnm");
+}
@@ -0,0 +1,196 @@
+#include <vector>
+
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "colour.h"
+#include "format.h"
+#include "thumbnail.h"
+#include "tiles.h"
+#include "check.h"
+
+static const unsigned SRC_WIDTHS[] = {1, 7, 64, 100, 641};
+static const unsigned SRC_HEIGHTS[] = {1, 5, 48, 97};
+static const unsigned THUMB_SIZES[] = {1, 3, 16, 40};
+
+/**
+ * Each output pixel must be the rounded mean of the source pixels under
+ * it, and the statistics those of the output, made in one go or in bands
+ * across a pool
+ */
+static void check_grey_box(TileScheduler & tiles)
+{
+    unsigned w, h, t, x, y, r, c;
+
+    for(w = 0; w < sizeof(SRC_WIDTHS) / sizeof(SRC_WIDTHS[0]); w++) {
+        for(h = 0; h < sizeof(SRC_HEIGHTS) / sizeof(SRC_HEIGHTS[0]); h++) {
+            const unsigned width = SRC_WIDTHS[w];
+            const unsigned height = SRC_HEIGHTS[h];
+            const unsigned bpl = width + 3;
+            BaseFormat * fmt = create_format_obj(V4L2_PIX_FMT_GREY);
+            fmt->init(width, height, bpl);
+            GuardedBuffer src(fmt->plane_size(0));
+            const uint8_t * const planes[1] = {src.data()};
+
+            check_fill(src.data(), fmt->plane_size(0), width * height);
+            for(t = 0; t < sizeof(THUMB_SIZES) / sizeof(THUMB_SIZES[0]); t++) {
+                const unsigned tw = THUMB_SIZES[t] < width ? THUMB_SIZES[t] : width;
+                const unsigned th = THUMB_SIZES[t] < height ? THUMB_SIZES[t] : height;
+                Thumbnailer thumbnailer(tw, th);
+                Thumbnail thumb, banded;
+                ImageQuality qual(true), banded_qual(true);
+                std::vector<uint8_t> want(tw * th);
+                uint32_t hist[256];
+                bool same = true;
+
+                memset(hist, 0, sizeof(hist));
+                for(y = 0; y < th; y++) {
+                    const unsigned y0 = y * height / th, y1 = (y + 1) * height / th;
+                    for(x = 0; x < tw; x++) {
+                        const unsigned x0 = x * width / tw, x1 = (x + 1) * width / tw;
+                        const unsigned area = (x1 - x0) * (y1 - y0);
+                        unsigned sum = area / 2;
+                        for(r = y0; r < y1; r++) {
+                            for(c = x0; c < x1; c++) {
+                                sum += src.data()[r * bpl + c];
+                            }
+                        }
+                        want[y * tw + x] = sum / area;
+                        hist[sum / area]++;
+                    }
+                }
+
+                CHECK(thumbnailer.make(*fmt, planes, fmt->plane_size(0), thumb, &qual),
+                        "%ux%u to %ux%u failed", width, height, tw, th);
+                CHECK(tiles.thumbnail(thumbnailer, *fmt, planes, fmt->plane_size(0),
+                        banded, &banded_qual), "%ux%u to %ux%u in bands failed",
+                        width, height, tw, th);
+                CHECK((thumb.width == tw) && (thumb.height == th) && (thumb.stride == tw)
+                        && (banded.width == tw) && (banded.height == th),
+                        "%ux%u to %ux%u came out %ux%u", width, height, tw, th,
+                        thumb.width, thumb.height);
+                if((thumb.width != tw) || (thumb.height != th) || (banded.height != th)) {
+                    continue;
+                }
+                for(y = 0; y < th; y++) {
+                    same = same && !memcmp(&thumb.data[y * thumb.stride], &want[y * tw], tw)
+                        && !memcmp(&banded.data[y * banded.stride], &want[y * tw], tw);
+                }
+                CHECK(same, "%ux%u to %ux%u pixels", width, height, tw, th);
+                CHECK(!memcmp(qual.histogram, hist, sizeof(hist))
+                        && !memcmp(banded_qual.histogram, hist, sizeof(hist))
+                        && (banded_qual.luma_mean == qual.luma_mean),
+                        "%ux%u to %ux%u statistics", width, height, tw, th);
+            }
+            delete fmt;
+        }
+    }
+}
+
+/**
+ * A flat YUYV frame must give a flat colour thumbnail, converted with the
+ * matrix set_colour gave it
+ */
+static void check_colour(ColourMatrix matrix, bool full)
+{
+    const unsigned width = 64, height = 32;
+    const ColourConverter conv(matrix, full);
+    BaseFormat * fmt = create_format_obj(V4L2_PIX_FMT_YUYV);
+    Thumbnailer thumbnailer(8, 4, THUMB_BOX, true);
+    Thumbnail thumb;
+    const uint8_t y = 90, u = 60, v = 200;
+    uint8_t want[3];
+    unsigned i;
+    bool same = true;
+
+    fmt->init(width, height, fmt->default_bytesperline(width));
+    std::vector<uint8_t> frame(fmt->plane_size(0));
+    const uint8_t * const planes[1] = {&frame[0]};
+    for(i = 0; i < frame.size(); i += 4) {
+        frame[i] = y;
+        frame[i + 1] = u;
+        frame[i + 2] = y;
+        frame[i + 3] = v;
+    }
+    yuv_row_scalar(conv.coeffs(), &y, &u, &v, 1, want);
+
+    thumbnailer.set_colour(conv);
+    CHECK(thumbnailer.make(*fmt, planes, frame.size(), thumb), "%s failed", conv.name());
+    for(i = 0; i < thumb.data.size(); i += 3) {
+        same = same && !memcmp(&thumb.data[i], want, 3);
+    }
+    CHECK(same && thumb.rgb && (thumb.data.size() == 8 * 4 * 3), "%s colour", conv.name());
+    delete fmt;
+}
+
+/**
+ * A colour thumbnail of a grey frame is R = G = B of the grey one, as
+ * convert() does, with no range stretch
+ */
+static void check_grey_colour()
+{
+    const unsigned width = 64, height = 30;
+    BaseFormat * fmt = create_format_obj(V4L2_PIX_FMT_GREY);
+    Thumbnailer grey(16, 10), colour(16, 10, THUMB_BOX, true);
+    Thumbnail g, c;
+    unsigned i;
+    bool same = true;
+
+    fmt->init(width, height, width);
+    std::vector<uint8_t> frame(fmt->plane_size(0));
+    const uint8_t * const planes[1] = {&frame[0]};
+    for(i = 0; i < frame.size(); i++) {
+        frame[i] = (i * 7) & 255;
+    }
+    colour.set_colour(ColourConverter(COLOUR_BT709, false));
+    CHECK(grey.make(*fmt, planes, frame.size(), g) && colour.make(*fmt, planes,
+            frame.size(), c) && (c.data.size() == 3 * g.data.size()), "grey made");
+    for(i = 0; i < g.data.size() && (c.data.size() == 3 * g.data.size()); i++) {
+        same = same && (c.data[3 * i] == g.data[i]) && (c.data[3 * i + 1] == g.data[i])
+            && (c.data[3 * i + 2] == g.data[i]);
+    }
+    CHECK(same, "grey in colour");
+    delete fmt;
+}
+
+/**
+ * One pixel from a frame big enough that its sum passes 32 bits
+ */
+static void check_big_box()
+{
+    const unsigned width = 5000, height = 3500;
+    BaseFormat * fmt = create_format_obj(V4L2_PIX_FMT_GREY);
+    Thumbnailer thumbnailer(1, 1);
+    Thumbnail thumb;
+    uint64_t sum = 0;
+    size_t i;
+
+    fmt->init(width, height, width);
+    std::vector<uint8_t> frame(fmt->plane_size(0));
+    const uint8_t * const planes[1] = {&frame[0]};
+    for(i = 0; i < frame.size(); i++) {
+        frame[i] = i & 1 ? 255 : 254;
+        sum += frame[i];
+    }
+    CHECK(thumbnailer.make(*fmt, planes, frame.size(), thumb)
+            && (thumb.data[0] == (sum + frame.size() / 2) / frame.size()),
+            "%ux%u to 1x1 gave %u", width, height, thumb.data.empty() ? 0 : thumb.data[0]);
+    delete fmt;
+}
+
+int main()
+{
+    static const ColourMatrix MATRICES[] = {COLOUR_BT601, COLOUR_BT709, COLOUR_BT2020};
+    TilePool pool(2);
+    TileScheduler tiles(pool, 256);
+    unsigned m;
+
+    check_grey_box(tiles);
+    check_grey_colour();
+    check_big_box();
+    for(m = 0; m < sizeof(MATRICES) / sizeof(MATRICES[0]); m++) {
+        check_colour(MATRICES[m], false);
+        check_colour(MATRICES[m], true);
+    }
+    return check_done("test_thumbnail");
+}
@@ -0,0 +1,104 @@
+#include <vector>
+
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "colour.h"
+#include "format.h"
+#include "tiles.h"
+#include "check.h"
+
+static const uint32_t FORMATS[] = {
+    V4L2_PIX_FMT_GREY, V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420,
+    V4L2_PIX_FMT_RGB24
+};
+static const unsigned WIDTHS[] = {2, 64, 100, 642};
+static const unsigned HEIGHTS[] = {1, 2, 3, 6, 47, 48, 98};
+static const unsigned BAND_BYTES[] = {1, 256, 4096, TILE_BAND_BYTES};
+
+/**
+ * The metering to try, whole frame, centre weighted and sub-sampled
+ */
+static MeteringConfig metering(unsigned i)
+{
+    MeteringConfig config;
+
+    switch(i) {
+    case 1:
+        return MeteringConfig::center_weighted();
+    case 2:
+        config = MeteringConfig::center_weighted(3);
+        config.add_region(0.1, 0.6, 0.3, 0.4, 2);
+        return config;
+    }
+    return config;
+}
+
+/**
+ * check_quality and convert split into bands across a pool must give
+ * exactly what they do in one go, whatever the band size
+ */
+static void check_format(TilePool & pool, uint32_t fourcc)
+{
+    unsigned w, h, m, b;
+
+    for(w = 0; w < sizeof(WIDTHS) / sizeof(WIDTHS[0]); w++) {
+        for(h = 0; h < sizeof(HEIGHTS) / sizeof(HEIGHTS[0]); h++) {
+            const unsigned width = WIDTHS[w];
+            const unsigned height = HEIGHTS[h];
+            BaseFormat * fmt = create_format_obj(fourcc);
+            fmt->init(width, height, fmt->default_bytesperline(width) + 4);
+            const unsigned bytes = fmt->plane_size(0);
+            GuardedBuffer frame(bytes);
+            uint8_t * const planes[1] = {frame.data()};
+            const ColourConverter conv;
+            const unsigned stride = 3 * width;
+            std::vector<uint8_t> want_rgb(stride * height), got_rgb(want_rgb.size());
+
+            check_fill(frame.data(), bytes, width + height);
+            CHECK(conv.convert(*fmt, planes, bytes, &want_rgb[0], stride),
+                    "%s convert failed", fmt->pix_fmt_str().c_str());
+
+            for(m = 0; m < 3; m++) {
+                ImageQuality want(true);
+                fmt->set_metering(metering(m));
+                CHECK(fmt->check_quality(frame.data(), bytes, want), "%s %ux%u failed",
+                        fmt->pix_fmt_str().c_str(), width, height);
+
+                for(b = 0; b < sizeof(BAND_BYTES) / sizeof(BAND_BYTES[0]); b++) {
+                    TileScheduler tiles(pool, BAND_BYTES[b]);
+                    ImageQuality got(true);
+
+                    CHECK(tiles.check_quality(*fmt, frame.data(), bytes, got)
+                            && (got.luma_mean == want.luma_mean)
+                            && (got.luma_min == want.luma_min)
+                            && (got.luma_max == want.luma_max)
+                            && (got.luma_p50 == want.luma_p50)
+                            && (got.contrast == want.contrast)
+                            && !memcmp(got.histogram, want.histogram, sizeof(want.histogram)),
+                            "%s %ux%u metering %u bands of %u bytes", fmt->pix_fmt_str().c_str(),
+                            width, height, m, BAND_BYTES[b]);
+                    if(m) {
+                        continue;
+                    }
+                    memset(&got_rgb[0], 0, got_rgb.size());
+                    CHECK(tiles.convert(conv, *fmt, planes, bytes, &got_rgb[0], stride)
+                            && (got_rgb == want_rgb), "%s %ux%u convert in bands of %u bytes",
+                            fmt->pix_fmt_str().c_str(), width, height, BAND_BYTES[b]);
+                }
+            }
+            delete fmt;
+        }
+    }
+}
+
+int main()
+{
+    TilePool pool(3);
+    unsigned f;
+
+    for(f = 0; f < sizeof(FORMATS) / sizeof(FORMATS[0]); f++) {
+        check_format(pool, FORMATS[f]);
+    }
+    return check_done("test_tiles");
+}
@@ -0,0 +1,410 @@
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "logging.h"
+#include "format.h"
+#include "pixkernel.h"
+#include "thumbnail.h"
+
+#define FRAC_BITS (ColourConverter::FRAC_BITS)
+#define ROUND (1 << (FRAC_BITS - 1))
+
+static inline uint8_t clamp8(int val)
+{
+    return val < 0 ? 0 : (val > 255 ? 255 : val);
+}
+
+/**
+ * Where the planes of a frame are
+ */
+struct ThumbPlanes
+{
+    const uint8_t * base[3];
+    unsigned bpl[3];
+};
+
+/*
+ * Sources give the three components of the pixel at (x, r): Y', Cb, Cr,
+ * or R, G, B if IS_RGB. Chroma is whichever sample covers the pixel.
+ */
+
+struct YuyvThumb
+{
+    static const bool IS_RGB = false;
+
+    static void view(const BaseFormat & fmt, const uint8_t * const * planes,
+            ThumbPlanes & view)
+    {
+        view.base[0] = planes[0];
+        view.bpl[0] = fmt.bytesperline();
+    }
+
+    static inline void sample(const ThumbPlanes & view, unsigned x, unsigned r,
+            int & a, int & b, int & c)
+    {
+        const uint8_t * row = view.base[0] + r * view.bpl[0];
+        const uint8_t * pair = row + 4 * (x >> 1);
+        a = row[2 * x];
+        b = pair[1];
+        c = pair[3];
+    }
+};
+
+template<bool SEPARATE> struct Nv12Thumb
+{
+    static const bool IS_RGB = false;
+
+    static void view(const BaseFormat & fmt, const uint8_t * const * planes,
+            ThumbPlanes & view)
+    {
+        view.base[0] = planes[0];
+        view.bpl[0] = fmt.bytesperline();
+        view.base[1] = SEPARATE ? planes[1] : planes[0] + fmt.bytesperline() * fmt.height();
+        view.bpl[1] = SEPARATE ? fmt.plane_bytesperline(1) : fmt.bytesperline();
+    }
+
+    static inline void sample(const ThumbPlanes & view, unsigned x, unsigned r,
+            int & a, int & b, int & c)
+    {
+        const uint8_t * uv = view.base[1] + (r >> 1) * view.bpl[1] + 2 * (x >> 1);
+        a = view.base[0][r * view.bpl[0] + x];
+        b = uv[0];
+        c = uv[1];
+    }
+};
+
+struct Yuv420Thumb
+{
+    static const bool IS_RGB = false;
+
+    static void view(const BaseFormat & fmt, const uint8_t * const * planes,
+            ThumbPlanes & view)
+    {
+        const unsigned bpl = fmt.bytesperline();
+        view.base[0] = planes[0];
+        view.bpl[0] = bpl;
+        view.base[1] = planes[0] + bpl * fmt.height();
+        view.bpl[1] = bpl / 2;
+        view.base[2] = view.base[1] + view.bpl[1] * ((fmt.height() + 1) / 2);
+        view.bpl[2] = bpl / 2;
+    }
+
+    static inline void sample(const ThumbPlanes & view, unsigned x, unsigned r,
+            int & a, int & b, int & c)
+    {
+        a = view.base[0][r * view.bpl[0] + x];
+        b = view.base[1][(r >> 1) * view.bpl[1] + (x >> 1)];
+        c = view.base[2][(r >> 1) * view.bpl[2] + (x >> 1)];
+    }
+};
+
+/* Read as R = G = B, so a colour thumbnail is grey as convert() makes it
+ * rather than stretched through the matrix */
+struct GreyThumb
+{
+    static const bool IS_RGB = true;
+
+    static void view(const BaseFormat & fmt, const uint8_t * const * planes,
+            ThumbPlanes & view)
+    {
+        view.base[0] = planes[0];
+        view.bpl[0] = fmt.bytesperline();
+    }
+
+    static inline void sample(const ThumbPlanes & view, unsigned x, unsigned r,
+            int & a, int & b, int & c)
+    {
+        a = b = c = view.base[0][r * view.bpl[0] + x];
+    }
+};
+
+struct Rgb24Thumb
+{
+    static const bool IS_RGB = true;
+
+    static void view(const BaseFormat & fmt, const uint8_t * const * planes,
+            ThumbPlanes & view)
+    {
+        view.base[0] = planes[0];
+        view.bpl[0] = fmt.bytesperline();
+    }
+
+    static inline void sample(const ThumbPlanes & view, unsigned x, unsigned r,
+            int & a, int & b, int & c)
+    {
+        const uint8_t * p = view.base[0] + r * view.bpl[0] + 3 * x;
+        a = p[0];
+        b = p[1];
+        c = p[2];
+    }
+};
+
+/**
+ * The two source pixels either side of the centre of output pixel o,
+ * and the weight of the second in 256ths
+ */
+static void bilinear_tap(unsigned o, unsigned out_size, unsigned src_size,
+        unsigned & s0, unsigned & s1, unsigned & w)
+{
+    const int64_t pos = (static_cast<int64_t>(2 * o + 1) * src_size * 128) / out_size - 128;
+
+    if(pos <= 0) {
+        s0 = 0;
+        w = 0;
+    }
+    else {
+        s0 = pos >> 8;
+        w = pos & 255;
+    }
+    if(s0 >= src_size - 1) {
+        s0 = src_size - 1;
+        w = 0;
+    }
+    s1 = s0 + 1 < src_size ? s0 + 1 : s0;
+}
+
+static inline int lerp2(int s00, int s01, int s10, int s11, unsigned wx, unsigned wy)
+{
+    const int top = s00 * (256 - wx) + s01 * wx;
+    const int bottom = s10 * (256 - wx) + s11 * wx;
+    return (top * (256 - wy) + bottom * wy + 32768) >> 16;
+}
+
+/**
+ * The box and bilinear kernels for one source and output, everything
+ * that differs between them fixed at compile time
+ */
+template<class Src, bool RGB> struct ThumbKernels
+{
+    /**
+     * Write one output pixel and add its luma to sums
+     */
+    static inline void emit(const YuvCoeffs & k, int a, int b, int c, uint8_t * out,
+            QualitySums & sums)
+    {
+        /* Same weights as rgb24_luma, they sum to 256 so grey keeps its level */
+        const unsigned luma = Src::IS_RGB ? (77 * a + 150 * b + 29 * c + 128) >> 8 : a;
+
+        if(!RGB) {
+            out[0] = luma;
+        }
+        else if(Src::IS_RGB) {
+            out[0] = a;
+            out[1] = b;
+            out[2] = c;
+        }
+        else {
+            const int yy = k.cy * (a - k.y_offset) + ROUND;
+            const int uu = b - 128;
+            const int vv = c - 128;
+            out[0] = clamp8((yy + k.crv * vv) >> FRAC_BITS);
+            out[1] = clamp8((yy - k.cgu * uu - k.cgv * vv) >> FRAC_BITS);
+            out[2] = clamp8((yy + k.cbu * uu) >> FRAC_BITS);
+        }
+        sums.sum += luma;
+        sums.count++;
+        if(luma < sums.min) {
+            sums.min = luma;
+        }
+        if(luma > sums.max) {
+            sums.max = luma;
+        }
+        if(sums.with_histogram) {
+            sums.histogram[luma]++;
+        }
+    }
+
+    static void box(const Thumbnailer & thumb, const BaseFormat & fmt,
+            const uint8_t * const * planes, unsigned first_row, unsigned num_rows,
+            Thumbnail & out, QualitySums & sums)
+    {
+        const unsigned src_h = fmt.height();
+        const unsigned bpp = RGB ? 3 : 1;
+        ThumbPlanes view;
+        unsigned oy, ox, x, r;
+
+        Src::view(fmt, planes, view);
+        for(oy = first_row; oy < first_row + num_rows; oy++) {
+            const unsigned y0 = static_cast<uint64_t>(oy) * src_h / out.height;
+            const unsigned y1 = static_cast<uint64_t>(oy + 1) * src_h / out.height;
+            uint8_t * dst = &out.data[oy * out.stride];
+            for(ox = 0; ox < out.width; ox++) {
+                const unsigned x0 = thumb.m_x0[ox];
+                const unsigned x1 = thumb.m_x1[ox];
+                const unsigned area = (x1 - x0) * (y1 - y0);
+                /* 64 bits, 255 * area passes 32 above 16.8 million pixels */
+                uint64_t sa = area / 2, sb = area / 2, sc = area / 2;
+                for(r = y0; r < y1; r++) {
+                    for(x = x0; x < x1; x++) {
+                        int a, b, c;
+                        Src::sample(view, x, r, a, b, c);
+                        sa += a;
+                        sb += b;
+                        sc += c;
+                    }
+                }
+                emit(thumb.m_coeffs, sa / area, sb / area, sc / area, dst + ox * bpp, sums);
+            }
+        }
+    }
+
+    static void bilinear(const Thumbnailer & thumb, const BaseFormat & fmt,
+            const uint8_t * const * planes, unsigned first_row, unsigned num_rows,
+            Thumbnail & out, QualitySums & sums)
+    {
+        const unsigned src_h = fmt.height();
+        const unsigned bpp = RGB ? 3 : 1;
+        ThumbPlanes view;
+        unsigned oy, ox;
+
+        Src::view(fmt, planes, view);
+        for(oy = first_row; oy < first_row + num_rows; oy++) {
+            unsigned y0, y1, wy;
+            bilinear_tap(oy, out.height, src_h, y0, y1, wy);
+            uint8_t * dst = &out.data[oy * out.stride];
+            for(ox = 0; ox < out.width; ox++) {
+                const unsigned x0 = thumb.m_x0[ox];
+                const unsigned x1 = thumb.m_x1[ox];
+                const unsigned wx = thumb.m_wx[ox];
+                int a00, b00, c00, a01, b01, c01, a10, b10, c10, a11, b11, c11;
+                Src::sample(view, x0, y0, a00, b00, c00);
+                Src::sample(view, x1, y0, a01, b01, c01);
+                Src::sample(view, x0, y1, a10, b10, c10);
+                Src::sample(view, x1, y1, a11, b11, c11);
+                emit(thumb.m_coeffs, lerp2(a00, a01, a10, a11, wx, wy),
+                        lerp2(b00, b01, b10, b11, wx, wy),
+                        lerp2(c00, c01, c10, c11, wx, wy), dst + ox * bpp, sums);
+            }
+        }
+    }
+};
+
+template<class Src>
+static Thumbnailer::RowsFn pick_rows(ThumbFilter filter, bool rgb)
+{
+    if(filter == THUMB_BILINEAR) {
+        return rgb ? ThumbKernels<Src, true>::bilinear : ThumbKernels<Src, false>::bilinear;
+    }
+    return rgb ? ThumbKernels<Src, true>::box : ThumbKernels<Src, false>::box;
+}
+
+/**
+ * @param[in] width, height Size wanted, height 0 to keep the frame's
+ *            aspect ratio. Never more than the frame itself.
+ * @param[in] filter How to reduce
+ * @param[in] rgb RGB24 rather than grey
+ */
+Thumbnailer::Thumbnailer(unsigned width, unsigned height, ThumbFilter filter, bool rgb)
+    : m_width(width), m_height(height), m_filter(filter), m_rgb(rgb),
+      m_coeffs(matrix_coeffs(COLOUR_BT601, false)), m_rows(NULL)
+{
+}
+
+/**
+ * Size out and work out the column taps for frames of fmt
+ *
+ * @return false if fmt cannot be read without decoding
+ */
+bool Thumbnailer::prepare(const BaseFormat & fmt, Thumbnail & out)
+{
+    const unsigned src_w = fmt.width();
+    const unsigned src_h = fmt.height();
+    unsigned ox;
+
+    switch(fmt.pix_fmt()) {
+    case V4L2_PIX_FMT_YUYV:
+        m_rows = pick_rows<YuyvThumb>(m_filter, m_rgb);
+        break;
+    case V4L2_PIX_FMT_NV12:
+        m_rows = pick_rows<Nv12Thumb<false> >(m_filter, m_rgb);
+        break;
+    case V4L2_PIX_FMT_NV12M:
+        m_rows = pick_rows<Nv12Thumb<true> >(m_filter, m_rgb);
+        break;
+    case V4L2_PIX_FMT_YUV420:
+        m_rows = pick_rows<Yuv420Thumb>(m_filter, m_rgb);
+        break;
+    case V4L2_PIX_FMT_GREY:
+        m_rows = pick_rows<GreyThumb>(m_filter, m_rgb);
+        break;
+    case V4L2_PIX_FMT_RGB24:
+        m_rows = pick_rows<Rgb24Thumb>(m_filter, m_rgb);
+        break;
+    default:
+        m_rows = NULL;
+        return false;
+    }
+    if(!src_w || !src_h) {
+        return false;
+    }
+
+    out.width = m_width && (m_width < src_w) ? m_width : src_w;
+    out.height = m_height ? m_height : static_cast<uint64_t>(src_h) * out.width / src_w;
+    if(out.height > src_h) {
+        out.height = src_h;
+    }
+    if(!out.height) {
+        out.height = 1;
+    }
+    out.rgb = m_rgb;
+    out.stride = out.width * (m_rgb ? 3 : 1);
+    out.data.resize(static_cast<size_t>(out.stride) * out.height);
+
+    m_x0.resize(out.width);
+    m_x1.resize(out.width);
+    m_wx.resize(out.width);
+    for(ox = 0; ox < out.width; ox++) {
+        if(m_filter == THUMB_BILINEAR) {
+            bilinear_tap(ox, out.width, src_w, m_x0[ox], m_x1[ox], m_wx[ox]);
+        }
+        else {
+            m_x0[ox] = static_cast<uint64_t>(ox) * src_w / out.width;
+            m_x1[ox] = static_cast<uint64_t>(ox + 1) * src_w / out.width;
+            m_wx[ox] = 0;
+        }
+    }
+    return true;
+}
+
+/**
+ * Fill rows first_row to first_row + num_rows - 1 of out, which prepare()
+ * has sized. Bands of the same thumbnail can be made from several threads
+ * at once, each with its own sums.
+ */
+void Thumbnailer::make_rows(const BaseFormat & fmt, const uint8_t * const * planes,
+        unsigned first_row, unsigned num_rows, Thumbnail & out, QualitySums & sums) const
+{
+    if(first_row >= out.height) {
+        return;
+    }
+    if(num_rows > out.height - first_row) {
+        num_rows = out.height - first_row;
+    }
+    m_rows(*this, fmt, planes, first_row, num_rows, out, sums);
+}
+
+/**
+ * Make the thumbnail of a frame
+ *
+ * @param[in] fmt The frame's format
+ * @param[in] planes Start of each plane, only the first is used unless
+ *            the format is multi-planar
+ * @param[in] bytes Bytes in the first plane
+ * @param[out] out The thumbnail
+ * @param[out] qual If not NULL, the thumbnail's luma statistics
+ *
+ * @return false if the format cannot be read or the frame is short
+ */
+bool Thumbnailer::make(const BaseFormat & fmt, const uint8_t * const * planes,
+        unsigned bytes, Thumbnail & out, ImageQuality * qual)
+{
+    if(fmt.compressed() || (bytes < fmt.plane_size(0)) || !prepare(fmt, out)) {
+        return false;
+    }
+    QualitySums sums(qual ? qual->with_histogram : false);
+    make_rows(fmt, planes, 0, out.height, out, sums);
+    if(qual) {
+        sums.finish(*qual);
+    }
+    return true;
+}
@@ -0,0 +1,77 @@
+#ifndef _THUMBNAIL_H_
+#define _THUMBNAIL_H_
+
+#include <vector>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "colour.h"
+
+class BaseFormat;
+struct ImageQuality;
+struct QualitySums;
+
+enum ThumbFilter
+{
+    THUMB_BOX,          /* Average of every source pixel under the output pixel */
+    THUMB_BILINEAR,     /* Four source pixels per output pixel */
+};
+
+/**
+ * A reduced image, one byte per pixel for grey or three for RGB24
+ */
+struct Thumbnail
+{
+    unsigned width;
+    unsigned height;
+    unsigned stride;
+    bool rgb;
+    std::vector<uint8_t> data;
+
+    Thumbnail() : width(0), height(0), stride(0), rgb(false) {};
+};
+
+/**
+ * Makes thumbnails straight from the frame, reading the source with its
+ * own stride and layout and writing only the reduced image, so there is
+ * no full size copy in between. The luma statistics of the thumbnail are
+ * gathered in the same pass. Box filtering keeps the frame's mean, the
+ * spread is that of the averaged image.
+ */
+class Thumbnailer
+{
+public:
+    typedef void (*RowsFn)(const Thumbnailer & thumb, const BaseFormat & fmt,
+            const uint8_t * const * planes, unsigned first_row, unsigned num_rows,
+            Thumbnail & out, QualitySums & sums);
+
+private:
+    unsigned m_width;
+    unsigned m_height;
+    ThumbFilter m_filter;
+    bool m_rgb;
+    YuvCoeffs m_coeffs;
+
+    /* Worked out by prepare() for the source size */
+    RowsFn m_rows;
+    std::vector<unsigned> m_x0;     /* Box: first column, bilinear: left */
+    std::vector<unsigned> m_x1;     /* Box: end column, bilinear: right */
+    std::vector<unsigned> m_wx;     /* Bilinear: weight of right, of 256 */
+
+    template<class Src, bool RGB> friend struct ThumbKernels;
+
+public:
+    Thumbnailer(unsigned width, unsigned height, ThumbFilter filter = THUMB_BOX,
+            bool rgb = false);
+
+    void set_colour(const ColourConverter & conv) {m_coeffs = conv.coeffs();};
+    bool prepare(const BaseFormat & fmt, Thumbnail & out);
+    void make_rows(const BaseFormat & fmt, const uint8_t * const * planes,
+            unsigned first_row, unsigned num_rows, Thumbnail & out,
+            QualitySums & sums) const;
+    bool make(const BaseFormat & fmt, const uint8_t * const * planes, unsigned bytes,
+            Thumbnail & out, ImageQuality * qual = 0);
+};
+
+#endif
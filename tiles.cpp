@@ -0,0 +1,335 @@
+#include "logging.h"
+#include "format.h"
+#include "colour.h"
+#include "thumbnail.h"
+#include "tiles.h"
+
+#define RANGE(next, end) ((static_cast<uint64_t>(end) << 32) | (next))
+#define RANGE_NEXT(range) (static_cast<unsigned>((range) & 0xFFFFFFFF))
+#define RANGE_END(range) (static_cast<unsigned>((range) >> 32))
+
+/**
+ * Start the threads, which wait for run()
+ *
+ * @param[in] num_threads Threads to start, 0 for one per core less the
+ *            caller's
+ */
+TilePool::TilePool(unsigned num_threads) : m_active(0), m_task(0), m_stop(false)
+{
+    unsigned i;
+
+    if(num_threads == 0) {
+        const unsigned cores = std::thread::hardware_concurrency();
+        num_threads = cores > 1 ? cores - 1 : 0;
+    }
+    m_num_workers = num_threads + 1;
+    m_shares = new Share[m_num_workers];
+    m_start = new sem_t[num_threads];
+    sem_init(&m_done, 0, 0);
+    for(i = 0; i < num_threads; i++) {
+        sem_init(&m_start[i], 0, 0);
+    }
+    for(i = 0; i < m_num_workers; i++) {
+        m_shares[i].range.store(0, std::memory_order_relaxed);
+    }
+    for(i = 0; i < num_threads; i++) {
+        m_threads.push_back(std::thread(&TilePool::thread_loop, this, i));
+    }
+    LOG_DEBUG("Tile pool of %u workers", m_num_workers);
+}
+
+TilePool::~TilePool()
+{
+    unsigned i;
+
+    m_stop = true;
+    for(i = 0; i < m_threads.size(); i++) {
+        sem_post(&m_start[i]);
+    }
+    for(i = 0; i < m_threads.size(); i++) {
+        m_threads[i].join();
+        sem_destroy(&m_start[i]);
+    }
+    sem_destroy(&m_done);
+    delete [] m_start;
+    delete [] m_shares;
+}
+
+void TilePool::thread_loop(unsigned worker)
+{
+    for(;;) {
+        while(sem_wait(&m_start[worker]) < 0) {
+        }
+        if(m_stop) {
+            return;
+        }
+        work(worker);
+        if(m_active.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            sem_post(&m_done);
+        }
+    }
+}
+
+/**
+ * Take the next band of our own share
+ */
+bool TilePool::take(unsigned worker, unsigned & band)
+{
+    std::atomic<uint64_t> & range = m_shares[worker].range;
+    uint64_t cur = range.load(std::memory_order_acquire);
+
+    while(RANGE_NEXT(cur) < RANGE_END(cur)) {
+        if(range.compare_exchange_weak(cur, RANGE(RANGE_NEXT(cur) + 1, RANGE_END(cur)),
+                    std::memory_order_acq_rel)) {
+            band = RANGE_NEXT(cur);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Move the back half of another worker's share into our own, which is
+ * empty so nobody else touches it
+ *
+ * @return false if there was nothing left anywhere
+ */
+bool TilePool::steal(unsigned worker)
+{
+    unsigned i;
+
+    for(i = 1; i < m_num_workers; i++) {
+        std::atomic<uint64_t> & victim = m_shares[(worker + i) % m_num_workers].range;
+        uint64_t cur = victim.load(std::memory_order_acquire);
+        while(RANGE_NEXT(cur) < RANGE_END(cur)) {
+            const unsigned next = RANGE_NEXT(cur);
+            const unsigned end = RANGE_END(cur);
+            const unsigned split = end - (end - next + 1) / 2;
+            if(victim.compare_exchange_weak(cur, RANGE(next, split),
+                        std::memory_order_acq_rel)) {
+                m_shares[worker].range.store(RANGE(split, end), std::memory_order_release);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void TilePool::work(unsigned worker)
+{
+    unsigned band;
+
+    do {
+        while(take(worker, band)) {
+            m_task->run(band, worker);
+        }
+    } while(steal(worker));
+}
+
+/**
+ * Run task over bands 0 to num_bands - 1 and wait for all of them. Only
+ * one thread may call this at a time.
+ */
+void TilePool::run(TileTask & task, unsigned num_bands)
+{
+    const unsigned num_threads = m_threads.size();
+    unsigned i;
+
+    if((num_threads == 0) || (num_bands < 2)) {
+        for(i = 0; i < num_bands; i++) {
+            task.run(i, num_threads);
+        }
+        return;
+    }
+    m_task = &task;
+    for(i = 0; i < m_num_workers; i++) {
+        const unsigned first = static_cast<uint64_t>(num_bands) * i / m_num_workers;
+        const unsigned last = static_cast<uint64_t>(num_bands) * (i + 1) / m_num_workers;
+        m_shares[i].range.store(RANGE(first, last), std::memory_order_relaxed);
+    }
+    m_active.store(num_threads, std::memory_order_release);
+    for(i = 0; i < num_threads; i++) {
+        sem_post(&m_start[i]);
+    }
+    work(num_threads);
+    while(sem_wait(&m_done) < 0) {
+    }
+    m_task = 0;
+}
+
+/**
+ * Rows per band, about m_band_bytes of the first plane and always even
+ */
+unsigned TileScheduler::band_rows(const BaseFormat & fmt) const
+{
+    const unsigned bpl = fmt.bytesperline() ? fmt.bytesperline() : fmt.width();
+    unsigned rows = bpl ? m_band_bytes / bpl : fmt.height();
+
+    rows = (rows + 1) & ~1u;
+    return rows < 2 ? 2 : rows;
+}
+
+unsigned TileScheduler::num_bands(const BaseFormat & fmt) const
+{
+    const unsigned rows = band_rows(fmt);
+    return (fmt.height() + rows - 1) / rows;
+}
+
+/**
+ * Measures a band into the worker's own sums
+ */
+class QualityTask : public TileTask
+{
+private:
+    const BaseFormat & m_fmt;
+    const uint8_t * m_data;
+    unsigned m_bytes;
+    unsigned m_band_rows;
+    std::vector<QualitySums> m_sums;
+    std::atomic<bool> m_failed;
+
+public:
+    QualityTask(const BaseFormat & fmt, const uint8_t * data, unsigned bytes,
+            unsigned band_rows, unsigned num_workers, bool histogram)
+        : m_fmt(fmt), m_data(data), m_bytes(bytes), m_band_rows(band_rows),
+          m_sums(num_workers, QualitySums(histogram)), m_failed(false) {};
+
+    virtual void run(unsigned band, unsigned worker)
+    {
+        if(!m_fmt.quality_sums(m_data, m_bytes, band * m_band_rows, m_band_rows,
+                    m_sums[worker])) {
+            m_failed = true;
+        }
+    }
+
+    bool finish(ImageQuality & qual)
+    {
+        unsigned i;
+
+        if(m_failed) {
+            return false;
+        }
+        for(i = 1; i < m_sums.size(); i++) {
+            m_sums[0].merge(m_sums[i]);
+        }
+        m_sums[0].finish(qual);
+        return true;
+    }
+};
+
+/**
+ * As BaseFormat::check_quality, the bands measured in parallel and the
+ * sums merged at the end. The result is the same as measuring the frame
+ * in one go.
+ */
+bool TileScheduler::check_quality(const BaseFormat & fmt, const uint8_t * data,
+        unsigned bytes, ImageQuality & qual)
+{
+    QualityTask task(fmt, data, bytes, band_rows(fmt), m_pool.num_workers(),
+            qual.with_histogram);
+
+    m_pool.run(task, num_bands(fmt));
+    return task.finish(qual);
+}
+
+class ConvertTask : public TileTask
+{
+private:
+    const ColourConverter & m_conv;
+    const BaseFormat & m_fmt;
+    const uint8_t * const * m_planes;
+    unsigned m_bytes;
+    unsigned m_band_rows;
+    uint8_t * m_dst;
+    unsigned m_dst_stride;
+
+public:
+    ConvertTask(const ColourConverter & conv, const BaseFormat & fmt,
+            const uint8_t * const * planes, unsigned bytes, unsigned band_rows,
+            uint8_t * dst, unsigned dst_stride)
+        : m_conv(conv), m_fmt(fmt), m_planes(planes), m_bytes(bytes),
+          m_band_rows(band_rows), m_dst(dst), m_dst_stride(dst_stride) {};
+
+    virtual void run(unsigned band, unsigned)
+    {
+        m_conv.convert_rows(m_fmt, m_planes, m_bytes, band * m_band_rows,
+                m_band_rows, m_dst, m_dst_stride);
+    }
+};
+
+/**
+ * As ColourConverter::convert, the bands converted in parallel
+ */
+bool TileScheduler::convert(const ColourConverter & conv, const BaseFormat & fmt,
+        const uint8_t * const * planes, unsigned bytes, uint8_t * dst,
+        unsigned dst_stride)
+{
+    if(fmt.compressed() || (bytes < fmt.plane_size(0)) || !conv.prepare(fmt)) {
+        return false;
+    }
+    ConvertTask task(conv, fmt, planes, bytes, band_rows(fmt), dst, dst_stride);
+    m_pool.run(task, num_bands(fmt));
+    return true;
+}
+
+/**
+ * Makes a band of thumbnail rows, measuring them into the worker's sums
+ */
+class ThumbnailTask : public TileTask
+{
+private:
+    const Thumbnailer & m_thumb;
+    const BaseFormat & m_fmt;
+    const uint8_t * const * m_planes;
+    unsigned m_band_rows;
+    Thumbnail & m_out;
+    std::vector<QualitySums> m_sums;
+
+public:
+    ThumbnailTask(const Thumbnailer & thumb, const BaseFormat & fmt,
+            const uint8_t * const * planes, unsigned band_rows, Thumbnail & out,
+            unsigned num_workers, bool histogram)
+        : m_thumb(thumb), m_fmt(fmt), m_planes(planes), m_band_rows(band_rows),
+          m_out(out), m_sums(num_workers, QualitySums(histogram)) {};
+
+    virtual void run(unsigned band, unsigned worker)
+    {
+        m_thumb.make_rows(m_fmt, m_planes, band * m_band_rows, m_band_rows, m_out,
+                m_sums[worker]);
+    }
+
+    void finish(ImageQuality & qual)
+    {
+        unsigned i;
+
+        for(i = 1; i < m_sums.size(); i++) {
+            m_sums[0].merge(m_sums[i]);
+        }
+        m_sums[0].finish(qual);
+    }
+};
+
+/**
+ * As Thumbnailer::make, bands of output rows made in parallel. Each band
+ * covers about as much of the source as a band of check_quality.
+ */
+bool TileScheduler::thumbnail(Thumbnailer & thumb, const BaseFormat & fmt,
+        const uint8_t * const * planes, unsigned bytes, Thumbnail & out,
+        ImageQuality * qual)
+{
+    if(fmt.compressed() || (bytes < fmt.plane_size(0)) || !thumb.prepare(fmt, out)) {
+        return false;
+    }
+    const unsigned src_rows = band_rows(fmt);
+    unsigned rows = static_cast<uint64_t>(src_rows) * out.height / fmt.height();
+    if(rows < 1) {
+        rows = 1;
+    }
+    ThumbnailTask task(thumb, fmt, planes, rows, out, m_pool.num_workers(),
+            qual ? qual->with_histogram : false);
+    m_pool.run(task, (out.height + rows - 1) / rows);
+    if(qual) {
+        task.finish(*qual);
+    }
+    return true;
+}
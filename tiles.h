@@ -0,0 +1,105 @@
+#ifndef _TILES_H_
+#define _TILES_H_
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ring.h"
+
+class BaseFormat;
+class ColourConverter;
+class Thumbnailer;
+struct ImageQuality;
+struct Thumbnail;
+
+/* Bytes of source per band, about what fits in a core's L2 with room for
+ * the output */
+#define TILE_BAND_BYTES (128 * 1024)
+
+/**
+ * One piece of work split into numbered bands. run() is called once for
+ * each band, from any thread, and worker says which (0 to
+ * TilePool::num_workers() - 1) so per-worker results need no locking.
+ */
+class TileTask
+{
+public:
+    virtual ~TileTask() {};
+    virtual void run(unsigned band, unsigned worker) = 0;
+};
+
+/**
+ * A persistent pool of threads that share out the bands of one task at a
+ * time. Each worker starts with an even share of the bands and takes them
+ * from the front; a worker that runs out steals the back half of someone
+ * else's share, so uneven bands still finish together. The caller works
+ * too, as the last worker.
+ */
+class TilePool
+{
+private:
+    struct Share
+    {
+        alignas(CACHE_LINE) std::atomic<uint64_t> range;   /* next | end << 32 */
+    };
+
+    std::vector<std::thread> m_threads;
+    Share * m_shares;
+    unsigned m_num_workers;
+    sem_t * m_start;            /* One per thread */
+    sem_t m_done;               /* Posted by the last thread out of a task */
+    std::atomic<unsigned> m_active;
+    TileTask * m_task;
+    bool m_stop;
+
+    TilePool(const TilePool &);
+    TilePool & operator=(const TilePool &);
+
+    void thread_loop(unsigned worker);
+    void work(unsigned worker);
+    bool take(unsigned worker, unsigned & band);
+    bool steal(unsigned worker);
+
+public:
+    TilePool(unsigned num_threads = 0);
+    ~TilePool();
+
+    unsigned num_workers() const {return m_num_workers;};
+    void run(TileTask & task, unsigned num_bands);
+};
+
+/**
+ * Runs the per-frame kernels a band of rows at a time across a TilePool.
+ * Bands are sized to the cache and an even number of rows, so 4:2:0
+ * chroma rows are never split between bands.
+ */
+class TileScheduler
+{
+private:
+    TilePool & m_pool;
+    unsigned m_band_bytes;
+
+public:
+    TileScheduler(TilePool & pool, unsigned band_bytes = TILE_BAND_BYTES)
+        : m_pool(pool), m_band_bytes(band_bytes) {};
+
+    TilePool & pool() const {return m_pool;};
+    unsigned band_rows(const BaseFormat & fmt) const;
+    unsigned num_bands(const BaseFormat & fmt) const;
+
+    bool check_quality(const BaseFormat & fmt, const uint8_t * data, unsigned bytes,
+            ImageQuality & qual);
+    bool convert(const ColourConverter & conv, const BaseFormat & fmt,
+            const uint8_t * const * planes, unsigned bytes, uint8_t * dst,
+            unsigned dst_stride);
+    bool thumbnail(Thumbnailer & thumb, const BaseFormat & fmt,
+            const uint8_t * const * planes, unsigned bytes, Thumbnail & out,
+            ImageQuality * qual = 0);
+};
+
+#endif
@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "logging.h"
+#include "uring.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params * p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+            NULL, 0);
+}
+
+IoUring::IoUring()
+    : m_fd(-1), m_entries(0), m_pending(0), m_sq_ptr(MAP_FAILED), m_sq_len(0),
+      m_cq_ptr(MAP_FAILED), m_cq_len(0), m_sqes(0), m_sqes_len(0)
+{
+}
+
+IoUring::~IoUring()
+{
+    release();
+}
+
+/**
+ * Create the ring and map its queues
+ *
+ * @param[in] entries Submission queue size, the kernel rounds it up to a
+ *            power of two
+ *
+ * @return true on success, false if io_uring is unavailable (old kernel,
+ * or blocked by seccomp) and the caller should fall back to plain I/O
+ */
+bool IoUring::setup(unsigned entries)
+{
+    struct io_uring_params p;
+
+    release();
+    memset(&p, 0, sizeof(p));
+    const int fd = io_uring_setup(entries, &p);
+    if(fd < 0) {
+        LOG_ERRNO_AS_ERROR("io_uring_setup");
+        return false;
+    }
+    m_fd = fd;
+    m_entries = p.sq_entries;
+
+    m_sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(m_cq_len > m_sq_len) {
+            m_sq_len = m_cq_len;
+        }
+        m_cq_len = 0;
+    }
+    m_sq_ptr = mmap(NULL, m_sq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(m_sq_ptr == MAP_FAILED) {
+        LOG_ERRNO_AS_ERROR("Failed to map io_uring SQ");
+        release();
+        return false;
+    }
+    if(m_cq_len) {
+        m_cq_ptr = mmap(NULL, m_cq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if(m_cq_ptr == MAP_FAILED) {
+            LOG_ERRNO_AS_ERROR("Failed to map io_uring CQ");
+            release();
+            return false;
+        }
+    }
+    m_sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    void * sqes = mmap(NULL, m_sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        LOG_ERRNO_AS_ERROR("Failed to map io_uring SQEs");
+        release();
+        return false;
+    }
+    m_sqes = reinterpret_cast<struct io_uring_sqe *>(sqes);
+
+    uint8_t * sq = reinterpret_cast<uint8_t *>(m_sq_ptr);
+    uint8_t * cq = reinterpret_cast<uint8_t *>(m_cq_len ? m_cq_ptr : m_sq_ptr);
+    m_sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    m_cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+    m_pending = 0;
+    return true;
+}
+
+void IoUring::release()
+{
+    if(m_sqes) {
+        munmap(m_sqes, m_sqes_len);
+        m_sqes = 0;
+    }
+    if(m_cq_ptr != MAP_FAILED) {
+        munmap(m_cq_ptr, m_cq_len);
+        m_cq_ptr = MAP_FAILED;
+    }
+    if(m_sq_ptr != MAP_FAILED) {
+        munmap(m_sq_ptr, m_sq_len);
+        m_sq_ptr = MAP_FAILED;
+    }
+    if(m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+/**
+ * Put a write on the submission queue, it is not started until submit()
+ *
+ * @param[in] fd File to write
+ * @param[in] buf Data, must stay valid until the completion is reaped
+ * @param[in] len Bytes to write
+ * @param[in] offset File offset
+ * @param[in] user_data Returned with the completion
+ *
+ * @return false if the submission queue is full
+ */
+bool IoUring::prep_write(int fd, const void * buf, size_t len, uint64_t offset,
+        uint64_t user_data)
+{
+    const unsigned tail = *m_sq_tail;
+    if(tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_entries) {
+        return false;
+    }
+    const unsigned idx = tail & m_sq_mask;
+    struct io_uring_sqe * sqe = &m_sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(buf);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    m_sq_array[idx] = idx;
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    m_pending++;
+    return true;
+}
+
+/**
+ * Hand prepared entries to the kernel
+ *
+ * @param[in] wait_nr Block until at least this many completions are ready
+ *
+ * @return Number submitted, or -1 on error
+ */
+int IoUring::submit(unsigned wait_nr)
+{
+    const unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    do {
+        ret = io_uring_enter(m_fd, m_pending, wait_nr, flags);
+    } while((ret < 0) && (errno == EINTR));
+    if(ret < 0) {
+        LOG_ERRNO_AS_ERROR("io_uring_enter");
+        return -1;
+    }
+    m_pending -= ret;
+    return ret;
+}
+
+/**
+ * Take back the entries prepared since the last submit() that the kernel
+ * has not taken, so a caller whose submit failed can do the work another
+ * way without a later submit() starting it again. The kernel only reads
+ * the queue inside io_uring_enter, so these are still ours.
+ */
+void IoUring::unprep()
+{
+    __atomic_store_n(m_sq_tail, *m_sq_tail - m_pending, __ATOMIC_RELEASE);
+    m_pending = 0;
+}
+
+/**
+ * Take one completion if there is one, never blocks
+ *
+ * @param[out] user_data As given to prep_write
+ * @param[out] res Bytes written, or -errno
+ *
+ * @return true if a completion was taken
+ */
+bool IoUring::peek(uint64_t & user_data, int & res)
+{
+    const unsigned head = *m_cq_head;
+    if(head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    const struct io_uring_cqe * cqe = &m_cqes[head & m_cq_mask];
+    user_data = cqe->user_data;
+    res = cqe->res;
+    __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
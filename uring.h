@@ -0,0 +1,54 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * Minimal io_uring wrapper using the raw syscalls, enough to queue writes
+ * and reap their completions without pulling in liburing. Not thread safe,
+ * one thread submits and reaps.
+ */
+class IoUring
+{
+private:
+    int m_fd;
+    unsigned m_entries;
+    unsigned m_pending;
+
+    void * m_sq_ptr;
+    size_t m_sq_len;
+    void * m_cq_ptr;
+    size_t m_cq_len;
+    struct io_uring_sqe * m_sqes;
+    size_t m_sqes_len;
+
+    unsigned * m_sq_head;
+    unsigned * m_sq_tail;
+    unsigned m_sq_mask;
+    unsigned * m_sq_array;
+    unsigned * m_cq_head;
+    unsigned * m_cq_tail;
+    unsigned m_cq_mask;
+    struct io_uring_cqe * m_cqes;
+
+public:
+    IoUring();
+    ~IoUring();
+
+    bool setup(unsigned entries);
+    void release();
+    bool ok() const {return m_fd >= 0;};
+
+    bool prep_write(int fd, const void * buf, size_t len, uint64_t offset,
+            uint64_t user_data);
+    int submit(unsigned wait_nr = 0);
+    void unprep();
+    bool peek(uint64_t & user_data, int & res);
+};
+
+#endif